@@ -0,0 +1,189 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstddef>
+#include <vector>
+#include <new>
+#include <utility>
+#include <algorithm>
+
+namespace mt {
+
+	struct ArenaStats {
+		size_t n_slabs;
+		size_t n_nodes;          // nodes currently allocated
+		size_t n_free;           // freed nodes waiting for reuse
+		size_t bytes_reserved;   // total slab memory
+		size_t bytes_in_use;     // memory held by allocated nodes
+		size_t bytes_overhead;   // the pool's own list of slabs
+
+		ArenaStats():n_slabs(0),n_nodes(0),n_free(0),bytes_reserved(0),bytes_in_use(0),bytes_overhead(0){}
+
+		ArenaStats& operator+=(const ArenaStats &other){
+			n_slabs += other.n_slabs;
+			n_nodes += other.n_nodes;
+			n_free += other.n_free;
+			bytes_reserved += other.bytes_reserved;
+			bytes_in_use += other.bytes_in_use;
+			bytes_overhead += other.bytes_overhead;
+			return *this;
+		}
+	};
+
+	/**
+	 * pool of fixed-size nodes carved out of geometrically growing slabs
+	 * every node holds n_slots routes or entries, taking N::Bytes(n_slots)
+	 * freed nodes are reused first; Release() drops every slab at once
+	 * without running destructors
+	 **/
+	template<typename N>
+	class NodePool {
+	private:
+
+		static constexpr size_t MIN_SLAB = 8;           // nodes in first slab
+		static constexpr size_t MAX_SLAB_BYTES = 1<<20; // slab size limit once grown
+
+		struct FreeNode {
+			FreeNode *next;
+		};
+
+		int n_slots;
+		size_t node_bytes;   // N::Bytes(n_slots), rounded up to keep nodes aligned
+
+		std::vector<std::pair<unsigned char*,size_t>> slabs;
+		unsigned char *cursor;
+		unsigned char *limit;
+		FreeNode *free_list;
+
+		size_t n_nodes;
+		size_t n_free;
+		size_t n_bytes;
+
+		void grow();
+
+	public:
+
+		explicit NodePool(const int n_slots)
+			:cursor(NULL),limit(NULL),free_list(NULL),n_nodes(0),n_free(0),n_bytes(0){
+			Reset(n_slots);
+		}
+		~NodePool(){
+			Release();
+		}
+
+		NodePool(const NodePool&) = delete;
+		NodePool& operator=(const NodePool&) = delete;
+
+		// node constructed as N(n_slots, args...)
+		template<typename... Args>
+		N* New(Args&&... args);
+
+		void Delete(N *node);
+
+		void Release();
+
+		// Release, then give nodes allocated from now on n_slots slots
+		void Reset(const int n_slots);
+
+		int slots()const{ return n_slots; }
+
+		const ArenaStats stats()const;
+	};
+}
+
+template<typename N>
+void mt::NodePool<N>::grow(){
+	size_t n = MIN_SLAB;
+	if (!slabs.empty()){
+		n = std::max(slabs.back().second * 2, (size_t)1);
+		if (n*node_bytes > MAX_SLAB_BYTES)
+			n = std::max(MAX_SLAB_BYTES/node_bytes, slabs.back().second);
+	}
+
+	unsigned char *slab = (unsigned char*)::operator new(n*node_bytes, std::align_val_t(alignof(N)));
+	slabs.push_back({ slab, n });
+	n_bytes += n*node_bytes;
+	cursor = slab;
+	limit = slab + n*node_bytes;
+}
+
+template<typename N>
+template<typename... Args>
+N* mt::NodePool<N>::New(Args&&... args){
+	void *block;
+	if (free_list != NULL){
+		block = free_list;
+		free_list = free_list->next;
+		n_free--;
+	} else {
+		if (cursor == limit)
+			grow();
+		block = cursor;
+		cursor += node_bytes;
+	}
+	n_nodes++;
+	return new (block) N(n_slots, std::forward<Args>(args)...);
+}
+
+template<typename N>
+void mt::NodePool<N>::Delete(N *node){
+	node->~N();
+	FreeNode *f = (FreeNode*)node;
+	f->next = free_list;
+	free_list = f;
+	n_nodes--;
+	n_free++;
+}
+
+template<typename N>
+void mt::NodePool<N>::Release(){
+	for (auto &slab : slabs){
+		::operator delete(slab.first, std::align_val_t(alignof(N)));
+	}
+	slabs.clear();
+	cursor = limit = NULL;
+	free_list = NULL;
+	n_nodes = n_free = n_bytes = 0;
+}
+
+template<typename N>
+void mt::NodePool<N>::Reset(const int n_slots){
+	Release();
+	this->n_slots = n_slots;
+	node_bytes = std::max(N::Bytes(n_slots), sizeof(FreeNode));
+	node_bytes = (node_bytes + alignof(N) - 1)/alignof(N)*alignof(N);
+}
+
+template<typename N>
+const mt::ArenaStats mt::NodePool<N>::stats()const{
+	ArenaStats s;
+	s.n_slabs = slabs.size();
+	s.n_nodes = n_nodes;
+	s.n_free = n_free;
+	s.bytes_reserved = n_bytes;
+	s.bytes_in_use = n_nodes*node_bytes;
+	s.bytes_overhead = slabs.capacity()*sizeof(slabs[0]);
+	return s;
+}
+
+#endif /* _ARENA_H */
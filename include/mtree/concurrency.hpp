@@ -0,0 +1,191 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _CONCURRENCY_H
+#define _CONCURRENCY_H
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <utility>
+
+namespace mt {
+
+	/**
+	 * reader-writer spin latch, one int wide so it can sit in every node
+	 * state: -1 exclusive, 0 free, n > 0 shared by n readers
+	 **/
+	class RWLatch {
+	private:
+
+		std::atomic<int> state;
+
+	public:
+
+		RWLatch():state(0){}
+
+		void lock_shared();
+
+		void unlock_shared();
+
+		void lock();
+
+		void unlock();
+	};
+
+	/**
+	 * epoch-based reclamation of nodes unlinked from the tree while readers may still hold them
+	 * readers enter an epoch for the length of a query; the (single) writer retires nodes and
+	 * frees them once every reader that could have reached them has left
+	 **/
+	class EpochManager {
+	private:
+
+		typedef void (*deleter_t)(void *owner, void *node);
+
+		struct Retired {
+			void *node;
+			void *owner;
+			deleter_t deleter;
+		};
+
+		std::atomic<unsigned long> epoch;
+		std::atomic<long> readers[2];
+
+		std::vector<Retired> retired;   // retired in current epoch
+		std::vector<Retired> limbo;     // retired in previous epoch
+
+		void release(std::vector<Retired> &nodes);
+
+	public:
+
+		class Guard {
+		private:
+			EpochManager &m;
+			int slot;
+		public:
+			Guard(EpochManager &m);
+			~Guard();
+		};
+
+		EpochManager():epoch(0){
+			readers[0] = 0;
+			readers[1] = 0;
+		}
+
+		~EpochManager();
+
+		// writer only: hand over node unlinked from the tree, later freed by deleter(owner, node)
+		void Retire(void *node, void *owner, deleter_t deleter);
+
+		// writer only: free nodes no reader can still reach; never blocks
+		void Reclaim();
+
+		// writer only: wait out all readers and free everything retired
+		void Drain();
+
+		const size_t pending()const;
+	};
+}
+
+inline void mt::RWLatch::lock_shared(){
+	while (true){
+		int s = state.load(std::memory_order_relaxed);
+		if (s >= 0 && state.compare_exchange_weak(s, s+1, std::memory_order_acquire))
+			return;
+		std::this_thread::yield();
+	}
+}
+
+inline void mt::RWLatch::unlock_shared(){
+	state.fetch_sub(1, std::memory_order_release);
+}
+
+inline void mt::RWLatch::lock(){
+	while (true){
+		int s = 0;
+		if (state.compare_exchange_weak(s, -1, std::memory_order_acquire))
+			return;
+		std::this_thread::yield();
+	}
+}
+
+inline void mt::RWLatch::unlock(){
+	state.store(0, std::memory_order_release);
+}
+
+inline mt::EpochManager::Guard::Guard(EpochManager &m):m(m){
+	while (true){
+		unsigned long e = m.epoch.load();
+		slot = e & 1;
+		m.readers[slot]++;
+		if (m.epoch.load() == e)
+			break;
+		m.readers[slot]--;
+	}
+}
+
+inline mt::EpochManager::Guard::~Guard(){
+	m.readers[slot]--;
+}
+
+inline mt::EpochManager::~EpochManager(){
+	release(limbo);
+	release(retired);
+}
+
+inline void mt::EpochManager::release(std::vector<Retired> &nodes){
+	for (auto &n : nodes){
+		n.deleter(n.owner, n.node);
+	}
+	nodes.clear();
+}
+
+inline void mt::EpochManager::Retire(void *node, void *owner, deleter_t deleter){
+	retired.push_back({ node, owner, deleter });
+}
+
+inline void mt::EpochManager::Reclaim(){
+	unsigned long e = epoch.load();
+
+	// readers that started before the last epoch advance may still hold limbo nodes
+	if (readers[(e-1) & 1].load() != 0)
+		return;
+	release(limbo);
+
+	if (retired.empty())
+		return;
+	limbo.swap(retired);
+	epoch.store(e+1);
+}
+
+inline void mt::EpochManager::Drain(){
+	while (readers[0].load() != 0 || readers[1].load() != 0){
+		std::this_thread::yield();
+	}
+	release(limbo);
+	release(retired);
+}
+
+inline const size_t mt::EpochManager::pending()const{
+	return retired.size() + limbo.size();
+}
+
+#endif /* _CONCURRENCY_H */
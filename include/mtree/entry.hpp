@@ -21,9 +21,83 @@
 #ifndef _ENTRY_H
 #define _ENTRY_H
 #include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "mtree/stats.hpp"
 
 namespace mt {
 
+	/**
+	 * optional batch distance on key type T:
+	 *     static void distance_many(const T &query, const T *const keys[], const int n, double out[]);
+	 * filling out[i] with the distance from query to *keys[i]. It must agree with T::distance.
+	 **/
+	template<typename T, typename = void>
+	struct has_distance_many : std::false_type {};
+
+	template<typename T>
+	struct has_distance_many<T, std::void_t<decltype(T::distance_many(std::declval<const T&>(),
+																	   std::declval<const T* const*>(), 0,
+																	   std::declval<double*>()))>> : std::true_type {};
+
+	// distances from query to n keys, batched when T supports it
+	template<typename T>
+	inline void distance_many(const T &query, const T *const keys[], const int n, double out[]){
+		if (n == 0)
+			return;
+		if constexpr (has_distance_many<T>::value){
+			T::distance_many(query, keys, n, out);
+		} else {
+			for (int i=0;i < n;i++){
+				out[i] = keys[i]->distance(query);
+			}
+		}
+	}
+
+	/**
+	 * optional heap accounting on key type T:
+	 *     size_t heap_bytes()const;
+	 * returning the bytes a key owns outside itself, such as a std::vector's buffer.
+	 * Stats() and memory_usage() add it up over every stored key.
+	 **/
+	template<typename T, typename = void>
+	struct has_heap_bytes : std::false_type {};
+
+	template<typename T>
+	struct has_heap_bytes<T, std::void_t<decltype(std::declval<const T&>().heap_bytes())>> : std::true_type {};
+
+	template<typename T>
+	inline size_t heap_bytes(const T &key){
+		if constexpr (has_heap_bytes<T>::value){
+			return key.heap_bytes();
+		} else {
+			return 0;
+		}
+	}
+
+	/**
+	 * optional lower bound on key type T:
+	 *     double distance_bound(const T &query)const;
+	 * at most distance(query) and cheaper to take, e.g. from a compressed copy of the key.
+	 * leaves and routes whose bound already exceeds the query radius are skipped.
+	 **/
+	template<typename T, typename = void>
+	struct has_distance_bound : std::false_type {};
+
+	template<typename T>
+	struct has_distance_bound<T, std::void_t<decltype(std::declval<const T&>().distance_bound(std::declval<const T&>()))>>
+		: std::true_type {};
+
+	template<typename T>
+	inline double distance_bound(const T &query, const T &key){
+		if constexpr (has_distance_bound<T>::value){
+			return key.distance_bound(query);
+		} else {
+			return 0;
+		}
+	}
+
 	template<typename T>
 	struct  Entry {
 		long long id;
@@ -41,14 +115,89 @@ namespace mt {
 		}
 	};
 
+	template<typename T>
+	struct NNEntry {
+		long long id;
+		T key;
+		double dist;
+		NNEntry(){}
+		NNEntry(const long long id, const T key, const double dist):id(id),key(key),dist(dist){}
+		NNEntry(const NNEntry<T> &other){
+			id = other.id;
+			key = other.key;
+			dist = other.dist;
+		}
+		const NNEntry<T>& operator=(const NNEntry<T> &other){
+			id = other.id;
+			key = other.key;
+			dist = other.dist;
+			return *this;
+		}
+		bool operator<(const NNEntry<T> &other)const{
+			return (dist < other.dist);
+		}
+	};
+
+	// k-NN candidate pointing at its key inside a leaf instead of holding a copy
+	template<typename T>
+	struct NNRef {
+		long long id;
+		const T *key;
+		double dist;
+		NNRef(){}
+		NNRef(const long long id, const T &key, const double dist):id(id),key(&key),dist(dist){}
+		bool operator<(const NNRef<T> &other)const{
+			return (dist < other.dist);
+		}
+	};
+
+	struct IdDist {
+		long long id;
+		double dist;
+	};
+
+	/**
+	 * visitors for the callback forms of MTree::RangeQuery and MTree::KNNQuery
+	 * that keep only ids, or ids and distances, appending to a caller owned vector
+	 **/
+	class CollectIds {
+	private:
+		std::vector<long long> &ids;
+	public:
+		CollectIds(std::vector<long long> &ids):ids(ids){}
+		template<typename T>
+		void operator()(const long long id, const T &key, const double dist){
+			ids.push_back(id);
+		}
+	};
+
+	class CollectIdDists {
+	private:
+		std::vector<IdDist> &results;
+	public:
+		CollectIdDists(std::vector<IdDist> &results):results(results){}
+		template<typename T>
+		void operator()(const long long id, const T &key, const double dist){
+			results.push_back({ id, dist });
+		}
+	};
+
+	// pivot distance bounds for a route, empty unless T is Pivoted (see pivots.hpp)
+	template<typename T>
+	struct PivotRing {
+		void Reset(){}
+		void Extend(const T &key){}
+		void Extend(const PivotRing &other){}
+	};
+
 	template<typename T>
 	struct RoutingObject {
-		static unsigned long n_build_ops;
 		long long id;
 		T key;
 		void *subtree;
 		double cover_radius;
 		double d;
+		[[no_unique_address]] PivotRing<T> ring;
 		RoutingObject():id(0),subtree(NULL){}
 		RoutingObject(const long long id, const T key):id(id),key(key),subtree(0),cover_radius(0),d(0){}
 		RoutingObject(const RoutingObject &other){
@@ -57,6 +206,7 @@ namespace mt {
 			subtree = other.subtree;
 			cover_radius = other.cover_radius;
 			d = other.d;
+			ring = other.ring;
 		}
 		const RoutingObject& operator=(const RoutingObject &other){
 			id = other.id;
@@ -64,20 +214,22 @@ namespace mt {
 			subtree = other.subtree;
 			cover_radius = other.cover_radius;
 			d = other.d;
+			ring = other.ring;
 			return *this;
 		}
+		// counted as a build operation
 		const double distance(const T &other)const{
-			RoutingObject<T>::n_build_ops++;
+			BuildCounter::Add(1);
 			return key.distance(other);
 		}
 	};
 
 	template<typename T>
 	struct DBEntry {
-		static unsigned long n_query_ops;
 		long long id;
 		T key;
 		double d;
+		DBEntry(){}
 		DBEntry(const long long id, const T key, const double d):id(id),key(key),d(d){}
 		DBEntry(const DBEntry &other){
 			id = other.id;
@@ -91,16 +243,9 @@ namespace mt {
 			return *this;
 		}
 		const double distance(const T &other)const{
-			DBEntry<T>::n_query_ops++;
 			return key.distance(other);
 		}
 	};
 }
 
-template<typename T>
-unsigned long mt::RoutingObject<T>::n_build_ops = 0;
-
-template<typename T>
-unsigned long mt::DBEntry<T>::n_query_ops = 0;
-
 #endif /* _ENTRY_H */
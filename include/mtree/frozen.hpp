@@ -0,0 +1,716 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _FROZEN_H
+#define _FROZEN_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mtree/mnode.hpp"
+
+namespace mt {
+
+	// keys a FrozenMTree can Save and Map, used in place from the file: trivially copyable
+	// ones; specialize to true for a key that only holds plain values, as for Serializer
+	template<typename T>
+	struct is_mappable : std::is_trivially_copyable<T> {};
+
+	template<typename K, int P>
+	struct is_mappable<Pivoted<K,P>> : is_mappable<K> {};
+
+	// quantized keys point at their exact keys
+	template<typename K, int DIM, typename CODE>
+	struct is_mappable<Quantized<K,DIM,CODE>> : std::false_type {};
+
+	// madvise hints for a mapped FrozenMTree: ADVISE_HOT_ROUTES reads the nodes and routes
+	// ahead, which every query walks, and marks the leaves random, which few queries share
+	enum MapAdvice { ADVISE_NORMAL, ADVISE_RANDOM, ADVISE_SEQUENTIAL, ADVISE_WILLNEED, ADVISE_HOT_ROUTES };
+
+	/**
+	 * layout of a FrozenMTree's block, at its start: counts, then the byte offset of
+	 * each array from the start of the block
+	 **/
+	struct FrozenHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t key_size;
+		uint32_t nroutes;
+		uint32_t leafcap;
+		uint32_t n_pivots;         // 0 until a pivoted tree has chosen its pivots
+		uint32_t height;
+		uint64_t n_nodes;
+		uint64_t n_routes;
+		uint64_t n_entries;
+		uint64_t nodes;
+		uint64_t routes;
+		uint64_t route_keys;
+		uint64_t rings;            // pivoted keys only
+		uint64_t ids;
+		uint64_t ds;
+		uint64_t keys;
+		uint64_t pivots;
+		uint64_t exact;            // exact keys of quantized keys, for routes, entries, then pivots
+		uint64_t bytes;            // the whole block
+	};
+
+	/**
+	 * read-only M-tree in one block of memory, made by MTree::Freeze
+	 * nodes are numbered breadth first and refer to their children by number, so the
+	 * routes of a node, the entries of a leaf and the leaves under one parent sit side by
+	 * side.  there are no parent pointers, latches or spare slots: each array holds
+	 * exactly what the tree held.  queries answer as on the tree it was frozen from
+	 **/
+	template<typename T, int NROUTES=4, int LEAFCAP=50>
+	class FrozenMTree {
+	private:
+
+		static_assert(LEAFCAP <= UINT16_MAX && NROUTES <= UINT16_MAX, "node capacities must fit 16 bits");
+
+		// first route or entry of the node, and how many
+		struct Node {
+			uint32_t first;
+			uint16_t count;
+			uint16_t leaf;
+		};
+
+		struct Route {
+			double d;
+			double cover_radius;
+			uint32_t child;
+		};
+
+		struct Ref {
+			uint32_t node;
+			double d;
+			double dmin;
+			bool operator>(const Ref &other)const{
+				return (dmin > other.dmin);
+			}
+		};
+
+		char *m_base;
+		size_t m_mapped;    // bytes mapped from a file, 0 for a block on the heap
+		const FrozenHeader *m_header;
+		const Node *m_nodes;
+		const Route *m_routes;
+		const T *m_route_keys;
+		const PivotRing<T> *m_rings;
+		const long long *m_ids;
+		const double *m_ds;
+		const T *m_keys;
+		const T *m_pivots;
+
+		// exact keys of quantized keys, one for each route, entry and pivot key; see ExactStore
+		typedef typename exact_key<T>::type exact_type;
+
+		static uint64_t n_exact(const FrozenHeader &header){
+			return has_exact_key<T>::value ? header.n_routes + header.n_entries + header.n_pivots : 0;
+		}
+
+		// point the arrays into the block at m_base
+		void attach();
+
+		void release();
+
+		// madvise over bytes [from, to) of the mapping, widened to whole pages
+		void advise(const uint64_t from, const uint64_t to, const int advice)const;
+
+		// as MTree::with_pivots, from the frozen pivots
+		const T& with_pivots(const T &key, std::optional<T> &buffer, unsigned long &n_distances)const;
+
+		// as MInternal::SelectRoutes
+		template<typename Queue>
+		void select_routes(const Node &node, const T &query, const double d, const double radius,
+						   Queue &nodes, QueryStats &stats)const;
+
+	public:
+
+		FrozenMTree():m_base(NULL),m_mapped(0),m_header(NULL){}
+
+		// copy of the tree under top, with n_pivots pivots; see MTree::Freeze
+		FrozenMTree(const MNode<T,NROUTES,LEAFCAP> *top, const T *pivots, const int n_pivots);
+
+		FrozenMTree(FrozenMTree &&other);
+		FrozenMTree& operator=(FrozenMTree &&other);
+
+		FrozenMTree(const FrozenMTree&) = delete;
+		FrozenMTree& operator=(const FrozenMTree&) = delete;
+
+		~FrozenMTree(){
+			release();
+		}
+
+		static constexpr uint32_t VERSION = 2;
+
+		// write the block to file at path as it is, for Map; keys are written bytewise and
+		// must be is_mappable. throws std::runtime_error on i/o failure
+		void Save(const std::string &path)const;
+
+		// replace contents with the block in file at path, mapped read-only and shared:
+		// only nodes and routes are read, to check them, until a query touches the rest, and
+		// processes mapping one file share its pages in the page cache. throws
+		// std::runtime_error if the file cannot be mapped, was not saved by a FrozenMTree of
+		// this key size and capacities, or is corrupt, leaving it empty
+		void Map(const std::string &path, const MapAdvice advice = ADVISE_NORMAL);
+
+		// hint the kernel how the mapping will be read; no effect on a block on the heap
+		void Advise(const MapAdvice advice)const;
+
+		bool mapped()const{
+			return m_mapped > 0;
+		}
+
+		const std::vector<Entry<T>> RangeQuery(const T &query, const double radius, QueryStats *stats = NULL)const;
+
+		// as MTree::RangeQuery; keys refer into the block and stay valid as long as it does
+		template<typename Visitor>
+		void RangeQuery(const T &query, const double radius, Visitor &&visit, QueryStats *stats = NULL)const;
+
+		const std::vector<NNEntry<T>> KNNQuery(const T &query, const int k, QueryStats *stats = NULL)const;
+
+		template<typename Visitor>
+		void KNNQuery(const T &query, const int k, Visitor &&visit, QueryStats *stats = NULL)const;
+
+		const size_t size()const{
+			return m_header ? m_header->n_entries : 0;
+		}
+
+		// levels of nodes, 0 when empty
+		int height()const{
+			return m_header ? m_header->height : 0;
+		}
+
+		// the block, plus heap memory owned by its keys
+		const size_t memory_usage()const;
+	};
+}
+
+/**
+ *  FrozenMTree implementation code
+ *
+ **/
+template<typename T, int NROUTES, int LEAFCAP>
+mt::FrozenMTree<T,NROUTES,LEAFCAP>::FrozenMTree(const MNode<T,NROUTES,LEAFCAP> *top, const T *pivots, const int n_pivots)
+	:m_base(NULL),m_mapped(0),m_header(NULL){
+	// number the nodes breadth first; children follow in route order, so the children of
+	// the i-th internal node take the next numbers in turn
+	std::vector<const MNode<T,NROUTES,LEAFCAP>*> order;
+	std::vector<uint32_t> depth;
+	size_t n_routes = 0, n_entries = 0;
+	if (top != NULL){
+		order.push_back(top);
+		depth.push_back(1);
+	}
+	for (size_t i=0;i < order.size();i++){
+		if (order[i]->isleaf()){
+			n_entries += order[i]->size();
+			continue;
+		}
+		const MInternal<T,NROUTES,LEAFCAP> *internal = (const MInternal<T,NROUTES,LEAFCAP>*)order[i];
+		for (int r=0;r < internal->capacity();r++){
+			if (internal->GetChildNode(r) != NULL){
+				order.push_back(internal->GetChildNode(r));
+				depth.push_back(depth[i] + 1);
+				n_routes++;
+			}
+		}
+	}
+
+	// one block, each array aligned to a cache line
+	auto place = [](uint64_t &offset, const size_t bytes){
+		const uint64_t at = (offset + 63) & ~(uint64_t)63;
+		offset = at + bytes;
+		return at;
+	};
+	static_assert(alignof(T) <= 64, "key alignment above a cache line");
+	FrozenHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "MTFROZEN", 8);
+	header.version = VERSION;
+	header.key_size = sizeof(T);
+	header.nroutes = NROUTES;
+	header.leafcap = LEAFCAP;
+	header.n_pivots = n_pivots;
+	header.height = depth.empty() ? 0 : depth.back();
+	header.n_nodes = order.size();
+	header.n_routes = n_routes;
+	header.n_entries = n_entries;
+	uint64_t offset = sizeof(FrozenHeader);
+	header.nodes = place(offset, order.size()*sizeof(Node));
+	header.routes = place(offset, n_routes*sizeof(Route));
+	header.route_keys = place(offset, n_routes*sizeof(T));
+	header.rings = place(offset, is_pivoted<T>::value ? n_routes*sizeof(PivotRing<T>) : 0);
+	header.ids = place(offset, n_entries*sizeof(long long));
+	header.ds = place(offset, n_entries*sizeof(double));
+	header.keys = place(offset, n_entries*sizeof(T));
+	header.pivots = place(offset, n_pivots*sizeof(T));
+	header.exact = place(offset, n_exact(header)*sizeof(exact_type));
+	header.bytes = (offset + 63) & ~(uint64_t)63;
+
+	m_base = (char*)std::aligned_alloc(64, header.bytes);
+	if (m_base == NULL)
+		throw std::bad_alloc();
+	std::memset(m_base, 0, header.bytes);
+	std::memcpy(m_base, &header, sizeof(header));
+	attach();
+
+	Node *nodes = (Node*)m_nodes;
+	Route *routes = (Route*)m_routes;
+	T *route_keys = (T*)m_route_keys;
+	PivotRing<T> *rings = (PivotRing<T>*)m_rings;
+	long long *ids = (long long*)m_ids;
+	double *ds = (double*)m_ds;
+	T *keys = (T*)m_keys;
+	T *frozen_pivots = (T*)m_pivots;
+
+	// quantized keys take copies of their exact keys into the block, so it needs no tree
+	exact_type *exact = (exact_type*)(m_base + header.exact);
+	uint32_t next_exact = 0;
+	auto own_exact = [&](T &key){
+		if constexpr (has_exact_key<T>::value){
+			auto &q = quantized_part(key);
+			new (&exact[next_exact]) exact_type(*q.exact);
+			q.slot = next_exact;
+			q.exact = &exact[next_exact++];
+		}
+	};
+
+	uint32_t next_route = 0, next_entry = 0, next_child = 1;
+	std::vector<DBEntry<T>> entries;
+	for (size_t i=0;i < order.size();i++){
+		Node &node = nodes[i];
+		node.leaf = order[i]->isleaf();
+		if (node.leaf){
+			entries.clear();
+			((const MLeaf<T,NROUTES,LEAFCAP>*)order[i])->GetEntries(entries);
+			node.first = next_entry;
+			node.count = entries.size();
+			for (auto &e : entries){
+				ids[next_entry] = e.id;
+				ds[next_entry] = e.d;
+				new (&keys[next_entry]) T(e.key);
+				own_exact(keys[next_entry]);
+				next_entry++;
+			}
+		} else {
+			const MInternal<T,NROUTES,LEAFCAP> *internal = (const MInternal<T,NROUTES,LEAFCAP>*)order[i];
+			node.first = next_route;
+			node.count = internal->size();
+			for (int r=0;r < internal->capacity();r++){
+				if (internal->GetChildNode(r) == NULL)
+					continue;
+				const RoutingObject<T> &route = internal->Route(r);
+				routes[next_route].d = route.d;
+				routes[next_route].cover_radius = route.cover_radius;
+				routes[next_route].child = next_child++;
+				new (&route_keys[next_route]) T(route.key);
+				own_exact(route_keys[next_route]);
+				if constexpr (is_pivoted<T>::value)
+					rings[next_route] = route.ring;
+				next_route++;
+			}
+		}
+	}
+	for (int p=0;p < n_pivots;p++){
+		new (&frozen_pivots[p]) T(pivots[p]);
+		own_exact(frozen_pivots[p]);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+mt::FrozenMTree<T,NROUTES,LEAFCAP>::FrozenMTree(FrozenMTree &&other)
+	:m_base(NULL),m_mapped(0),m_header(NULL){
+	*this = std::move(other);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+mt::FrozenMTree<T,NROUTES,LEAFCAP>& mt::FrozenMTree<T,NROUTES,LEAFCAP>::operator=(FrozenMTree &&other){
+	if (this != &other){
+		release();
+		m_base = other.m_base;
+		m_mapped = other.m_mapped;
+		other.m_base = NULL;
+		other.m_mapped = 0;
+		other.m_header = NULL;
+		if (m_base != NULL)
+			attach();
+	}
+	return *this;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::attach(){
+	m_header = (const FrozenHeader*)m_base;
+	m_nodes = (const Node*)(m_base + m_header->nodes);
+	m_routes = (const Route*)(m_base + m_header->routes);
+	m_route_keys = (const T*)(m_base + m_header->route_keys);
+	m_rings = (const PivotRing<T>*)(m_base + m_header->rings);
+	m_ids = (const long long*)(m_base + m_header->ids);
+	m_ds = (const double*)(m_base + m_header->ds);
+	m_keys = (const T*)(m_base + m_header->keys);
+	m_pivots = (const T*)(m_base + m_header->pivots);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::release(){
+	if (m_base == NULL)
+		return;
+	if (m_mapped > 0){
+		munmap(m_base, m_mapped);
+	} else {
+		if constexpr (!std::is_trivially_destructible<T>::value){
+			for (uint64_t i=0;i < m_header->n_routes;i++) m_route_keys[i].~T();
+			for (uint64_t i=0;i < m_header->n_entries;i++) m_keys[i].~T();
+			for (uint32_t i=0;i < m_header->n_pivots;i++) m_pivots[i].~T();
+		}
+		if constexpr (!std::is_trivially_destructible<exact_type>::value){
+			const exact_type *exact = (const exact_type*)(m_base + m_header->exact);
+			for (uint64_t i=0;i < n_exact(*m_header);i++) exact[i].~exact_type();
+		}
+		std::free(m_base);
+	}
+	m_base = NULL;
+	m_mapped = 0;
+	m_header = NULL;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::Save(const std::string &path)const{
+	static_assert(is_mappable<T>::value, "specialize mt::is_mappable for keys that are not trivially copyable");
+	const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("unable to open " + path + " for writing");
+
+	FrozenHeader empty;
+	std::memset(&empty, 0, sizeof(empty));
+	std::memcpy(empty.magic, "MTFROZEN", 8);
+	empty.version = VERSION;
+	empty.key_size = sizeof(T);
+	empty.nroutes = NROUTES;
+	empty.leafcap = LEAFCAP;
+	empty.bytes = sizeof(empty);
+	const char *data = (m_header != NULL) ? m_base : (const char*)&empty;
+	const size_t bytes = (m_header != NULL) ? m_header->bytes : sizeof(empty);
+
+	size_t written = 0;
+	while (written < bytes){
+		const ssize_t n = write(fd, data + written, bytes - written);
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	if (close(fd) != 0 || written < bytes)
+		throw std::runtime_error("error writing " + path);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::Map(const std::string &path, const MapAdvice advice){
+	static_assert(is_mappable<T>::value, "specialize mt::is_mappable for keys that are not trivially copyable");
+	release();
+
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("unable to open " + path + " for reading");
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FrozenHeader)){
+		close(fd);
+		throw std::runtime_error(path + " is not a frozen mtree file");
+	}
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		throw std::runtime_error("unable to map " + path);
+
+	const FrozenHeader *header = (const FrozenHeader*)base;
+	std::string error;
+	if (std::memcmp(header->magic, "MTFROZEN", 8) != 0){
+		error = " is not a frozen mtree file";
+	} else if (header->version != VERSION){
+		error = ": unsupported frozen mtree version";
+	} else if (header->key_size != sizeof(T) || header->nroutes > NROUTES || header->leafcap > LEAFCAP
+			   || header->n_pivots > (uint32_t)is_pivoted<T>::count){
+		error = ": key size or node capacities do not match";
+	} else if (header->bytes != (uint64_t)st.st_size){
+		error = ": truncated or corrupt";
+	} else {
+		// every array aligned as Freeze places it and within the file; counts are divided
+		// rather than multiplied so no count can wrap the bound
+		auto within = [&](const uint64_t offset, const uint64_t n, const uint64_t size){
+			return offset % 64 == 0 && offset <= header->bytes && n <= (header->bytes - offset)/size;
+		};
+		if (!within(header->nodes, header->n_nodes, sizeof(Node))
+			|| !within(header->routes, header->n_routes, sizeof(Route))
+			|| !within(header->route_keys, header->n_routes, sizeof(T))
+			|| !within(header->rings, is_pivoted<T>::value ? header->n_routes : 0, sizeof(PivotRing<T>))
+			|| !within(header->ids, header->n_entries, sizeof(long long))
+			|| !within(header->ds, header->n_entries, sizeof(double))
+			|| !within(header->keys, header->n_entries, sizeof(T))
+			|| !within(header->pivots, header->n_pivots, sizeof(T))
+			|| !within(header->exact, n_exact(*header), sizeof(exact_type)))
+			error = ": truncated or corrupt";
+	}
+	if (error.empty()){
+		// queries follow nodes and routes unchecked: every node within its capacity and
+		// arrays, and every route to a later node, so no walk leaves the file or loops
+		const char *block = (const char*)base;
+		const Node *nodes = (const Node*)(block + header->nodes);
+		const Route *routes = (const Route*)(block + header->routes);
+		for (uint64_t i=0;i < header->n_nodes && error.empty();i++){
+			const Node &node = nodes[i];
+			const uint64_t end = (uint64_t)node.first + node.count;
+			if (node.leaf){
+				if (node.count > header->leafcap || end > header->n_entries)
+					error = ": corrupt leaf node";
+				continue;
+			}
+			if (node.count > header->nroutes || end > header->n_routes){
+				error = ": corrupt internal node";
+				continue;
+			}
+			for (uint64_t r=node.first;r < end;r++){
+				if (routes[r].child <= i || routes[r].child >= header->n_nodes){
+					error = ": corrupt route";
+					break;
+				}
+			}
+		}
+	}
+	if (!error.empty()){
+		munmap(base, st.st_size);
+		throw std::runtime_error(path + error);
+	}
+
+	m_base = (char*)base;
+	m_mapped = st.st_size;
+	attach();
+	Advise(advice);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::advise(const uint64_t from, const uint64_t to, const int advice)const{
+	const uint64_t page = sysconf(_SC_PAGESIZE);
+	const uint64_t start = from & ~(page - 1);
+	const uint64_t end = std::min((uint64_t)m_mapped, (to + page - 1) & ~(page - 1));
+	if (end > start)
+		madvise(m_base + start, end - start, advice);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::Advise(const MapAdvice advice)const{
+	if (m_mapped == 0)
+		return;
+	switch (advice){
+	case ADVISE_NORMAL:
+		advise(0, m_mapped, MADV_NORMAL);
+		break;
+	case ADVISE_RANDOM:
+		advise(0, m_mapped, MADV_RANDOM);
+		break;
+	case ADVISE_SEQUENTIAL:
+		advise(0, m_mapped, MADV_SEQUENTIAL);
+		break;
+	case ADVISE_WILLNEED:
+		advise(0, m_mapped, MADV_WILLNEED);
+		break;
+	case ADVISE_HOT_ROUTES:
+		// the leaf arrays follow the routes; the page shared at the border stays random
+		advise(m_header->ids, m_mapped, MADV_RANDOM);
+		advise(0, m_header->ids, MADV_WILLNEED);
+		break;
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+const T& mt::FrozenMTree<T,NROUTES,LEAFCAP>::with_pivots(const T &key, std::optional<T> &buffer,
+														 unsigned long &n_distances)const{
+	if constexpr (is_pivoted<T>::value){
+		buffer.emplace(key);
+		T &k = *buffer;
+		if (m_header != NULL && m_header->n_pivots > 0){
+			for (uint32_t p=0;p < m_header->n_pivots;p++){
+				k.pd[p] = m_pivots[p].distance(k);
+			}
+			n_distances += m_header->n_pivots;
+		} else {
+			std::fill(k.pd, k.pd + is_pivoted<T>::count, -1.0f);
+		}
+		return k;
+	} else {
+		return key;
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+template<typename Queue>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::select_routes(const Node &node, const T &query, const double d,
+													   const double radius, Queue &nodes, QueryStats &stats)const{
+	const Route *routes = m_routes + node.first;
+	const T *route_keys = m_route_keys + node.first;
+	const T *keys[NROUTES];
+	int pos[NROUTES];
+	int n = 0;
+	for (int i=0;i < node.count;i++){
+		if (std::abs(d - routes[i].d) > radius + routes[i].cover_radius){
+			MTREE_STAT(stats.n_pruned_parent++);
+			continue;
+		}
+		if constexpr (is_pivoted<T>::value){
+			if (pivot_bound(query, m_rings[node.first + i]) > radius){
+				MTREE_STAT(stats.n_pruned_pivot++);
+				continue;
+			}
+		}
+		if (distance_bound(query, route_keys[i]) > radius + routes[i].cover_radius){
+			MTREE_STAT(stats.n_pruned_bound++);
+			continue;
+		}
+		keys[n] = &route_keys[i];
+		pos[n++] = i;
+	}
+
+	double dists[NROUTES];
+	distance_many(query, keys, n, dists);
+	MTREE_STAT(stats.n_distances += n);
+	for (int i=0;i < n;i++){
+		const Route &route = routes[pos[i]];
+		const double dmin = (dists[i] > route.cover_radius) ? dists[i] - route.cover_radius : 0;
+		if (dmin <= radius){
+			nodes.push({ route.child, dists[i], dmin });
+		} else {
+			MTREE_STAT(stats.n_pruned_cover++);
+		}
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+const std::vector<mt::Entry<T>> mt::FrozenMTree<T,NROUTES,LEAFCAP>::RangeQuery(const T &query, const double radius,
+																			   QueryStats *stats)const{
+	std::vector<Entry<T>> results;
+	RangeQuery(query, radius, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+template<typename Visitor>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::RangeQuery(const T &query, const double radius, Visitor &&visit,
+													QueryStats *stats)const{
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	std::optional<T> buffer;
+	const T &q = with_pivots(query, buffer, qstats.n_distances);
+
+	std::queue<Ref> nodes;
+	if (m_header != NULL && m_header->n_nodes > 0)
+		nodes.push({ 0, 0, 0 });
+
+	while (!nodes.empty()){
+		const Ref current = nodes.front();
+		nodes.pop();
+		MTREE_STAT(qstats.n_nodes++);
+		const Node &node = m_nodes[current.node];
+		if (!node.leaf){
+			select_routes(node, q, current.d, radius, nodes, qstats);
+		} else {
+			visit_entries<LEAFCAP>(m_ids + node.first, m_ds + node.first, m_keys + node.first, node.count,
+								   q, current.d, radius, visit, qstats);
+		}
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+const std::vector<mt::NNEntry<T>> mt::FrozenMTree<T,NROUTES,LEAFCAP>::KNNQuery(const T &query, const int k,
+																			   QueryStats *stats)const{
+	std::vector<NNEntry<T>> results;
+	KNNQuery(query, k, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key, dist });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+template<typename Visitor>
+void mt::FrozenMTree<T,NROUTES,LEAFCAP>::KNNQuery(const T &query, const int k, Visitor &&visit,
+												  QueryStats *stats)const{
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	std::optional<T> buffer;
+	const T &q = with_pivots(query, buffer, qstats.n_distances);
+
+	// nothing moves, so candidates point at their keys in the block
+	std::priority_queue<Ref, std::vector<Ref>, std::greater<Ref>> nodes;
+	std::priority_queue<NNRef<T>> heap;
+	double radius = DBL_MAX;
+	if (m_header != NULL && m_header->n_nodes > 0 && k > 0)
+		nodes.push({ 0, 0, 0 });
+
+	while (!nodes.empty()){
+		const Ref current = nodes.top();
+		if (current.dmin > radius)
+			break;
+		nodes.pop();
+		MTREE_STAT(qstats.n_nodes++);
+		const Node &node = m_nodes[current.node];
+		if (!node.leaf){
+			select_routes(node, q, current.d, radius, nodes, qstats);
+		} else {
+			select_entries<LEAFCAP>(m_ids + node.first, m_ds + node.first, m_keys + node.first, node.count,
+									q, current.d, k, radius, heap, qstats);
+		}
+	}
+
+	std::vector<NNRef<T>> sorted(heap.size());
+	for (int i=(int)heap.size()-1;i >= 0;i--){
+		sorted[i] = heap.top();
+		heap.pop();
+	}
+	for (auto &e : sorted){
+		visit(e.id, *e.key, e.dist);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+const size_t mt::FrozenMTree<T,NROUTES,LEAFCAP>::memory_usage()const{
+	size_t bytes = sizeof(FrozenMTree<T,NROUTES,LEAFCAP>);
+	if (m_header == NULL)
+		return bytes;
+	bytes += m_header->bytes;
+	if constexpr (has_heap_bytes<T>::value){
+		for (uint64_t i=0;i < m_header->n_routes;i++) bytes += heap_bytes(m_route_keys[i]);
+		for (uint64_t i=0;i < m_header->n_entries;i++) bytes += heap_bytes(m_keys[i]);
+	}
+	return bytes;
+}
+
+#endif /* _FROZEN_H */
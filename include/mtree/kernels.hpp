@@ -0,0 +1,245 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace mt {
+
+	/**
+	 * write to idx the positions j in [0, n) with |d - ds[j]| <= radius, return their count
+	 * this is the triangle inequality test on stored parent distances; idx needs room for n
+	 **/
+	inline int filter_band(const double *ds, const int n, const double d, const double radius, int *idx);
+
+	/**
+	 * distance kernels for dense vectors and bit strings
+	 * the single pair and batched forms run the same code per key, so a key type that
+	 * uses one in distance() and the other in distance_many() gets identical results
+	 **/
+
+	// squared euclidean distance over dim components
+	inline double l2_sq(const double *a, const double *b, const int dim);
+	inline double l2_sq(const float *a, const float *b, const int dim);
+
+	// euclidean distance
+	template<typename V>
+	inline double l2(const V *a, const V *b, const int dim){
+		return std::sqrt(l2_sq(a, b, dim));
+	}
+
+	// number of differing bits over words 64-bit words
+	inline int hamming(const uint64_t *a, const uint64_t *b, const int words);
+
+	/**
+	 * query against n keys: out[i] = l2(q, proj(keys[i]), dim)
+	 * proj maps a key object to its component array
+	 **/
+	template<typename V, typename K, typename Proj>
+	inline void l2_many(const V *q, const K *const keys[], const int n, const int dim, Proj proj, double out[]){
+		for (int i=0;i < n;i++){
+			if (i + 1 < n)
+				__builtin_prefetch(proj(keys[i+1]));
+			out[i] = l2(q, proj(keys[i]), dim);
+		}
+	}
+
+	// query against n keys: out[i] = hamming(q, proj(keys[i]), words)
+	template<typename K, typename Proj>
+	inline void hamming_many(const uint64_t *q, const K *const keys[], const int n, const int words, Proj proj, double out[]){
+		for (int i=0;i < n;i++){
+			if (i + 1 < n)
+				__builtin_prefetch(proj(keys[i+1]));
+			out[i] = hamming(q, proj(keys[i]), words);
+		}
+	}
+}
+
+inline int mt::filter_band(const double *ds, const int n, const double d, const double radius, int *idx){
+	int count = 0;
+	int j = 0;
+
+#if defined(__AVX512F__)
+	const __m512d vd = _mm512_set1_pd(d);
+	const __m512d vr = _mm512_set1_pd(radius);
+	for (;j + 8 <= n;j += 8){
+		__m512d diff = _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(ds + j), vd));
+		unsigned mask = _mm512_cmp_pd_mask(diff, vr, _CMP_LE_OQ);
+		while (mask){
+			idx[count++] = j + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__AVX2__)
+	const __m256d vd = _mm256_set1_pd(d);
+	const __m256d vr = _mm256_set1_pd(radius);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	for (;j + 4 <= n;j += 4){
+		__m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(ds + j), vd));
+		unsigned mask = _mm256_movemask_pd(_mm256_cmp_pd(diff, vr, _CMP_LE_OQ));
+		while (mask){
+			idx[count++] = j + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	// branch-free compaction for the tail, or everything without AVX
+	for (;j < n;j++){
+		idx[count] = j;
+		count += (std::abs(d - ds[j]) <= radius);
+	}
+	return count;
+}
+
+inline double mt::l2_sq(const double *a, const double *b, const int dim){
+	double sum = 0;
+	int i = 0;
+
+#if defined(__AVX512F__)
+	__m512d acc = _mm512_setzero_pd();
+	for (;i + 8 <= dim;i += 8){
+		__m512d diff = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+		acc = _mm512_fmadd_pd(diff, diff, acc);
+	}
+	if (i < dim){
+		const __mmask8 m = (__mmask8)((1u << (dim - i)) - 1);
+		__m512d diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, a + i), _mm512_maskz_loadu_pd(m, b + i));
+		acc = _mm512_fmadd_pd(diff, diff, acc);
+		i = dim;
+	}
+	// spill rather than _mm512_reduce_add_pd, which trips -Wmaybe-uninitialized in gcc 12
+	alignas(64) double lanes[8];
+	_mm512_store_pd(lanes, acc);
+	for (int k=0;k < 8;k++){
+		sum += lanes[k];
+	}
+#elif defined(__AVX2__)
+	__m256d acc = _mm256_setzero_pd();
+	for (;i + 4 <= dim;i += 4){
+		__m256d diff = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+#if defined(__FMA__)
+		acc = _mm256_fmadd_pd(diff, diff, acc);
+#else
+		acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+#endif
+	}
+	__m128d s2 = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+	sum = _mm_cvtsd_f64(_mm_add_sd(s2, _mm_unpackhi_pd(s2, s2)));
+#endif
+
+	for (;i < dim;i++){
+		const double diff = a[i] - b[i];
+		sum += diff*diff;
+	}
+	return sum;
+}
+
+inline double mt::l2_sq(const float *a, const float *b, const int dim){
+	float sum = 0;
+	int i = 0;
+
+#if defined(__AVX512F__)
+	__m512 acc = _mm512_setzero_ps();
+	for (;i + 16 <= dim;i += 16){
+		__m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		acc = _mm512_fmadd_ps(diff, diff, acc);
+	}
+	if (i < dim){
+		const __mmask16 m = (__mmask16)((1u << (dim - i)) - 1);
+		__m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+		acc = _mm512_fmadd_ps(diff, diff, acc);
+		i = dim;
+	}
+	alignas(64) float lanes[16];
+	_mm512_store_ps(lanes, acc);
+	for (int k=0;k < 16;k++){
+		sum += lanes[k];
+	}
+#elif defined(__AVX2__)
+	__m256 acc = _mm256_setzero_ps();
+	for (;i + 8 <= dim;i += 8){
+		__m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+#if defined(__FMA__)
+		acc = _mm256_fmadd_ps(diff, diff, acc);
+#else
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+#endif
+	}
+	__m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+	sum = _mm_cvtss_f32(_mm_add_ss(s4, _mm_shuffle_ps(s4, s4, 1)));
+#endif
+
+	for (;i < dim;i++){
+		const float diff = a[i] - b[i];
+		sum += diff*diff;
+	}
+	return sum;
+}
+
+inline int mt::hamming(const uint64_t *a, const uint64_t *b, const int words){
+	int count = 0;
+	int i = 0;
+
+#if defined(__AVX512VPOPCNTDQ__)
+	__m512i acc = _mm512_setzero_si512();
+	for (;i + 8 <= words;i += 8){
+		__m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+	}
+	alignas(64) long long lanes[8];
+	_mm512_store_si512(lanes, acc);
+	for (int k=0;k < 8;k++){
+		count += (int)lanes[k];
+	}
+#elif defined(__AVX2__)
+	// nibble lookup popcount, summed per 64-bit lane with sad
+	if (words >= 8){
+		const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+												0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+		const __m256i low = _mm256_set1_epi8(0x0f);
+		__m256i acc = _mm256_setzero_si256();
+		for (;i + 4 <= words;i += 4){
+			__m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)),
+										 _mm256_loadu_si256((const __m256i*)(b + i)));
+			__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low)),
+										  _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+			acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+		}
+		count = (int)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+					  + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+	}
+#endif
+
+	for (;i < words;i++){
+		count += __builtin_popcountll(a[i] ^ b[i]);
+	}
+	return count;
+}
+
+#endif /* _KERNELS_H */
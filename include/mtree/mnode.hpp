@@ -21,17 +21,27 @@
 #ifndef _MNODE_H
 #define _MNODE_H
 
+#include <cassert>
 #include <vector>
 #include <array>
 #include <queue>
+#include <functional>
 #include <cfloat>
+#include <cmath>
+#include <memory>
 #include "mtree/entry.hpp"
+#include "mtree/concurrency.hpp"
+#include "mtree/kernels.hpp"
+#include "mtree/pivots.hpp"
+#include "mtree/quantize.hpp"
 
 
 namespace mt {
 	/**
-	 * template parameters: NROUTES - no. routes to store in internal nodes
-	 *                      LEAFCAP - no. dbentries to store in leaf nodes
+	 * template parameters: NROUTES - most routes to store in internal nodes
+	 *                      LEAFCAP - most dbentries to store in leaf nodes
+	 * each node is built with room for n_slots of them, its routes or entries
+	 * following it in the slot its NodePool sizes with Bytes(n_slots)
 	 **/
 
 	template<typename T, int NROUTES=4, int LEAFCAP=50>
@@ -40,15 +50,28 @@ namespace mt {
 
 		MNode<T,NROUTES,LEAFCAP> *p;   // parent node
 		int rindex; // route_entry index to parent node from this node
-	
+		const bool leaf;   // node kind, fixed at construction
+		const int n_slots; // routes or entries the node has room for
+
+		MNode(const bool leaf, const int n_slots):p(NULL),leaf(leaf),n_slots(n_slots){};
+		~MNode(){}
+
 	public:
 
-		MNode():p(NULL){};
-		virtual ~MNode(){}
+		mutable RWLatch latch;   // taken only by trees in concurrent mode
+
+		// no vtable: the methods below dispatch on the leaf tag to MInternal or MLeaf
+		const bool isleaf()const{
+			return leaf;
+		}
 	
-		virtual const int size()const = 0;
+		const int size()const;
 		
-		virtual const bool isfull()const = 0;
+		const bool isfull()const;
+
+		const int capacity()const{
+			return n_slots;
+		}
 
 		const bool isroot()const;
 
@@ -56,38 +79,77 @@ namespace mt {
 
 		void SetParentNode(MNode<T,NROUTES,LEAFCAP> *pnode, const int rdx);
 
-		virtual void SetChildNode(MNode<T,NROUTES,LEAFCAP>* child, const int rdx) = 0;
+		void SetChildNode(MNode<T,NROUTES,LEAFCAP>* child, const int rdx);
 
-		virtual MNode<T,NROUTES,LEAFCAP>* GetChildNode(const int rdx)const = 0;
+		MNode<T,NROUTES,LEAFCAP>* GetChildNode(const int rdx)const;
+
+		void Clear();
+
+	};
 
-		virtual void Clear() = 0;
 
+	/**
+	 * node reference for best-first traversal
+	 *    d    - distance from query to routing object of node
+	 *    dmin - lower bound on distance from query to any entry under node
+	 **/
+	template<typename T, int NROUTES, int LEAFCAP>
+	struct NodeRef {
+		MNode<T,NROUTES,LEAFCAP> *node;
+		double d;
+		double dmin;
+		bool operator>(const NodeRef<T,NROUTES,LEAFCAP> &other)const{
+			return (dmin > other.dmin);
+		}
 	};
 
+	template<typename T, int NROUTES, int LEAFCAP>
+	using NodeQueue = std::priority_queue<NodeRef<T,NROUTES,LEAFCAP>,
+										  std::vector<NodeRef<T,NROUTES,LEAFCAP>>,
+										  std::greater<NodeRef<T,NROUTES,LEAFCAP>>>;
 
 	template<typename T, int NROUTES, int LEAFCAP>
-	class MInternal : public MNode<T,NROUTES,LEAFCAP> {
+	class alignas(MNode<T,NROUTES,LEAFCAP>) alignas(RoutingObject<T>) MInternal : public MNode<T,NROUTES,LEAFCAP> {
 	protected:
 		
 		int n_routes;
-		RoutingObject<T> routes[NROUTES];
+
+		// n_slots routes, right after the node
+		RoutingObject<T>* routes(){
+			return reinterpret_cast<RoutingObject<T>*>(this + 1);
+		}
+		const RoutingObject<T>* routes()const{
+			return reinterpret_cast<const RoutingObject<T>*>(this + 1);
+		}
 	
 	public:
-		MInternal();
-		~MInternal(){}
+		explicit MInternal(const int n_slots);
+		~MInternal();
+
+		// bytes for a node with n_slots routes
+		static size_t Bytes(const int n_slots){
+			return sizeof(MInternal) + n_slots*sizeof(RoutingObject<T>);
+		}
 	
 		const int size()const;
 
 		const bool isfull()const;
 
 		// return all the routing objects for this node 
-		void GetRoutes(std::vector<RoutingObject<T>> &routes)const;
+		void GetRoutes(std::vector<RoutingObject<T>> &robjs)const;
 
 		// select routing object to follow for insert
 		// modify cover radius in routing object as appropriate
-		int SelectRoute(const T nobj, RoutingObject<T> &robj, bool insert);
-
-		void SelectRoutes(const T query, const double radius, std::queue<MNode<T,NROUTES,LEAFCAP>*> &nodes)const;
+		// dist, when given, takes the distance from nobj to the selected route
+		int SelectRoute(const T nobj, RoutingObject<T> &robj, bool insert, double *dist = NULL);
+
+		// push routes that can hold entries within radius onto nodes, a std::queue or
+		// best-first NodeQueue of NodeRef, each carrying its query-to-route distance
+		// d is the distance from query to this node's routing object; cover radii are scaled
+		// by shrink, below 1 for approximate search. returns the distances computed
+		template<typename Queue>
+		int SelectRoutes(const T &query, const double d, const double radius, Queue &nodes,
+						 QueryStats &stats, const double shrink=1.0)const;
 	
 		int StoreRoute(const RoutingObject<T> &robj);
 
@@ -95,33 +157,113 @@ namespace mt {
 
 		void GetRoute(const int rdx, RoutingObject<T> &route);
 
+		// routing object at rdx, for inspection
+		const RoutingObject<T>& Route(const int rdx)const{ return routes()[rdx]; }
+
+		// heap memory owned by the route keys
+		size_t HeapBytes()const;
+
+		void RemoveRoute(const int rdx);
+
+		// bound on the distance from this node's routing object to any entry below,
+		// from the stored route distances and cover radii
+		double CoverRadius()const;
+
+		// also refreshes the route's pivot ring from the child's contents
 		void SetChildNode(MNode<T,NROUTES,LEAFCAP> *child, const int rdx);
 
+		// recompute route rdx's pivot ring from its child, without distance computations
+		void RefreshRing(const int rdx);
+
 		MNode<T,NROUTES,LEAFCAP>* GetChildNode(const int rdx)const;
 	
 		void Clear();
 	};
 	
 	template<typename T, int NROUTES, int LEAFCAP>
-	class MLeaf : public MNode<T,NROUTES,LEAFCAP> {
+	class alignas(MNode<T,NROUTES,LEAFCAP>) alignas(double) alignas(T) MLeaf : public MNode<T,NROUTES,LEAFCAP> {
 	protected:
 
-		std::vector<DBEntry<T>> entries;
+		// entries stored as separate arrays of n_slots right after the node, so the
+		// parent distance filter scans ds contiguously and only touches the keys that pass it
+		int n_entries;
+
+		static size_t keys_offset(const int n_slots){
+			const size_t offset = sizeof(MLeaf) + n_slots*(sizeof(long long) + sizeof(double));
+			return (offset + alignof(T) - 1)/alignof(T)*alignof(T);
+		}
+		long long* ids(){
+			return reinterpret_cast<long long*>(this + 1);
+		}
+		const long long* ids()const{
+			return reinterpret_cast<const long long*>(this + 1);
+		}
+		double* ds(){
+			return reinterpret_cast<double*>(ids() + this->n_slots);
+		}
+		const double* ds()const{
+			return reinterpret_cast<const double*>(ids() + this->n_slots);
+		}
+		T* keys(){
+			return reinterpret_cast<T*>(reinterpret_cast<unsigned char*>(this) + keys_offset(this->n_slots));
+		}
+		const T* keys()const{
+			return reinterpret_cast<const T*>(reinterpret_cast<const unsigned char*>(this) + keys_offset(this->n_slots));
+		}
 
 	public:
-		MLeaf(){};
+		explicit MLeaf(const int n_slots):MNode<T,NROUTES,LEAFCAP>(true, n_slots),n_entries(0){
+			std::uninitialized_default_construct_n(keys(), n_slots);
+		}
 		~MLeaf();
+
+		// bytes for a node with n_slots entries
+		static size_t Bytes(const int n_slots){
+			return keys_offset(n_slots) + n_slots*sizeof(T);
+		}
 		
 		const int size()const;
 		const bool isfull()const;
 
 		int StoreEntry(const DBEntry<T> &nobj);
 
+		// key of entry i, for inspection
+		const T& Key(const int i)const{ return keys()[i]; }
+
 		void GetEntries(std::vector<DBEntry<T>> &dbentries)const;
 
-		void SelectEntries(const T query, const double radius, std::vector<Entry<T>> &results)const;
+		// largest distance from key to an entry, counted as build operations
+		double MaxDistance(const T &key)const;
+
+		// largest stored distance to this node's routing object
+		double CoverRadius()const;
 
-		int DeleteEntry(const T &entry);
+		// heap memory owned by the entry keys
+		size_t HeapBytes()const;
+
+		// widen ring to take in every entry's pivot distances
+		void ExtendRing(PivotRing<T> &ring)const{
+			for (int i=0;i < n_entries;i++) ring.Extend(keys()[i]);
+		}
+
+		// call visit(id, key, dist) for each entry within radius of query
+		// d is the distance from query to this node's routing object
+		// returns the distances computed
+		template<typename Visitor>
+		int VisitEntries(const T &query, const double d, const double radius, Visitor &visit,
+						 QueryStats &stats)const;
+
+		// keep k nearest entries in max-heap results, shrinking radius to k-th distance once full
+		// E is NNEntry<T> to copy keys into the heap, or NNRef<T> to point at them
+		// d is the distance from query to this node's routing object
+		// returns the distances computed
+		template<typename E>
+		int SelectEntries(const T &query, const double d, const int k, double &radius,
+						  std::priority_queue<E> &results, QueryStats &stats)const;
+
+		// remove every entry with key equal to entry, return the number removed
+		// d is the distance from entry to this node's routing object
+		int DeleteEntry(const T &entry, const double d);
 	
 		void SetChildNode(MNode<T,NROUTES,LEAFCAP> *child, const int rdx);
 
@@ -129,6 +271,19 @@ namespace mt {
 
 		void Clear();
 	};
+
+	/**
+	 * leaf scans over n_entries held as arrays, at most LEAFCAP; MLeaf and the leaves of a
+	 * FrozenMTree (frozen.hpp) share them. as MLeaf::VisitEntries and MLeaf::SelectEntries
+	 **/
+	template<int LEAFCAP, typename T, typename Visitor>
+	int visit_entries(const long long *ids, const double *ds, const T *keys, const int n_entries,
+					  const T &query, const double d, const double radius, Visitor &visit, QueryStats &stats);
+
+	template<int LEAFCAP, typename T, typename E>
+	int select_entries(const long long *ids, const double *ds, const T *keys, const int n_entries,
+					   const T &query, const double d, const int k, double &radius,
+					   std::priority_queue<E> &results, QueryStats &stats);
 }
 
 
@@ -155,6 +310,43 @@ void mt::MNode<T,NROUTES,LEAFCAP>::SetParentNode(MNode<T,NROUTES,LEAFCAP> *pnode
 	rindex = rdx;
 }
 
+template<typename T, int NROUTES, int LEAFCAP>
+const int mt::MNode<T,NROUTES,LEAFCAP>::size()const{
+	if (leaf)
+		return static_cast<const MLeaf<T,NROUTES,LEAFCAP>*>(this)->size();
+	return static_cast<const MInternal<T,NROUTES,LEAFCAP>*>(this)->size();
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+const bool mt::MNode<T,NROUTES,LEAFCAP>::isfull()const{
+	if (leaf)
+		return static_cast<const MLeaf<T,NROUTES,LEAFCAP>*>(this)->isfull();
+	return static_cast<const MInternal<T,NROUTES,LEAFCAP>*>(this)->isfull();
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::MNode<T,NROUTES,LEAFCAP>::SetChildNode(MNode<T,NROUTES,LEAFCAP> *child, const int rdx){
+	if (leaf)
+		static_cast<MLeaf<T,NROUTES,LEAFCAP>*>(this)->SetChildNode(child, rdx);
+	else
+		static_cast<MInternal<T,NROUTES,LEAFCAP>*>(this)->SetChildNode(child, rdx);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+mt::MNode<T,NROUTES,LEAFCAP>* mt::MNode<T,NROUTES,LEAFCAP>::GetChildNode(const int rdx)const{
+	if (leaf)
+		return static_cast<const MLeaf<T,NROUTES,LEAFCAP>*>(this)->GetChildNode(rdx);
+	return static_cast<const MInternal<T,NROUTES,LEAFCAP>*>(this)->GetChildNode(rdx);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::MNode<T,NROUTES,LEAFCAP>::Clear(){
+	if (leaf)
+		static_cast<MLeaf<T,NROUTES,LEAFCAP>*>(this)->Clear();
+	else
+		static_cast<MInternal<T,NROUTES,LEAFCAP>*>(this)->Clear();
+}
+
 /**
  *
  *  MInternal Node implementation
@@ -162,11 +354,14 @@ void mt::MNode<T,NROUTES,LEAFCAP>::SetParentNode(MNode<T,NROUTES,LEAFCAP> *pnode
  **/
 
 template<typename T, int NROUTES, int LEAFCAP>
-mt::MInternal<T,NROUTES,LEAFCAP>::MInternal(){
+mt::MInternal<T,NROUTES,LEAFCAP>::MInternal(const int n_slots):MNode<T,NROUTES,LEAFCAP>(false, n_slots){
 	n_routes = 0;
-	for (int i=0;i < NROUTES;i++){
-		routes[i].subtree = NULL;
-	}
+	std::uninitialized_default_construct_n(routes(), n_slots);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+mt::MInternal<T,NROUTES,LEAFCAP>::~MInternal(){
+	std::destroy_n(routes(), this->n_slots);
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
@@ -181,70 +376,106 @@ const bool mt::MInternal<T,NROUTES,LEAFCAP>::isfull()const{
 
 
 template<typename T, int NROUTES, int LEAFCAP>
-void mt::MInternal<T,NROUTES,LEAFCAP>::GetRoutes(std::vector<RoutingObject<T>> &routes)const{
-	for (int i=0;i < NROUTES;i++){
-		if (routes[i].subtree != NULL)
-			routes.push_back(routes[i]);
+void mt::MInternal<T,NROUTES,LEAFCAP>::GetRoutes(std::vector<RoutingObject<T>> &robjs)const{
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree != NULL)
+			robjs.push_back(routes()[i]);
 	}
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
-int mt::MInternal<T,NROUTES,LEAFCAP>::SelectRoute(const T nobj, RoutingObject<T> &robj, bool insert){
+int mt::MInternal<T,NROUTES,LEAFCAP>::SelectRoute(const T nobj, RoutingObject<T> &robj, bool insert, double *dist){
+
+	const T *keys[NROUTES];
+	int pos[NROUTES];
+	int n = 0;
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree != NULL){
+			keys[n] = &routes()[i].key;
+			pos[n++] = i;
+		}
+	}
+
+	double dists[NROUTES];
+	distance_many(nobj, keys, n, dists);
+	BuildCounter::Add(n);
 
+	// nearest route: splits only ever carve a route's region in two, so the
+	// nearest routing object is the one whose subtree holds nobj's neighbors
 	int min_pos = -1;
 	double min_dist = DBL_MAX;
-	for (int i=0;i < NROUTES;i++){
-		if (routes[i].subtree != NULL){
-			const double d = routes[i].distance(nobj); //distance(routes[i].key, nobj.key);
-			if (d < min_dist){
-				min_pos = i;
-				min_dist = d;
-			}
+	for (int i=0;i < n;i++){
+		if (dists[i] < min_dist){
+			min_pos = pos[i];
+			min_dist = dists[i];
 		}
 	}
 
 	if (min_pos < 0)
 		throw std::logic_error("unable to find route entry");
 
-	if (insert && min_dist > routes[min_pos].cover_radius)
-		routes[min_pos].cover_radius = min_dist;
+	if (insert && min_dist > routes()[min_pos].cover_radius)
+		routes()[min_pos].cover_radius = min_dist;
+	if (insert)
+		routes()[min_pos].ring.Extend(nobj);
 	
-	robj = routes[min_pos];
+	robj = routes()[min_pos];
+	if (dist)
+		*dist = min_dist;
 	
 	return min_pos;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
-void mt::MInternal<T,NROUTES,LEAFCAP>::SelectRoutes(const T query, const double radius,
-													std::queue<MNode<T,NROUTES,LEAFCAP>*> &nodes)const{
-
-	double d = 0;
-	if (this->p != NULL){
-		RoutingObject<T> pobj;
-		((MInternal<T,NROUTES,LEAFCAP>*)this->p)->GetRoute(this->rindex, pobj);
-		d = pobj.distance(query);
+template<typename Queue>
+int mt::MInternal<T,NROUTES,LEAFCAP>::SelectRoutes(const T &query, const double d, const double radius,
+												   Queue &nodes, QueryStats &stats, const double shrink)const{
+	const T *keys[NROUTES];
+	int pos[NROUTES];
+	int n = 0;
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree == NULL)
+			continue;
+		if (std::abs(d - routes()[i].d) > radius + shrink*routes()[i].cover_radius){
+			MTREE_STAT(stats.n_pruned_parent++);
+			continue;
+		}
+		if (pivot_bound(query, routes()[i].ring) > radius){
+			MTREE_STAT(stats.n_pruned_pivot++);
+			continue;
+		}
+		if (distance_bound(query, routes()[i].key) > radius + shrink*routes()[i].cover_radius){
+			MTREE_STAT(stats.n_pruned_bound++);
+			continue;
+		}
+		keys[n] = &routes()[i].key;
+		pos[n++] = i;
 	}
 
-	for (int i=0;i < NROUTES;i++){
-		if (routes[i].subtree != NULL){
-			if (abs(d -  routes[i].d) <= radius + routes[i].cover_radius){
-				if (routes[i].distance(query) <= radius + routes[i].cover_radius){   //distance(routes[i].key, query)
-					nodes.push((MNode<T,NROUTES,LEAFCAP>*)routes[i].subtree);
-				}
-			}
+	double dists[NROUTES];
+	distance_many(query, keys, n, dists);
+	MTREE_STAT(stats.n_distances += n);
+	for (int i=0;i < n;i++){
+		const RoutingObject<T> &route = routes()[pos[i]];
+		const double cover = shrink*route.cover_radius;
+		const double dmin = (dists[i] > cover) ? dists[i] - cover : 0;
+		if (dmin <= radius){
+			nodes.push({ (MNode<T,NROUTES,LEAFCAP>*)route.subtree, dists[i], dmin });
+		} else {
+			MTREE_STAT(stats.n_pruned_cover++);
 		}
 	}
-	
+	return n;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 int mt::MInternal<T,NROUTES,LEAFCAP>::StoreRoute(const RoutingObject<T> &robj){
-	assert(n_routes < NROUTES);
+	assert(n_routes < this->n_slots);
 
 	int index = -1;
-	for (int i=0;i < NROUTES;i++){
-		if (routes[i].subtree == NULL){
-			routes[i] = robj;
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree == NULL){
+			routes()[i] = robj;
 			index = i;
 			n_routes++;
 			break;
@@ -255,27 +486,73 @@ int mt::MInternal<T,NROUTES,LEAFCAP>::StoreRoute(const RoutingObject<T> &robj){
 
 template<typename T, int NROUTES, int LEAFCAP>
 void mt::MInternal<T,NROUTES,LEAFCAP>::ConfirmRoute(const RoutingObject<T> &robj, const int rdx){
-	assert(rdx >= 0 && rdx < NROUTES && robj.subtree != NULL);
-	routes[rdx] = robj;
+	assert(rdx >= 0 && rdx < this->n_slots && robj.subtree != NULL);
+	routes()[rdx] = robj;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 void mt::MInternal<T,NROUTES,LEAFCAP>::GetRoute(const int rdx, RoutingObject<T> &route){
-	assert(rdx >= 0 && rdx < NROUTES);
-	route = routes[rdx];
+	assert(rdx >= 0 && rdx < this->n_slots);
+	route = routes()[rdx];
 };
 
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::MInternal<T,NROUTES,LEAFCAP>::RemoveRoute(const int rdx){
+	assert(rdx >= 0 && rdx < this->n_slots && routes()[rdx].subtree != NULL);
+	routes()[rdx].subtree = NULL;
+	n_routes--;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+double mt::MInternal<T,NROUTES,LEAFCAP>::CoverRadius()const{
+	double radius = 0;
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree != NULL)
+			radius = std::max(radius, routes()[i].d + routes()[i].cover_radius);
+	}
+	return radius;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+size_t mt::MInternal<T,NROUTES,LEAFCAP>::HeapBytes()const{
+	size_t bytes = 0;
+	for (int i=0;i < this->n_slots;i++){
+		if (routes()[i].subtree != NULL)
+			bytes += heap_bytes(routes()[i].key);
+	}
+	return bytes;
+}
+
 template<typename T, int NROUTES, int LEAFCAP>
 void mt::MInternal<T,NROUTES,LEAFCAP>::SetChildNode(MNode<T,NROUTES,LEAFCAP> *child, const int rdx){
-	assert(rdx >= 0 && rdx < NROUTES);
-	routes[rdx].subtree = child;
+	assert(rdx >= 0 && rdx < this->n_slots);
+	routes()[rdx].subtree = child;
 	child->SetParentNode(this, rdx);
+	RefreshRing(rdx);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+void mt::MInternal<T,NROUTES,LEAFCAP>::RefreshRing(const int rdx){
+	if constexpr (is_pivoted<T>::value){
+		PivotRing<T> &ring = routes()[rdx].ring;
+		ring.Reset();
+		MNode<T,NROUTES,LEAFCAP> *child = (MNode<T,NROUTES,LEAFCAP>*)routes()[rdx].subtree;
+		if (child->isleaf()){
+			((MLeaf<T,NROUTES,LEAFCAP>*)child)->ExtendRing(ring);
+		} else {
+			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)child;
+			for (int i=0;i < internal->n_slots;i++){
+				if (internal->routes()[i].subtree != NULL)
+					ring.Extend(internal->routes()[i].ring);
+			}
+		}
+	}
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 mt::MNode<T,NROUTES,LEAFCAP>* mt::MInternal<T,NROUTES,LEAFCAP>::GetChildNode(const int rdx)const{
-	assert(rdx >= 0 && rdx < NROUTES);
-	return (MNode<T,NROUTES,LEAFCAP>*)routes[rdx].subtree;
+	assert(rdx >= 0 && rdx < this->n_slots);
+	return (MNode<T,NROUTES,LEAFCAP>*)routes()[rdx].subtree;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
@@ -292,73 +569,189 @@ void mt::MInternal<T,NROUTES,LEAFCAP>::Clear(){
 
 template<typename T, int NROUTES, int LEAFCAP>
 mt::MLeaf<T,NROUTES,LEAFCAP>::~MLeaf(){
-	entries.clear();
+	std::destroy_n(keys(), this->n_slots);
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 const int mt::MLeaf<T,NROUTES,LEAFCAP>::size()const{
-	return entries.size();
+	return n_entries;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 const bool mt::MLeaf<T,NROUTES,LEAFCAP>::isfull()const{
-	return (entries.size() >= LEAFCAP);
+	return (n_entries >= this->n_slots);
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 int mt::MLeaf<T,NROUTES,LEAFCAP>::StoreEntry(const DBEntry<T> &nobj){
-	if (entries.size() >= LEAFCAP)
+	if (n_entries >= this->n_slots)
 		throw std::out_of_range("full leaf node");
 
-	int index = entries.size();
-	entries.push_back(nobj);
+	int index = n_entries++;
+	ids()[index] = nobj.id;
+	ds()[index] = nobj.d;
+	keys()[index] = nobj.key;
 	return index;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
 void mt::MLeaf<T,NROUTES,LEAFCAP>::GetEntries(std::vector<DBEntry<T>> &dbentries)const{
-	for (auto &e : entries){
-		dbentries.push_back(e);
+	for (int j=0;j < n_entries;j++){
+		dbentries.push_back({ ids()[j], keys()[j], ds()[j] });
 	}
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
-void mt::MLeaf<T,NROUTES,LEAFCAP>::SelectEntries(const T query, const double radius,
-												 std::vector<Entry<T>> &results)const{
-	double d = 0;
-	if (this->p != NULL){
-		RoutingObject<T> pobj;
-		((MInternal<T,NROUTES,LEAFCAP>*)this->p)->GetRoute(this->rindex, pobj);
-		d = pobj.distance(query);               //distance(pobj.key, query);
+double mt::MLeaf<T,NROUTES,LEAFCAP>::MaxDistance(const T &key)const{
+	const T *cand[LEAFCAP];
+	for (int i=0;i < n_entries;i++){
+		cand[i] = &keys()[i];
 	}
-	
-	for (int j=0;j < (int)entries.size();j++){
-		if (abs(d -  entries[j].d) <= radius){
-			if (entries[j].distance(query) <= radius){	//distance(entries[j].key, query) <= radius){
-				results.push_back({ entries[j].id, entries[j].key });
-			}
-		}
+	double dists[LEAFCAP];
+	distance_many(key, cand, n_entries, dists);
+	BuildCounter::Add(n_entries);
+
+	double radius = 0;
+	for (int i=0;i < n_entries;i++){
+		if (dists[i] > radius) radius = dists[i];
 	}
+	return radius;
 }
 
 template<typename T, int NROUTES, int LEAFCAP>
-int mt::MLeaf<T,NROUTES,LEAFCAP>::DeleteEntry(const T &entry){
-	int count = 0;
+double mt::MLeaf<T,NROUTES,LEAFCAP>::CoverRadius()const{
+	double radius = 0;
+	for (int i=0;i < n_entries;i++){
+		if (ds()[i] > radius) radius = ds()[i];
+	}
+	return radius;
+}
 
-	double d = 0;
-	if (this->p != NULL){
-		RoutingObject<T> pobj;
-		((MInternal<T,NROUTES,LEAFCAP>*)this->p)->GetRoute(this->rindex, pobj);
-		d = pobj.key.distance(entry.key);            //distance(pobj.key, entry.key);
+template<typename T, int NROUTES, int LEAFCAP>
+size_t mt::MLeaf<T,NROUTES,LEAFCAP>::HeapBytes()const{
+	size_t bytes = 0;
+	for (int i=0;i < n_entries;i++){
+		bytes += heap_bytes(keys()[i]);
 	}
+	return bytes;
+}
 
-	for (int j=0;j < (int)entries.size();j++){
-		if (d == entries[j].d){
-			if (entry.distance(entries[j].key) == 0){      //distance(entries[j].key, entry.key) == 0){
-				entries[j] = entries.back();
-				entries.pop_back();
-				count++;
-			}
+template<typename T, int NROUTES, int LEAFCAP>
+template<typename Visitor>
+int mt::MLeaf<T,NROUTES,LEAFCAP>::VisitEntries(const T &query, const double d, const double radius,
+											   Visitor &visit, QueryStats &stats)const{
+	return visit_entries<LEAFCAP>(ids(), ds(), keys(), n_entries, query, d, radius, visit, stats);
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+template<typename E>
+int mt::MLeaf<T,NROUTES,LEAFCAP>::SelectEntries(const T &query, const double d, const int k, double &radius,
+												std::priority_queue<E> &results, QueryStats &stats)const{
+	return select_entries<LEAFCAP>(ids(), ds(), keys(), n_entries, query, d, k, radius, results, stats);
+}
+
+template<int LEAFCAP, typename T, typename Visitor>
+int mt::visit_entries(const long long *ids, const double *ds, const T *keys, const int n_entries,
+					  const T &query, const double d, const double radius, Visitor &visit, QueryStats &stats){
+	int idx[LEAFCAP];
+	int n = filter_band(ds, n_entries, d, radius, idx);
+	MTREE_STAT(stats.n_pruned_parent += n_entries - n);
+
+	if constexpr (is_pivoted<T>::value){
+		int m = 0;
+		for (int i=0;i < n;i++){
+			if (pivot_bound(query, keys[idx[i]]) <= radius)
+				idx[m++] = idx[i];
+		}
+		MTREE_STAT(stats.n_pruned_pivot += n - m);
+		n = m;
+	}
+	if constexpr (has_distance_bound<T>::value){
+		int m = 0;
+		for (int i=0;i < n;i++){
+			if (distance_bound(query, keys[idx[i]]) <= radius)
+				idx[m++] = idx[i];
+		}
+		MTREE_STAT(stats.n_pruned_bound += n - m);
+		n = m;
+	}
+
+	const T *cand[LEAFCAP];
+	for (int i=0;i < n;i++){
+		cand[i] = &keys[idx[i]];
+	}
+	double dists[LEAFCAP];
+	distance_many(query, cand, n, dists);
+	MTREE_STAT(stats.n_distances += n);
+
+	for (int i=0;i < n;i++){
+		if (dists[i] <= radius){
+			visit(ids[idx[i]], keys[idx[i]], dists[i]);
+		}
+	}
+	return n;
+}
+
+template<int LEAFCAP, typename T, typename E>
+int mt::select_entries(const long long *ids, const double *ds, const T *keys, const int n_entries,
+					   const T &query, const double d, const int k, double &radius,
+					   std::priority_queue<E> &results, QueryStats &stats){
+	int idx[LEAFCAP];
+	const int n = filter_band(ds, n_entries, d, radius, idx);
+	int n_distances = 0;
+	MTREE_STAT(stats.n_pruned_parent += n_entries - n);
+
+	// one pair at a time rather than distance_many: the radius shrinks as the
+	// heap fills, so later candidates are re-filtered and often skipped
+	for (int i=0;i < n;i++){
+		const int j = idx[i];
+		if (std::abs(d - ds[j]) > radius){
+			MTREE_STAT(stats.n_pruned_parent++);
+			continue;
+		}
+		if (pivot_bound(query, keys[j]) > radius){
+			MTREE_STAT(stats.n_pruned_pivot++);
+			continue;
+		}
+		if (distance_bound(query, keys[j]) > radius){
+			MTREE_STAT(stats.n_pruned_bound++);
+			continue;
+		}
+		MTREE_STAT(stats.n_distances++);
+		n_distances++;
+		const double dist = keys[j].distance(query);
+		if (dist <= radius){
+			results.push({ ids[j], keys[j], dist });
+			if ((int)results.size() > k)
+				results.pop();
+			if ((int)results.size() == k)
+				radius = results.top().dist;
+		}
+	}
+	return n_distances;
+}
+
+template<typename T, int NROUTES, int LEAFCAP>
+int mt::MLeaf<T,NROUTES,LEAFCAP>::DeleteEntry(const T &entry, const double d){
+	int count = 0;
+
+	// candidates are entries at exactly the same parent distance
+	int idx[LEAFCAP];
+	const int n = filter_band(ds(), n_entries, d, 0, idx);
+
+	// walk candidates from the back so moving the last entry into a hole
+	// never displaces a candidate not yet visited
+	for (int i=n-1;i >= 0;i--){
+		const int j = idx[i];
+		if (entry.distance(keys()[j]) == 0){      //distance(keys[j], entry.key) == 0){
+			const int last = --n_entries;
+			ids()[j] = ids()[last];
+			ds()[j] = ds()[last];
+			keys()[j] = keys()[last];
+			// drop the stale copy so it stops holding what the key owns
+			if constexpr (!std::is_trivially_destructible<T>::value)
+				keys()[last] = T();
+			count++;
 		}
 	}
 	
@@ -377,7 +770,11 @@ mt::MNode<T,NROUTES,LEAFCAP>* mt::MLeaf<T,NROUTES,LEAFCAP>::GetChildNode(const i
 
 template<typename T, int NROUTES, int LEAFCAP>
 void mt::MLeaf<T,NROUTES,LEAFCAP>::Clear(){
-	entries.clear();
+	if constexpr (!std::is_trivially_destructible<T>::value){
+		for (int i=0;i < n_entries;i++)
+			keys()[i] = T();
+	}
+	n_entries = 0;
 }
 
 
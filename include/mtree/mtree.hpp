@@ -23,49 +23,311 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cmath>
+#include <array>
 #include <vector>
 #include <map>
+#include <set>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <string>
+#include <fstream>
 #include "mtree/mnode.hpp"
 #include "mtree/entry.hpp"
+#include "mtree/threadpool.hpp"
+#include "mtree/arena.hpp"
+#include "mtree/serialize.hpp"
+#include "mtree/split.hpp"
+#include "mtree/frozen.hpp"
 
 namespace mt {
 
-	template<typename T, int NROUTES=4, int LEAFCAP=50>
+	/**
+	 * template parameters: NROUTES, LEAFCAP - node capacities, as for MNode; a tree can be
+	 *                                         constructed with smaller nodes
+	 *                      PROMOTE, PARTITION - policies for splitting a full leaf (split.hpp)
+	 **/
+	template<typename T, int NROUTES=4, int LEAFCAP=50,
+			 typename PROMOTE=FarthestPromote, typename PARTITION=HyperplanePartition>
 	class MTree {
 	private:
 
-		size_t m_count;
+		std::atomic<size_t> m_count;
 	
-		MNode<T,NROUTES,LEAFCAP> *m_top;
-		
-		void promote(std::vector<DBEntry<T>> &entries, RoutingObject<T> &op1, RoutingObject<T> &op2);
-	
-		void partition(std::vector<DBEntry<T>> &entries, RoutingObject<T> &op1, RoutingObject<T> &op2,
-					   std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2);
+		std::atomic<MNode<T,NROUTES,LEAFCAP>*> m_top;
+
+		// capacities in use, at most NROUTES and LEAFCAP
+		int m_nroutes;
+		int m_leafcap;
+
+		// all nodes live in these pools, sized to m_leafcap and m_nroutes slots;
+		// Clear() hands the slabs back in one go
+		NodePool<MLeaf<T,NROUTES,LEAFCAP>> m_leaves;
+		NodePool<MInternal<T,NROUTES,LEAFCAP>> m_internals;
+
+		// exact keys of Quantized keys (quantize.hpp); declared ahead of m_epoch, which may
+		// still hold slots to give back to it when destroyed
+		[[no_unique_address]] ExactStore<T> m_exact;
+
+		// retire every slot of m_exact that no entry, route or pivot points at any more
+		void sweep_exact();
+
+		// concurrent mode: writers serialize on m_writer and latch only the nodes they modify;
+		// readers latch each node shared while scanning it and never follow parent pointers.
+		// nodes replaced by a split are retired to m_epoch rather than deleted
+		const bool m_concurrent;
+		std::mutex m_writer;
+		mutable EpochManager m_epoch;
+
+		static void delete_node(void *tree, void *node);
+
+		void retire(MNode<T,NROUTES,LEAFCAP> *node);
+
+		// global pivots for Pivoted keys (pivots.hpp), chosen when the first leaf splits or
+		// on BulkLoad; m_has_pivots is set only once every entry in the tree is measured
+		std::array<T, is_pivoted<T>::count> m_pivots;
+		std::atomic<bool> m_has_pivots{false};
+
+		// pick pivots farthest-first over a sample of entries, then measure every entry
+		void choose_pivots(std::vector<DBEntry<T>> &entries);
+
+		// key with its pivot distances filled in, in buffer, adding their count to n_distances;
+		// without pivots yet they stay unmeasured. other key types come back as is
+		const T& with_pivots(const T &key, std::optional<T> &buffer, unsigned long &n_distances)const;
+
+		// split policies, see split.hpp
+		PROMOTE m_promote;
+		PARTITION m_partition;
+
+		// if partition left one side empty, move an entry over to it
+		void fill_empty(std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2,
+						RoutingObject<T> &robj1, RoutingObject<T> &robj2);
+
+		// split routes, more than a node holds, across new internal nodes, pushing a routing
+		// object over each to parents with its cover radius.  given fresh, the radius is the
+		// bound from the child routes, which already take in entries of a batch still to be
+		// stored, and the new nodes are added to fresh to have it tightened afterwards
+		void split_routes(std::vector<RoutingObject<T>> &routes, std::vector<RoutingObject<T>> &parents,
+						  std::set<MNode<T,NROUTES,LEAFCAP>*> *fresh = NULL);
 
-		MNode<T,NROUTES,LEAFCAP>* split(MNode<T,NROUTES,LEAFCAP> *node, const Entry<T> &nobj);
+		// put routes, each over a new subtree, in node's place in its parent. when the parent
+		// has no room they go under a new internal node that takes node's place beneath
+		// node's own routing object, so no other route's region changes; more routes than
+		// a node holds are grouped by split_routes first. node is retired once replaced
+		void replace_node(MNode<T,NROUTES,LEAFCAP> *node, std::vector<RoutingObject<T>> &routes,
+						  std::set<MNode<T,NROUTES,LEAFCAP>*> *fresh = NULL);
+
+		// largest distance from key to an entry under node, but no less than radius;
+		// subtrees whose covering ball already lies within radius are skipped
+		double subtree_radius(const T &key, MNode<T,NROUTES,LEAFCAP> *node, double radius);
+
+		// distance from key to pnode's own routing object, 0 when pnode is the root
+		double parent_distance(MInternal<T,NROUTES,LEAFCAP> *pnode, const T &key);
+
+		// nodes below these sizes are merged with a sibling after a delete;
+		// an internal node with one route is only a link in a chain
+		int min_entries()const{ return (m_leafcap+3)/4; }
+		int min_routes()const{ return std::max(2, (m_nroutes+1)/2); }
+
+		// combine the underfull node under route rdx with its nearest sibling of the same kind into
+		// one node, or move the sibling's nearest entries over when both do not fit
+		void merge(MInternal<T,NROUTES,LEAFCAP> *pnode, const int rdx,
+				   std::vector<MNode<T,NROUTES,LEAFCAP>*> &replaced);
+
+		// after node lost entries, unlink or merge underfull nodes and shrink cover radii
+		// on the way up, then drop root levels left with a single route
+		void condense(MNode<T,NROUTES,LEAFCAP> *node, std::vector<MNode<T,NROUTES,LEAFCAP>*> &replaced);
+
+		// split full leaf node on insert of nobj, the two halves replacing it
+		// nobj.d is the distance from the new entry to node's routing object
+		void split(MNode<T,NROUTES,LEAFCAP> *node, const DBEntry<T> &nobj);
 	
 		void StoreEntries(MLeaf<T,NROUTES,LEAFCAP> *leaf, std::vector<DBEntry<T>> &entries);
+
+		// Insert without the writer lock and entry count
+		void insert(const Entry<T> &entry);
+
+		// descend with entries, whose d is the distance to node's routing object, choosing a
+		// route for each at every internal node as Insert does; each leaf reached is pushed
+		// to pending with its share
+		void route_batch(MNode<T,NROUTES,LEAFCAP> *node, std::vector<DBEntry<T>> &entries,
+						 std::vector<std::pair<MLeaf<T,NROUTES,LEAFCAP>*,std::vector<DBEntry<T>>>> &pending);
+
+		// add entries to leaf, replacing it with as many new leaves as they all need if full;
+		// new internal nodes are added to fresh
+		void store_batch(MLeaf<T,NROUTES,LEAFCAP> *leaf, std::vector<DBEntry<T>> &entries,
+						 std::set<MNode<T,NROUTES,LEAFCAP>*> &fresh);
+
+		// spread entries over new leaves of at most leafcap, halving them by the split policies,
+		// pushing a routing object over each leaf to routes
+		void split_leaves(std::vector<DBEntry<T>> &entries, std::vector<RoutingObject<T>> &routes);
+
+		// pick pivots from entries[idx[0..n)] until there are k
+		void sample_pivots(const std::vector<DBEntry<T>> &entries, int *idx, const int n, const int k,
+						   std::minstd_rand &gen, std::vector<RoutingObject<T>> &pivots);
+
+		// build subtree over entries[idx[0..n)]; entries[i].d holds distance to the
+		// subtree's routing object pobj (NULL at root)
+		MNode<T,NROUTES,LEAFCAP>* build(std::vector<DBEntry<T>> &entries, int *idx, const int n,
+										const RoutingObject<T> *pobj, const int levels, std::minstd_rand &gen);
+
+		// write subtree in preorder: a node, then each of its children
+		void save_node(std::ostream &out, const MNode<T,NROUTES,LEAFCAP> *node)const;
+
+		// rebuild subtree written by save_node, returns count of entries in it
+		MNode<T,NROUTES,LEAFCAP>* load_node(std::istream &in, size_t &count);
+
+		// heap memory owned by every key in the tree, without visiting nodes when T owns none
+		size_t key_heap_bytes()const;
+
+		// best-first search leaving the k nearest entries in max-heap, within limits;
+		// caller holds the epoch guard
+		template<typename E>
+		void knn_search(const T &query, const int k, std::priority_queue<E> &heap, QueryStats &stats,
+						const SearchLimits &limits)const;
+
+		static const T& key_of(const NNEntry<T> &e){ return e.key; }
+		static const T& key_of(const NNRef<T> &e){ return *e.key; }
+
+		// empty heap into visit in ascending distance order
+		template<typename E, typename Visitor>
+		static void visit_sorted(std::priority_queue<E> &heap, Visitor &visit);
 	
 	public:
 
-		MTree():m_count(0),m_top(NULL){}
+		MTree():m_count(0),m_top(NULL),m_nroutes(NROUTES),m_leafcap(LEAFCAP),m_leaves(LEAFCAP),m_internals(NROUTES),m_concurrent(false){}
+
+		// concurrent = true lets any number of threads call RangeQuery/KNNQuery while others
+		// Insert or DeleteEntry; BulkLoad and Clear still need exclusive access
+		explicit MTree(const bool concurrent)
+			:m_count(0),m_top(NULL),m_nroutes(NROUTES),m_leafcap(LEAFCAP),m_leaves(LEAFCAP),m_internals(NROUTES),m_concurrent(concurrent){}
+
+		// nodes sized for nroutes routes and leafcap entries, so one instantiation with
+		// generous NROUTES and LEAFCAP can try many capacities without recompiling
+		// throws std::invalid_argument unless 2 <= nroutes <= NROUTES and 2 <= leafcap <= LEAFCAP
+		MTree(const int nroutes, const int leafcap, const bool concurrent=false);
+
+		MTree(std::vector<Entry<T>> &&entries)
+			:m_count(0),m_top(NULL),m_nroutes(NROUTES),m_leafcap(LEAFCAP),m_leaves(LEAFCAP),m_internals(NROUTES),m_concurrent(false){
+			BulkLoad(std::move(entries));
+		}
+
+		~MTree(){
+			Clear();
+		}
+
+		MTree(const MTree&) = delete;
+		MTree& operator=(const MTree&) = delete;
+
+		// replace contents of tree with entries, built top-down by recursive clustering
+		// into a height-balanced tree with filled leaves
+		void BulkLoad(std::vector<Entry<T>> &&entries);
+
+		// file format version written by Save
+		static constexpr uint32_t FILE_VERSION = 1;
+
+		// write tree structure to file at path; keys go through Serializer<T>
+		// throws std::runtime_error on i/o failure
+		void Save(const std::string &path)const;
+
+		// replace contents of tree with one written by Save, without computing distances
+		// the file's node capacities must fit NROUTES and LEAFCAP; the tree takes them on
+		// throws std::runtime_error on i/o failure or format mismatch, leaving the tree empty
+		void Load(const std::string &path);
 
 		
 		void Insert(const Entry<T> &entry);
 
+		// insert many entries in one pass: at each internal node the batch is divided among
+		// the routes as Insert would choose them, so it descends once per subtree, and each
+		// leaf takes its whole share at once, splitting into as many leaves as it needs.
+		// queries answer as after inserting the entries one by one
+		template<typename Iterator>
+		void InsertBatch(Iterator first, Iterator last);
+
+		void InsertBatch(const std::vector<Entry<T>> &entries){
+			InsertBatch(entries.begin(), entries.end());
+		}
+
+		// remove every entry with entry's key, searching all routes whose ball can hold it
+		// returns the number of entries removed
 		const int DeleteEntry(const Entry<T> &entry);
 
 		void Clear();
 
+		// read-only copy of the tree in one block of memory, nodes in breadth first order
+		// (frozen.hpp), answering queries as this tree does now; later changes to this tree
+		// do not reach it. in concurrent mode it waits for no writer, so freeze between updates
+		FrozenMTree<T,NROUTES,LEAFCAP> Freeze()const;
+
 	
-		const std::vector<Entry<T>> RangeQuery(T query, const double radius)const;
+		// queries add their distance computations, nodes visited and pruning counts
+		// to stats when given (see stats.hpp)
+		const std::vector<Entry<T>> RangeQuery(T query, const double radius, QueryStats *stats = NULL)const;
+
+		// k nearest neighbors of query, sorted by ascending distance
+		const std::vector<NNEntry<T>> KNNQuery(const T &query, const int k, QueryStats *stats = NULL)const;
+
+		// call visit(id, key, dist) for each entry within radius of query as it is found;
+		// key refers into the tree and is valid only during the call, nothing is copied.
+		// in concurrent mode visit runs under the leaf's shared latch and must not modify the tree
+		template<typename Visitor>
+		void RangeQuery(const T &query, const double radius, Visitor &&visit, QueryStats *stats = NULL)const;
+
+		// call visit(id, key, dist) for the k nearest neighbors of query in ascending distance
+		// order, once the search is done; same key lifetime rules as RangeQuery above
+		template<typename Visitor>
+		void KNNQuery(const T &query, const int k, Visitor &&visit, QueryStats *stats = NULL)const;
+
+		// approximate queries for bounded latency: nodes are visited nearest first until a budget
+		// of distances or nodes runs out, and cover radii shrink by 1+epsilon when pruning.
+		// every reported entry and distance is exact, but some matches or neighbors may be missed
+		const std::vector<Entry<T>> ApproxRangeQuery(const T &query, const double radius, const SearchLimits &limits,
+													 QueryStats *stats = NULL)const;
+
+		template<typename Visitor>
+		void ApproxRangeQuery(const T &query, const double radius, const SearchLimits &limits, Visitor &&visit,
+							  QueryStats *stats = NULL)const;
+
+		const std::vector<NNEntry<T>> ApproxKNNQuery(const T &query, const int k, const SearchLimits &limits,
+													 QueryStats *stats = NULL)const;
+
+		template<typename Visitor>
+		void ApproxKNNQuery(const T &query, const int k, const SearchLimits &limits, Visitor &&visit,
+							QueryStats *stats = NULL)const;
+
+		// run queries in parallel across pool; element i of result holds the answer to queries[i]
+		const std::vector<std::vector<Entry<T>>> BatchRangeQuery(const std::vector<T> &queries, const double radius,
+																 ThreadPool &pool)const;
+
+		const std::vector<std::vector<NNEntry<T>>> BatchKNNQuery(const std::vector<T> &queries, const int k,
+																 ThreadPool &pool)const;
 
 		const size_t size()const;
 
+		// node capacities in use
+		int nroutes()const{ return m_nroutes; }
+		int leafcap()const{ return m_leafcap; }
+
 		//void PrintTree()const;
 		
+		// bytes held by the tree: node pools, their bookkeeping and heap memory owned by keys
 		const size_t memory_usage()const;
+
+		// height, nodes per level, fanout and leaf fill, cover radii and sibling overlap, and
+		// memory; overlap costs a distance for each pair of sibling routes whose balls may meet
+		const TreeStats Stats()const;
+
+		// node pool usage summed over leaf and internal nodes
+		const ArenaStats allocator_stats()const;
+
+		// element i counts the leaves at depth i, the root being at depth 0;
+		// a height-balanced tree has a single nonzero element
+		const std::vector<size_t> DepthHistogram()const;
 	};
 
 }
@@ -74,290 +336,1661 @@ namespace mt {
  *  MTree implementation code 
  *
  **/
-template<typename T, int NROUTES, int LEAFCAP>
-void mt::MTree<T,NROUTES,LEAFCAP>::promote(std::vector<DBEntry<T>> &entries,
-										   RoutingObject<T> &robj1,
-										   RoutingObject<T> &robj2){
-
-	RoutingObject<T> routes[2];
-
-	int current = 0;
-	routes[current%2].key = entries[0].key;
-
-	const int n_iters = 5;
-	for (int i=0;i < n_iters;i++){
-		int maxpos = -1;
-		double maxd = 0;
-		const int slimit = entries.size();
-		for (int j=0;j < slimit;j++){
-			double d = routes[current%2].distance(entries[j].key);
-			if (d > maxd){
-				maxpos = j;
-				maxd = d;
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::StoreEntries(MLeaf<T,NROUTES,LEAFCAP> *leaf,
+												std::vector<DBEntry<T>> &entries){
+	while (!entries.empty()){
+		leaf->StoreEntry(entries.back());
+		entries.pop_back();
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::MTree(const int nroutes, const int leafcap, const bool concurrent)
+	:m_count(0),m_top(NULL),m_nroutes(nroutes),m_leafcap(leafcap),m_leaves(leafcap),m_internals(nroutes),m_concurrent(concurrent){
+	if (nroutes < 2 || nroutes > NROUTES)
+		throw std::invalid_argument("nroutes must be in 2.." + std::to_string(NROUTES));
+	if (leafcap < 2 || leafcap > LEAFCAP)
+		throw std::invalid_argument("leafcap must be in 2.." + std::to_string(LEAFCAP));
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::delete_node(void *tree, void *node){
+	MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION> *mtree = (MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>*)tree;
+	MNode<T,NROUTES,LEAFCAP> *mnode = (MNode<T,NROUTES,LEAFCAP>*)node;
+	if (!mnode->isleaf()){
+		mtree->m_internals.Delete((MInternal<T,NROUTES,LEAFCAP>*)mnode);
+	} else {
+		mtree->m_leaves.Delete((MLeaf<T,NROUTES,LEAFCAP>*)mnode);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::retire(MNode<T,NROUTES,LEAFCAP> *node){
+	if (m_concurrent){
+		m_epoch.Retire(node, this, &delete_node);
+	} else {
+		delete_node(this, node);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::choose_pivots(std::vector<DBEntry<T>> &entries){
+	if constexpr (is_pivoted<T>::value){
+		const int n_pivots = is_pivoted<T>::count;
+		const size_t n = entries.size();
+		const size_t n_samples = std::min(n, (size_t)1000);
+		const size_t stride = n/n_samples;
+
+		std::vector<double> mind(n_samples, DBL_MAX);
+		size_t next = 0;
+		for (int p=0;p < n_pivots;p++){
+			m_pivots[p] = entries[next*stride].key;
+			double maxd = -1;
+			for (size_t i=0;i < n_samples;i++){
+				const double d = m_pivots[p].distance(entries[i*stride].key);
+				mind[i] = std::min(mind[i], d);
+				if (mind[i] > maxd){
+					next = i;
+					maxd = mind[i];
+				}
+			}
+		}
+		BuildCounter::Add(n_pivots*n_samples);
+
+		for (auto &e : entries){
+			for (int p=0;p < n_pivots;p++){
+				e.key.pd[p] = m_pivots[p].distance(e.key);
 			}
 		}
-		routes[++current%2].key = entries[maxpos].key;
+		BuildCounter::Add(n_pivots*n);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const T& mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::with_pivots(const T &key, std::optional<T> &buffer,
+																	  unsigned long &n_distances)const{
+	if constexpr (is_pivoted<T>::value){
+		const int n_pivots = is_pivoted<T>::count;
+		buffer.emplace(key);
+		T &k = *buffer;
+		if (m_has_pivots.load(std::memory_order_acquire)){
+			for (int p=0;p < n_pivots;p++){
+				k.pd[p] = m_pivots[p].distance(k);
+			}
+			n_distances += n_pivots;
+		} else {
+			std::fill(k.pd, k.pd + n_pivots, -1.0f);
+		}
+		return k;
+	} else {
+		return key;
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::fill_empty(std::vector<DBEntry<T>> &entries1,
+																std::vector<DBEntry<T>> &entries2,
+																RoutingObject<T> &robj1,
+																RoutingObject<T> &robj2){
+	std::vector<DBEntry<T>> *from = &entries1, *to = &entries2;
+	RoutingObject<T> *robj = &robj2;
+	if (entries1.empty()){
+		std::swap(from, to);
+		robj = &robj1;
+	} else if (!entries2.empty()){
+		return;
 	}
-	
-	robj1.key = routes[0].key;
-	robj2.key = routes[1].key;
-	robj1.d = 0;
-	robj2.d = 0;
 
+	DBEntry<T> e = from->back();
+	from->pop_back();
+	e.d = robj->distance(e.key);
+	if (e.d > robj->cover_radius)
+		robj->cover_radius = e.d;
+	to->push_back(e);
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-void mt::MTree<T,NROUTES,LEAFCAP>::partition(std::vector<DBEntry<T>> &entries,
-											 RoutingObject<T> &robj1,
-											 RoutingObject<T> &robj2,
-											 std::vector<DBEntry<T>> &entries1,
-											 std::vector<DBEntry<T>> &entries2){
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::split_routes(std::vector<RoutingObject<T>> &routes,
+																  std::vector<RoutingObject<T>> &parents,
+																  std::set<MNode<T,NROUTES,LEAFCAP>*> *fresh){
+	const int n = routes.size();
+
+	// no new node gets fewer than 40% of a node's routes, nor a lone route unless n leaves
+	// no choice (3 routes at fanout 2): mM_RAD alone often sets a single outlier apart
+	const int min_fill = std::min(std::max(2, (2*m_nroutes + 4)/5), n/2);
+
+	// routes go to the nearer of promoted routes a and b, ties to the smaller group, as
+	// side 0 or 1; then the larger group gives up the routes that cost least to move
+	// until the other holds min_fill
+	std::vector<int> side(n);
+	auto assign = [&](const int a, const int b, const double *da, const double *db){
+		int count[2] = { 0, 0 };
+		for (int i=0;i < n;i++){
+			int j = (i == a || (i != b && da[i] < db[i])) ? 0 : 1;
+			if (i != a && i != b && da[i] == db[i])
+				j = (count[0] < count[1]) ? 0 : 1;
+			side[i] = j;
+			count[j]++;
+		}
+		for (int j=0;j < 2;j++){
+			const double *dj = (j == 0) ? da : db;
+			const double *dk = (j == 0) ? db : da;
+			const int keep = (j == 0) ? b : a;
+			while (count[j] < min_fill){
+				int move = -1;
+				for (int i=0;i < n;i++){
+					if (side[i] != j && i != keep && (move < 0 || dj[i] - dk[i] < dj[move] - dk[move]))
+						move = i;
+				}
+				side[move] = j;
+				count[j]++;
+				count[1-j]--;
+			}
+		}
+	};
+
+	// a subtree under route r lies within r.cover_radius of r.key, so within
+	// dist(r.key, p) + r.cover_radius of a new routing object p.  with a few routes over
+	// capacity every pair can be tried: promote the pair whose assignment gives the
+	// smallest larger covering radius (mM_RAD, counting child cover radii).
+	// the many routes of a batch insert take a far apart pair instead
+	int best1 = 0, best2 = 1;
+	std::vector<double> dists1(n, 0), dists2(n, 0);
+	if (n <= 2*m_nroutes){
+		std::vector<double> dists(n*n, 0);
+		for (int a=0;a < n;a++){
+			for (int b=a+1;b < n;b++){
+				dists[a*n+b] = dists[b*n+a] = routes[a].distance(routes[b].key);
+			}
+		}
 
-	double radius1 = 0;
-	double radius2 = 0;
-	for (int i=0;i < (int)entries.size();i++){
-		double d1 = robj1.distance(entries[i].key); //distance(entries[i].key, robj1.key);
-		double d2 = robj2.distance(entries[i].key); //distance(entries[i].key, robj2.key);
-		if (d1 < d2){
-			entries1.push_back({ entries[i].id, entries[i].key, d1 });
-			if (d1 > radius1) radius1 = d1;
+		double best = DBL_MAX;
+		for (int a=0;a < n;a++){
+			for (int b=a+1;b < n;b++){
+				assign(a, b, &dists[a*n], &dists[b*n]);
+				double r[2] = { 0, 0 };
+				for (int i=0;i < n;i++){
+					const double d = dists[(side[i] == 0 ? a : b)*n+i] + routes[i].cover_radius;
+					r[side[i]] = std::max(r[side[i]], d);
+				}
+				if (std::max(r[0], r[1]) < best){
+					best = std::max(r[0], r[1]);
+					best1 = a;
+					best2 = b;
+				}
+			}
+		}
+		for (int i=0;i < n;i++){
+			dists1[i] = dists[best1*n+i];
+			dists2[i] = dists[best2*n+i];
+		}
+	} else {
+		for (int i=0;i < n;i++){
+			dists1[i] = routes[0].distance(routes[i].key);
+			if (dists1[i] > dists1[best1]) best1 = i;
+		}
+		for (int i=0;i < n;i++){
+			dists1[i] = routes[best1].distance(routes[i].key);
+			if (i != best1 && (best2 == best1 || dists1[i] > dists1[best2])) best2 = i;
+		}
+		for (int i=0;i < n;i++){
+			dists2[i] = routes[best2].distance(routes[i].key);
+		}
+	}
+	assign(best1, best2, dists1.data(), dists2.data());
+
+	// each promoted route heads a new internal node over its group; a group still over
+	// capacity is split again
+	const int promoted[2] = { best1, best2 };
+	std::vector<RoutingObject<T>> groups[2];
+	for (int i=0;i < n;i++){
+		RoutingObject<T> route = routes[i];
+		route.d = (side[i] == 0) ? dists1[i] : dists2[i];
+		groups[side[i]].push_back(route);
+	}
+	for (int j=0;j < 2;j++){
+		if ((int)groups[j].size() > m_nroutes){
+			split_routes(groups[j], parents, fresh);
+			continue;
+		}
+		RoutingObject<T> robj(routes[promoted[j]].id, routes[promoted[j]].key);
+		MInternal<T,NROUTES,LEAFCAP> *internal = m_internals.New();
+		for (auto &route : groups[j]){
+			int rdx = internal->StoreRoute(route);
+			internal->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, rdx);
+		}
+		robj.subtree = internal;
+
+		// d + cover_radius compounds at every level; the exact radius is far tighter
+		// near the root and costs about one distance per entry per level over a build
+		if (fresh){
+			robj.cover_radius = internal->CoverRadius();
+			fresh->insert(internal);
 		} else {
-			entries2.push_back({ entries[i].id, entries[i].key, d2 });
-			if (d2 > radius2) radius2 = d2;
+			robj.cover_radius = subtree_radius(robj.key, internal, 0);
 		}
+		parents.push_back(robj);
 	}
-	
-	robj1.cover_radius = radius1;
-	robj2.cover_radius = radius2;
-	entries.clear();
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-void mt::MTree<T,NROUTES,LEAFCAP>::StoreEntries(MLeaf<T,NROUTES,LEAFCAP> *leaf,
-												std::vector<DBEntry<T>> &entries){
-	while (!entries.empty()){
-		leaf->StoreEntry(entries.back());
-		entries.pop_back();
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+double mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::subtree_radius(const T &key,
+																	   MNode<T,NROUTES,LEAFCAP> *node,
+																	   double radius){
+	if (node->isleaf())
+		return std::max(radius, ((MLeaf<T,NROUTES,LEAFCAP>*)node)->MaxDistance(key));
+
+	for (int i=0;i < m_nroutes;i++){
+		MNode<T,NROUTES,LEAFCAP> *child = node->GetChildNode(i);
+		if (child == NULL) continue;
+		RoutingObject<T> route;
+		((MInternal<T,NROUTES,LEAFCAP>*)node)->GetRoute(i, route);
+		if (route.distance(key) + route.cover_radius > radius)
+			radius = subtree_radius(key, child, radius);
 	}
+	return radius;
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-mt::MNode<T,NROUTES,LEAFCAP>* mt::MTree<T,NROUTES,LEAFCAP>::split(MNode<T,NROUTES,LEAFCAP> *node, const Entry<T> &nobj){
-	assert(typeid(*node) == typeid(MLeaf<T,NROUTES,LEAFCAP>));
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+double mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::parent_distance(MInternal<T,NROUTES,LEAFCAP> *pnode,
+																		const T &key){
+	int gdx;
+	MInternal<T,NROUTES,LEAFCAP> *gnode = (MInternal<T,NROUTES,LEAFCAP>*)pnode->GetParentNode(gdx);
+	if (gnode == NULL)
+		return 0;
 
+	RoutingObject<T> pobj;
+	gnode->GetRoute(gdx, pobj);
+	return pobj.distance(key);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::split(MNode<T,NROUTES,LEAFCAP> *node, const DBEntry<T> &nobj){
+	assert(node->isleaf());
+
+	// entries go to two fresh leaves so concurrent readers of the old leaf still see all of them
 	MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)node;
-	MLeaf<T,NROUTES,LEAFCAP> *leaf2 = new MLeaf<T,NROUTES,LEAFCAP>();
+	MLeaf<T,NROUTES,LEAFCAP> *leaf1 = m_leaves.New();
+	MLeaf<T,NROUTES,LEAFCAP> *leaf2 = m_leaves.New();
 
 	std::vector<DBEntry<T>> entries;
 	leaf->GetEntries(entries);
 
-	entries.push_back({ .id = nobj.id, .key = nobj.key, 0 });
+	entries.push_back(nobj);
+
+	// a pivoted tree picks its pivots when its first leaf splits, from that leaf
+	const bool first_pivots = is_pivoted<T>::value && !m_has_pivots;
+	if (first_pivots)
+		choose_pivots(entries);
 
 	RoutingObject<T> robj1, robj2;
-	promote(entries, robj1, robj2);
+	m_promote(entries, robj1, robj2);
+	robj1.d = 0;
+	robj2.d = 0;
 
 	std::vector<DBEntry<T>> entries1, entries2;
-	partition(entries, robj1, robj2, entries1, entries2);
-	robj1.subtree = leaf;
+	m_partition(entries, robj1, robj2, entries1, entries2);
+	fill_empty(entries1, entries2, robj1, robj2);
+	robj1.subtree = leaf1;
 	robj2.subtree = leaf2;
 
-	leaf->Clear();
-
-	StoreEntries(leaf, entries1);
+	StoreEntries(leaf1, entries1);
 	StoreEntries(leaf2, entries2);
 
-	MInternal<T,NROUTES,LEAFCAP> *pnode;
-	if (node->isroot()){ // root level
-		MInternal<T,NROUTES,LEAFCAP> *qnode = new MInternal<T,NROUTES,LEAFCAP>();
+	std::vector<RoutingObject<T>> routes = { robj1, robj2 };
+	replace_node(node, routes);
 
-		int rdx = qnode->StoreRoute(robj1);
-		qnode->SetChildNode(leaf, rdx);
+	// readers seeing the pivots now only reach measured entries
+	if (first_pivots)
+		m_has_pivots.store(true, std::memory_order_release);
+}
 
-		rdx = qnode->StoreRoute(robj2);
-		qnode->SetChildNode(leaf2, rdx);
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::replace_node(MNode<T,NROUTES,LEAFCAP> *node,
+																  std::vector<RoutingObject<T>> &routes,
+																  std::set<MNode<T,NROUTES,LEAFCAP>*> *fresh){
+	// more routes than one node holds are grouped under as many levels as it takes
+	auto group = [&](const RoutingObject<T> *pobj){
+		while ((int)routes.size() > m_nroutes){
+			std::vector<RoutingObject<T>> parents;
+			split_routes(routes, parents, fresh);
+			routes.swap(parents);
+		}
+		for (auto &route : routes){
+			route.d = pobj ? pobj->distance(route.key) : 0;
+		}
+	};
 
-		pnode = qnode;
-	} else {  // not root  
-		int rdx;
-		pnode = (MInternal<T,NROUTES,LEAFCAP>*)(node->GetParentNode(rdx));
-		if (pnode->isfull()){ // parent node overflows
-			MInternal<T,NROUTES,LEAFCAP> *qnode = new MInternal<T,NROUTES,LEAFCAP>();
-			
-			RoutingObject<T> pobj;
-			pnode->GetRoute(rdx, pobj);
-
-			robj1.d = pobj.distance(robj1.key); //  distance(robj1.key, pobj.key);
-			
-			int rdx1 = qnode->StoreRoute(robj1);
-			qnode->SetChildNode(leaf, rdx1);
-
-			robj2.d = pobj.distance(robj2.key); // distance(robj2.key, pobj.key);
-			
-			int rdx2 = qnode->StoreRoute(robj2);
-			qnode->SetChildNode(leaf2, rdx2);
-
-			pnode->SetChildNode(qnode, rdx);
-
-		} else { // still room in parent node
-			int gdx;
-			MInternal<T,NROUTES,LEAFCAP> *gnode = (MInternal<T,NROUTES,LEAFCAP>*)pnode->GetParentNode(gdx);
-			if (gnode != NULL){
-				RoutingObject<T> pobj;
-				gnode->GetRoute(gdx, pobj);
-				robj1.d = pobj.distance(robj1.key); // distance(robj1.key, pobj.key);
-				robj2.d = pobj.distance(robj2.key); // distance(robj2.key, pobj.key);
-			}
-			
-			pnode->ConfirmRoute(robj1, rdx);
-			pnode->SetChildNode(leaf, rdx);
+	if (node->isroot()){
+		group(NULL);
+		MInternal<T,NROUTES,LEAFCAP> *root = m_internals.New();
+		for (auto &route : routes){
+			int rdx = root->StoreRoute(route);
+			root->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, rdx);
+		}
+		m_top = root;
+		retire(node);
+		return;
+	}
 
-			int rdx2 = pnode->StoreRoute(robj2);
-			pnode->SetChildNode(leaf2, rdx2);
+	int rdx;
+	MInternal<T,NROUTES,LEAFCAP> *pnode = (MInternal<T,NROUTES,LEAFCAP>*)node->GetParentNode(rdx);
+
+	if (pnode->size() - 1 + (int)routes.size() <= m_nroutes){ // still room in parent node
+		// routes in pnode hold their distance to pnode's own routing object
+		for (auto &route : routes){
+			route.d = parent_distance(pnode, route.key);
+		}
+
+		if (m_concurrent) pnode->latch.lock();
+		pnode->ConfirmRoute(routes[0], rdx);
+		pnode->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)routes[0].subtree, rdx);
+		for (size_t i=1;i < routes.size();i++){
+			int rdx2 = pnode->StoreRoute(routes[i]);
+			pnode->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)routes[i].subtree, rdx2);
+		}
+		if (m_concurrent) pnode->latch.unlock();
+	} else {
+		// parent node overflows. splitting it would regroup its routes under new routing
+		// objects in the grandparent, whose nearest-route regions then no longer match what
+		// the subtrees hold, so inserts stray and widen balls on every level. instead the
+		// routes go one level down, beneath node's routing object, whose ball and region
+		// stay as they were
+		RoutingObject<T> pobj;
+		pnode->GetRoute(rdx, pobj);
+		group(&pobj);
+
+		MInternal<T,NROUTES,LEAFCAP> *qnode = m_internals.New();
+		for (auto &route : routes){
+			int qdx = qnode->StoreRoute(route);
+			qnode->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, qdx);
+		}
+		if (fresh) fresh->insert(qnode);
+
+		if (m_concurrent) pnode->latch.lock();
+		pnode->SetChildNode(qnode, rdx);
+		if (m_concurrent) pnode->latch.unlock();
+	}
+
+	retire(node);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<size_t> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::DepthHistogram()const{
+	std::vector<size_t> histogram;
+	std::queue<std::pair<MNode<T,NROUTES,LEAFCAP>*,int>> nodes;
+
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL)
+		nodes.push({ top, 0 });
+
+	while (!nodes.empty()){
+		MNode<T,NROUTES,LEAFCAP> *current = nodes.front().first;
+		const int depth = nodes.front().second;
+		nodes.pop();
+		if (current->isleaf()){
+			if ((int)histogram.size() <= depth)
+				histogram.resize(depth+1, 0);
+			histogram[depth]++;
+		} else {
+			for (int i=0;i < m_nroutes;i++){
+				MNode<T,NROUTES,LEAFCAP> *child = current->GetChildNode(i);
+				if (child) nodes.push({ child, depth+1 });
+			}
 		}
 	}
+	return histogram;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Insert(const Entry<T> &entry){
+	std::unique_lock<std::mutex> lock(m_writer, std::defer_lock);
+	if (m_concurrent) lock.lock();
 
-	return pnode;
+	insert(entry);
+	m_count += 1;
+
+	if (m_concurrent)
+		m_epoch.Reclaim();
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-void mt::MTree<T,NROUTES,LEAFCAP>::Insert(const Entry<T> &entry){
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::insert(const Entry<T> &entry){
+	unsigned long n_pivot_distances = 0;
+	std::optional<T> buffer;
+	const T &key = m_exact.Adopt(with_pivots(entry.key, buffer, n_pivot_distances), buffer);
+	BuildCounter::Add(n_pivot_distances);
 
 	MNode<T,NROUTES,LEAFCAP> *node = m_top;
 	if (node == NULL){ // add first entry to empty tree
-	    MLeaf<T,NROUTES,LEAFCAP> *leaf = new MLeaf<T,NROUTES,LEAFCAP>();
-		DBEntry<T> dentry(entry.id, entry.key, 0);
+	    MLeaf<T,NROUTES,LEAFCAP> *leaf = m_leaves.New();
+		DBEntry<T> dentry(entry.id, key, 0);
 		leaf->StoreEntry(dentry);
 		m_top = leaf;
 	} else {
 		double d = 0;
 		do {
-			if (typeid(*node) == typeid(MInternal<T,NROUTES,LEAFCAP>)){
+			if (!node->isleaf()){
 				RoutingObject<T>  robj;
-				((MInternal<T,NROUTES,LEAFCAP>*)node)->SelectRoute(entry.key, robj, true);
+				if (m_concurrent) node->latch.lock();
+				((MInternal<T,NROUTES,LEAFCAP>*)node)->SelectRoute(key, robj, true, &d);
+				if (m_concurrent) node->latch.unlock();
 				node = (MNode<T,NROUTES,LEAFCAP>*)robj.subtree;
-				d = robj.key.distance(entry.key);  // distance(robj.key, entry.key);
-			} else if (typeid(*node) == typeid(MLeaf<T,NROUTES,LEAFCAP>)){
-				if (!node->isfull()){
-					((MLeaf<T,NROUTES,LEAFCAP>*)node)->StoreEntry({ entry.id, entry.key, d });
+			} else {
+				if (node->size() < m_leafcap){
+					if (m_concurrent) node->latch.lock();
+					((MLeaf<T,NROUTES,LEAFCAP>*)node)->StoreEntry({ entry.id, key, d });
+					if (m_concurrent) node->latch.unlock();
 				} else {
-					node = split(node, entry);
-					if (node->isroot()){
-						m_top = node;
-					}
+					split(node, { entry.id, key, d });
 				}
 				node = NULL;
-			} else {
-				throw std::logic_error("no such node type");
 			}
 		} while (node != NULL);
 	}
+}
 
-	m_count += 1;
-	
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Iterator>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::InsertBatch(Iterator first, Iterator last){
+	std::unique_lock<std::mutex> lock(m_writer, std::defer_lock);
+	if (m_concurrent) lock.lock();
+
+	// a tree of one leaf takes entries one at a time until its first split, which also
+	// picks the pivots of a pivoted tree
+	std::vector<DBEntry<T>> batch;
+	for (;first != last;++first){
+		MNode<T,NROUTES,LEAFCAP> *top = m_top;
+		if (top == NULL || top->isleaf()){
+			insert(*first);
+			m_count += 1;
+			continue;
+		}
+		unsigned long n_pivot_distances = 0;
+		std::optional<T> buffer;
+		batch.push_back(DBEntry<T>(first->id, with_pivots(first->key, buffer, n_pivot_distances), 0));
+		m_exact.Adopt(batch.back().key);
+		BuildCounter::Add(n_pivot_distances);
+	}
+
+	if (!batch.empty()){
+		const size_t n = batch.size();
+
+		// leaves only change once every entry has found its leaf, so pending leaves stay valid
+		std::vector<std::pair<MLeaf<T,NROUTES,LEAFCAP>*,std::vector<DBEntry<T>>>> pending;
+		route_batch(m_top, batch, pending);
+		std::set<MNode<T,NROUTES,LEAFCAP>*> fresh;
+		for (auto &p : pending){
+			store_batch(p.first, p.second, fresh);
+		}
+		m_count += n;
+
+		// with every entry stored, new internal nodes get their exact cover radii, deepest first
+		std::vector<std::pair<int,MNode<T,NROUTES,LEAFCAP>*>> by_depth;
+		for (auto node : fresh){
+			int depth = 0, rdx;
+			for (MNode<T,NROUTES,LEAFCAP> *p = node;p->GetParentNode(rdx) != NULL;p = p->GetParentNode(rdx)){
+				depth++;
+			}
+			by_depth.push_back({ depth, node });
+		}
+		std::sort(by_depth.begin(), by_depth.end(), std::greater<std::pair<int,MNode<T,NROUTES,LEAFCAP>*>>());
+		for (auto &nd : by_depth){
+			int rdx;
+			MInternal<T,NROUTES,LEAFCAP> *pnode = (MInternal<T,NROUTES,LEAFCAP>*)nd.second->GetParentNode(rdx);
+			if (pnode == NULL)
+				continue;
+			RoutingObject<T> route;
+			pnode->GetRoute(rdx, route);
+			route.cover_radius = subtree_radius(route.key, nd.second, 0);
+			if (m_concurrent) pnode->latch.lock();
+			pnode->ConfirmRoute(route, rdx);
+			if (m_concurrent) pnode->latch.unlock();
+		}
+	}
+
+	if (m_concurrent)
+		m_epoch.Reclaim();
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-const int mt::MTree<T,NROUTES,LEAFCAP>::DeleteEntry(const Entry<T> &entry){
-	MNode<T,NROUTES,LEAFCAP> *node = m_top;
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::route_batch(MNode<T,NROUTES,LEAFCAP> *node,
+	std::vector<DBEntry<T>> &entries,
+	std::vector<std::pair<MLeaf<T,NROUTES,LEAFCAP>*,std::vector<DBEntry<T>>>> &pending){
+	if (node->isleaf()){
+		pending.push_back({ (MLeaf<T,NROUTES,LEAFCAP>*)node, std::move(entries) });
+		return;
+	}
 
-	int count = 0;
-	while (node != NULL){
-		if (typeid(*node) == typeid(MInternal<T,NROUTES,LEAFCAP>)){
-			RoutingObject<T> robj;
-			((MInternal<T,NROUTES,LEAFCAP>*)node)->SelectRoute(entry.key, robj, false);
-			node = (MNode<T,NROUTES,LEAFCAP>*)robj.subtree;
-		} else if (typeid(*node) == typeid(MLeaf<T,NROUTES,LEAFCAP>)){
-			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)node;
-			count = leaf->DeleteEntry(entry.key);
-			node = NULL;
+	MInternal<T,NROUTES,LEAFCAP> *inode = (MInternal<T,NROUTES,LEAFCAP>*)node;
+	std::vector<DBEntry<T>> parts[NROUTES];
+	RoutingObject<T> robj;
+	// one latch hold for the node's whole share of the batch
+	if (m_concurrent) inode->latch.lock();
+	for (auto &e : entries){
+		const int rdx = inode->SelectRoute(e.key, robj, true, &e.d);
+		parts[rdx].push_back(std::move(e));
+	}
+	if (m_concurrent) inode->latch.unlock();
+	entries.clear();
+	entries.shrink_to_fit();
+
+	for (int i=0;i < m_nroutes;i++){
+		if (!parts[i].empty())
+			route_batch(inode->GetChildNode(i), parts[i], pending);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::store_batch(MLeaf<T,NROUTES,LEAFCAP> *leaf,
+																 std::vector<DBEntry<T>> &entries,
+																 std::set<MNode<T,NROUTES,LEAFCAP>*> &fresh){
+	if (leaf->size() + (int)entries.size() <= m_leafcap){
+		if (m_concurrent) leaf->latch.lock();
+		StoreEntries(leaf, entries);
+		if (m_concurrent) leaf->latch.unlock();
+		return;
+	}
+
+	// built on fresh leaves, so concurrent readers of the old leaf still see all of its entries
+	std::vector<DBEntry<T>> all;
+	leaf->GetEntries(all);
+	all.insert(all.end(), entries.begin(), entries.end());
+	entries.clear();
+
+	std::vector<RoutingObject<T>> routes;
+	split_leaves(all, routes);
+	replace_node(leaf, routes, &fresh);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::split_leaves(std::vector<DBEntry<T>> &entries,
+																  std::vector<RoutingObject<T>> &routes){
+	RoutingObject<T> robjs[2];
+	m_promote(entries, robjs[0], robjs[1]);
+
+	std::vector<DBEntry<T>> parts[2];
+	m_partition(entries, robjs[0], robjs[1], parts[0], parts[1]);
+
+	// many equal keys all fall on one side; halve them rather than peel off one per split
+	if (parts[0].empty() || parts[1].empty()){
+		const int j = parts[0].empty() ? 1 : 0;
+		if ((int)parts[j].size() > 2*m_leafcap){
+			entries.swap(parts[j]);
+			BalancedPartition()(entries, robjs[0], robjs[1], parts[0], parts[1]);
+		}
+	}
+	fill_empty(parts[0], parts[1], robjs[0], robjs[1]);
+
+	for (int j=0;j < 2;j++){
+		if ((int)parts[j].size() > m_leafcap){
+			split_leaves(parts[j], routes);
+			continue;
+		}
+		MLeaf<T,NROUTES,LEAFCAP> *leaf = m_leaves.New();
+		robjs[j].d = 0;
+		robjs[j].subtree = leaf;
+		StoreEntries(leaf, parts[j]);
+		routes.push_back(robjs[j]);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::sample_pivots(const std::vector<DBEntry<T>> &entries, int *idx,
+												 const int n, const int k, std::minstd_rand &gen,
+												 std::vector<RoutingObject<T>> &pivots){
+	const int n_samples = std::min(n, 4*k);
+
+	// partial shuffle brings a random sample to the front
+	for (int i=0;i < n_samples;i++){
+		std::uniform_int_distribution<int> distrib(i, n-1);
+		std::swap(idx[i], idx[distrib(gen)]);
+	}
+
+	// farthest-first traversal over the sample, from a pivot already in pivots when
+	// given, the routing object above, to which entries hold their distance d
+	std::vector<double> mind(n_samples, DBL_MAX);
+	int next = 0;
+	if (!pivots.empty()){
+		for (int i=0;i < n_samples;i++){
+			mind[i] = entries[idx[i]].d;
+			if (mind[i] > mind[next])
+				next = i;
+		}
+	}
+	for (int j=pivots.size();j < k;j++){
+		pivots.push_back({ entries[idx[next]].id, entries[idx[next]].key });
+		int maxpos = 0;
+		double maxd = -1;
+		for (int i=0;i < n_samples;i++){
+			double d = pivots.back().distance(entries[idx[i]].key);
+			if (d < mind[i]) mind[i] = d;
+			if (mind[i] > maxd){
+				maxpos = i;
+				maxd = mind[i];
+			}
+		}
+		next = maxpos;
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+mt::MNode<T,NROUTES,LEAFCAP>* mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::build(std::vector<DBEntry<T>> &entries,
+																	int *idx, const int n,
+																	const RoutingObject<T> *pobj,
+																	const int levels,
+																	std::minstd_rand &gen){
+	if (levels == 0){
+		assert(n <= m_leafcap);
+		MLeaf<T,NROUTES,LEAFCAP> *leaf = m_leaves.New();
+		for (int i=0;i < n;i++){
+			leaf->StoreEntry(entries[idx[i]]);
+		}
+		return leaf;
+	}
+
+	// the subtree gets as few leaves as hold its entries, and as many routes as spread them
+	// evenly over the levels left, but no fewer than hold them in subtrees one level down of
+	// at most cap leaves each, and two or more for two or more entries so no internal node
+	// has a lone route
+	int cap = 1;
+	for (int i=1;i < levels;i++) cap *= m_nroutes;
+	const int n_leaves = std::max((n + m_leafcap - 1)/m_leafcap, std::min(n, 2));
+	const int fanout = std::ceil(std::pow((double)n_leaves, 1.0/levels) - 1e-9);
+	const int k = std::max((n_leaves + cap - 1)/cap, std::min({ n_leaves, m_nroutes, std::max(fanout, 2) }));
+
+	// just above the leaves clusters are leaves, filled to leafcap. higher up a cluster
+	// holds what fits in its subtree and no more than 1.5 times an even share: packing
+	// them as tightly as the leaves forces many entries away from their nearest pivot
+	const int limit = (levels == 1) ? m_leafcap
+		: std::max((int)std::min(1.5*n/k, (double)cap*m_leafcap), (n + k - 1)/k);
+
+	// the routing object above is kept as the first pivot, to which entries already hold
+	// their distance
+	std::vector<RoutingObject<T>> pivots;
+	if (pobj != NULL)
+		pivots.push_back({ pobj->id, pobj->key });
+	sample_pivots(entries, idx, n, k, gen, pivots);
+	for (int j=0;j < k;j++){
+		pivots[j].d = (pobj != NULL && j > 0) ? pobj->distance(pivots[j].key) : 0;
+	}
+
+	// assign entries to nearest pivot
+	std::vector<double> dists(n*k);
+	std::vector<int> labels(n);
+	int counts[NROUTES] = { 0 };
+	for (int i=0;i < n;i++){
+		int best = 0;
+		for (int j=0;j < k;j++){
+			dists[i*k+j] = (pobj != NULL && j == 0) ? entries[idx[i]].d : pivots[j].distance(entries[idx[i]].key);
+			if (dists[i*k+j] < dists[i*k+best])
+				best = j;
+		}
+		labels[i] = best;
+		counts[best]++;
+	}
+
+	// evict entries from overfull clusters that lose the least by moving, i.e. with the
+	// smallest gap to their second nearest pivot, and place them at nearest pivot with room
+	std::vector<std::pair<double,int>> evicted;
+	for (int j=0;j < k;j++){
+		if (counts[j] <= limit)
+			continue;
+		std::vector<std::pair<double,int>> members;
+		for (int i=0;i < n;i++){
+			if (labels[i] != j)
+				continue;
+			double second = DBL_MAX;
+			for (int m=0;m < k;m++){
+				if (m != j && dists[i*k+m] < second)
+					second = dists[i*k+m];
+			}
+			members.push_back({ second - dists[i*k+j], i });
+		}
+		const int n_evict = counts[j] - limit;
+		std::nth_element(members.begin(), members.begin() + n_evict, members.end());
+		evicted.insert(evicted.end(), members.begin(), members.begin() + n_evict);
+		counts[j] = limit;
+	}
+	std::sort(evicted.begin(), evicted.end());
+	for (auto &ev : evicted){
+		const int i = ev.second;
+		int best = -1;
+		for (int j=0;j < k;j++){
+			if (counts[j] < limit && (best < 0 || dists[i*k+j] < dists[i*k+best]))
+				best = j;
+		}
+		labels[i] = best;
+		counts[best]++;
+	}
+
+	// group indices by cluster
+	int offsets[NROUTES+1] = { 0 };
+	int pos[NROUTES];
+	for (int j=0;j < k;j++){
+		offsets[j+1] = offsets[j] + counts[j];
+		pos[j] = offsets[j];
+	}
+	std::vector<int> grouped(n);
+	for (int i=0;i < n;i++){
+		const int j = labels[i];
+		const double d = dists[i*k+j];
+		entries[idx[i]].d = d;
+		if (d > pivots[j].cover_radius)
+			pivots[j].cover_radius = d;
+		grouped[pos[j]++] = idx[i];
+	}
+	std::copy(grouped.begin(), grouped.end(), idx);
+	std::vector<double>().swap(dists);
+	std::vector<int>().swap(labels);
+	std::vector<int>().swap(grouped);
+
+	MInternal<T,NROUTES,LEAFCAP> *internal = m_internals.New();
+	for (int j=0;j < k;j++){
+		if (counts[j] == 0)
+			continue;
+		MNode<T,NROUTES,LEAFCAP> *child = build(entries, idx + offsets[j], counts[j], &pivots[j], levels-1, gen);
+		pivots[j].subtree = child;
+		int rdx = internal->StoreRoute(pivots[j]);
+		internal->SetChildNode(child, rdx);
+	}
+	return internal;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::BulkLoad(std::vector<Entry<T>> &&entries){
+	Clear();
+
+	std::vector<DBEntry<T>> dbentries;
+	dbentries.reserve(entries.size());
+	for (auto &e : entries){
+		dbentries.push_back({ e.id, e.key, 0 });
+		m_exact.Adopt(dbentries.back().key);
+	}
+	std::vector<Entry<T>>().swap(entries);
+
+	if (dbentries.empty())
+		return;
+
+	if (is_pivoted<T>::value)
+		choose_pivots(dbentries);
+
+	std::vector<int> idx(dbentries.size());
+	for (int i=0;i < (int)idx.size();i++) idx[i] = i;
+
+	int levels = 0;
+	for (double capacity=m_leafcap;capacity < (double)dbentries.size();capacity *= m_nroutes)
+		levels++;
+
+	std::minstd_rand gen(dbentries.size());
+	m_top = build(dbentries, idx.data(), idx.size(), NULL, levels, gen);
+	m_count = dbentries.size();
+	m_has_pivots = is_pivoted<T>::value;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::save_node(std::ostream &out, const MNode<T,NROUTES,LEAFCAP> *node)const{
+	if (node->isleaf()){
+		std::vector<DBEntry<T>> entries;
+		((const MLeaf<T,NROUTES,LEAFCAP>*)node)->GetEntries(entries);
+		write_value<uint8_t>(out, 0);
+		write_value<int32_t>(out, entries.size());
+		for (auto &e : entries){
+			write_value<int64_t>(out, e.id);
+			write_value<double>(out, e.d);
+			Serializer<T>::write(out, e.key);
+		}
+	} else {
+		std::vector<RoutingObject<T>> routes;
+		((const MInternal<T,NROUTES,LEAFCAP>*)node)->GetRoutes(routes);
+		write_value<uint8_t>(out, 1);
+		write_value<int32_t>(out, routes.size());
+		for (auto &r : routes){
+			write_value<int64_t>(out, r.id);
+			write_value<double>(out, r.cover_radius);
+			write_value<double>(out, r.d);
+			Serializer<T>::write(out, r.key);
+		}
+		for (auto &r : routes){
+			save_node(out, (const MNode<T,NROUTES,LEAFCAP>*)r.subtree);
+		}
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+mt::MNode<T,NROUTES,LEAFCAP>* mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::load_node(std::istream &in, size_t &count){
+	const uint8_t kind = read_value<uint8_t>(in);
+	const int32_t n = read_value<int32_t>(in);
+
+	if (kind == 0){
+		if (n < 0 || n > m_leafcap)
+			throw std::runtime_error("corrupt mtree file: bad leaf size");
+		MLeaf<T,NROUTES,LEAFCAP> *leaf = m_leaves.New();
+		DBEntry<T> entry;
+		for (int i=0;i < n;i++){
+			entry.id = read_value<int64_t>(in);
+			entry.d = read_value<double>(in);
+			Serializer<T>::read(in, entry.key);
+			m_exact.Adopt(entry.key);
+			leaf->StoreEntry(entry);
+		}
+		count += n;
+		return leaf;
+	}
+
+	if (kind != 1 || n <= 0 || n > m_nroutes)
+		throw std::runtime_error("corrupt mtree file: bad internal node");
+
+	RoutingObject<T> routes[NROUTES];
+	for (int i=0;i < n;i++){
+		routes[i].id = read_value<int64_t>(in);
+		routes[i].cover_radius = read_value<double>(in);
+		routes[i].d = read_value<double>(in);
+		Serializer<T>::read(in, routes[i].key);
+		m_exact.Adopt(routes[i].key);
+	}
+	if (!in)
+		throw std::runtime_error("unexpected end of mtree file");
+
+	MInternal<T,NROUTES,LEAFCAP> *internal = m_internals.New();
+	for (int i=0;i < n;i++){
+		MNode<T,NROUTES,LEAFCAP> *child = load_node(in, count);
+		routes[i].subtree = child;
+		int rdx = internal->StoreRoute(routes[i]);
+		internal->SetChildNode(child, rdx);
+	}
+	return internal;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Save(const std::string &path)const{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("unable to open " + path + " for writing");
+
+	out.write("MTREE\0\0\0", 8);
+	write_value<uint32_t>(out, FILE_VERSION);
+	write_value<int32_t>(out, m_nroutes);
+	write_value<int32_t>(out, m_leafcap);
+	write_value<uint64_t>(out, m_count);
+	if (is_pivoted<T>::value){
+		write_value<uint8_t>(out, m_has_pivots);
+		for (auto &pivot : m_pivots){
+			Serializer<T>::write(out, pivot);
+		}
+	}
+
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	write_value<uint8_t>(out, top != NULL);
+	if (top != NULL)
+		save_node(out, top);
+
+	out.flush();
+	if (!out)
+		throw std::runtime_error("error writing " + path);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Load(const std::string &path){
+	Clear();
+
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("unable to open " + path + " for reading");
+
+	char magic[8];
+	if (!in.read(magic, 8) || std::string(magic, 8) != std::string("MTREE\0\0\0", 8))
+		throw std::runtime_error(path + " is not an mtree file");
+	if (read_value<uint32_t>(in) != FILE_VERSION)
+		throw std::runtime_error(path + ": unsupported mtree file version");
+	const int32_t nroutes = read_value<int32_t>(in);
+	const int32_t leafcap = read_value<int32_t>(in);
+	if (nroutes < 2 || nroutes > NROUTES || leafcap < 2 || leafcap > LEAFCAP)
+		throw std::runtime_error(path + ": saved with NROUTES=" + std::to_string(nroutes)
+								 + ", LEAFCAP=" + std::to_string(leafcap));
+	m_nroutes = nroutes;
+	m_leafcap = leafcap;
+	m_leaves.Reset(leafcap);
+	m_internals.Reset(nroutes);
+	const uint64_t n_entries = read_value<uint64_t>(in);
+
+	size_t count = 0;
+	try {
+		bool has_pivots = false;
+		if (is_pivoted<T>::value){
+			has_pivots = read_value<uint8_t>(in);
+			for (auto &pivot : m_pivots){
+				Serializer<T>::read(in, pivot);
+				m_exact.Adopt(pivot);
+			}
+		}
+		if (read_value<uint8_t>(in))
+			m_top = load_node(in, count);
+		if (count != n_entries)
+			throw std::runtime_error("corrupt mtree file: entry count mismatch");
+		m_has_pivots = has_pivots;
+	} catch (...){
+		Clear();
+		throw;
+	}
+	m_count = count;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::merge(MInternal<T,NROUTES,LEAFCAP> *pnode, const int rdx,
+														   std::vector<MNode<T,NROUTES,LEAFCAP>*> &replaced){
+	RoutingObject<T> robj;
+	pnode->GetRoute(rdx, robj);
+
+	// leaves and internal nodes may share a parent; only a node of the same kind will do
+	const bool leaf = pnode->GetChildNode(rdx)->isleaf();
+	int sdx = -1;
+	double min_dist = DBL_MAX;
+	for (int i=0;i < m_nroutes;i++){
+		if (i == rdx || pnode->GetChildNode(i) == NULL || pnode->GetChildNode(i)->isleaf() != leaf)
+			continue;
+		RoutingObject<T> route;
+		pnode->GetRoute(i, route);
+		const double d = robj.distance(route.key);
+		if (d < min_dist){
+			sdx = i;
+			min_dist = d;
+		}
+	}
+	if (sdx < 0)
+		return;
+
+	RoutingObject<T> sobj;
+	pnode->GetRoute(sdx, sobj);
+	MNode<T,NROUTES,LEAFCAP> *node = pnode->GetChildNode(rdx);
+	MNode<T,NROUTES,LEAFCAP> *sibling = pnode->GetChildNode(sdx);
+
+	// both routing objects are kept, so their distances to pnode's routing object are
+	// unchanged: the node is merged into its sibling when both fit, otherwise it takes
+	// the sibling's entries or routes nearest to it until it is no longer underfull
+	RoutingObject<T> robj1(sobj.id, sobj.key), robj2(robj.id, robj.key);
+	robj1.d = sobj.d;
+	robj2.d = robj.d;
+	bool both = false;
+	if (node->isleaf()){
+		std::vector<DBEntry<T>> entries, node_entries;
+		((MLeaf<T,NROUTES,LEAFCAP>*)sibling)->GetEntries(entries);
+		((MLeaf<T,NROUTES,LEAFCAP>*)node)->GetEntries(node_entries);
+
+		if ((int)(entries.size() + node_entries.size()) <= m_leafcap){
+			for (auto &e : node_entries){
+				e.d = robj1.distance(e.key);
+				entries.push_back(e);
+			}
 		} else {
-			throw std::logic_error("no such node type");
+			for (auto &e : entries){
+				e.d = robj2.distance(e.key);
+			}
+			std::sort(entries.begin(), entries.end(),
+					  [](const DBEntry<T> &a, const DBEntry<T> &b){ return a.d > b.d; });
+			while ((int)node_entries.size() < min_entries()){
+				node_entries.push_back(entries.back());
+				entries.pop_back();
+			}
+			for (auto &e : entries){
+				e.d = robj1.distance(e.key);
+			}
+
+			MLeaf<T,NROUTES,LEAFCAP> *leaf2 = m_leaves.New();
+			for (auto &e : node_entries){
+				robj2.cover_radius = std::max(robj2.cover_radius, e.d);
+			}
+			StoreEntries(leaf2, node_entries);
+			robj2.subtree = leaf2;
+			both = true;
 		}
-	};
+
+		MLeaf<T,NROUTES,LEAFCAP> *leaf1 = m_leaves.New();
+		for (auto &e : entries){
+			robj1.cover_radius = std::max(robj1.cover_radius, e.d);
+		}
+		StoreEntries(leaf1, entries);
+		robj1.subtree = leaf1;
+	} else {
+		std::vector<RoutingObject<T>> routes, node_routes;
+		((MInternal<T,NROUTES,LEAFCAP>*)sibling)->GetRoutes(routes);
+		((MInternal<T,NROUTES,LEAFCAP>*)node)->GetRoutes(node_routes);
+
+		if ((int)(routes.size() + node_routes.size()) <= m_nroutes){
+			routes.insert(routes.end(), node_routes.begin(), node_routes.end());
+		} else {
+			for (auto &route : routes){
+				route.d = robj2.distance(route.key);
+			}
+			std::sort(routes.begin(), routes.end(),
+					  [](const RoutingObject<T> &a, const RoutingObject<T> &b){ return a.d > b.d; });
+			while ((int)node_routes.size() < min_routes()){
+				node_routes.push_back(routes.back());
+				routes.pop_back();
+			}
+
+			MInternal<T,NROUTES,LEAFCAP> *internal2 = m_internals.New();
+			for (auto &route : node_routes){
+				route.d = robj2.distance(route.key);
+				int idx = internal2->StoreRoute(route);
+				internal2->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, idx);
+			}
+			robj2.cover_radius = subtree_radius(robj2.key, internal2, 0);
+			robj2.subtree = internal2;
+			both = true;
+		}
+
+		MInternal<T,NROUTES,LEAFCAP> *internal1 = m_internals.New();
+		for (auto &route : routes){
+			route.d = robj1.distance(route.key);
+			int idx = internal1->StoreRoute(route);
+			internal1->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, idx);
+		}
+		robj1.cover_radius = subtree_radius(robj1.key, internal1, 0);
+		robj1.subtree = internal1;
+	}
+
+	if (m_concurrent) pnode->latch.lock();
+	pnode->ConfirmRoute(robj1, sdx);
+	pnode->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)robj1.subtree, sdx);
+	if (both){
+		pnode->ConfirmRoute(robj2, rdx);
+		pnode->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)robj2.subtree, rdx);
+	} else {
+		pnode->RemoveRoute(rdx);
+	}
+	if (m_concurrent) pnode->latch.unlock();
+
+	replaced.push_back(node);
+	replaced.push_back(sibling);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::condense(MNode<T,NROUTES,LEAFCAP> *node,
+															  std::vector<MNode<T,NROUTES,LEAFCAP>*> &replaced){
+	while (!node->isroot()){
+		int rdx;
+		MInternal<T,NROUTES,LEAFCAP> *pnode = (MInternal<T,NROUTES,LEAFCAP>*)node->GetParentNode(rdx);
+		const int min_size = node->isleaf() ? min_entries() : min_routes();
+
+		if (node->size() == 0){
+			if (m_concurrent) pnode->latch.lock();
+			pnode->RemoveRoute(rdx);
+			if (m_concurrent) pnode->latch.unlock();
+			replaced.push_back(node);
+		} else if (node->size() < min_size && pnode->size() > 1){
+			merge(pnode, rdx, replaced);
+		} else {
+			// stored distances bound the subtree, so shrinking costs no distance computations
+			const double radius = node->isleaf() ? ((MLeaf<T,NROUTES,LEAFCAP>*)node)->CoverRadius()
+				: ((MInternal<T,NROUTES,LEAFCAP>*)node)->CoverRadius();
+			RoutingObject<T> route;
+			pnode->GetRoute(rdx, route);
+			if (m_concurrent) pnode->latch.lock();
+			if (radius < route.cover_radius){
+				route.cover_radius = radius;
+				pnode->ConfirmRoute(route, rdx);
+			}
+			pnode->RefreshRing(rdx);
+			if (m_concurrent) pnode->latch.unlock();
+		}
+		node = pnode;
+	}
+
+	// a root with one route gives way to a copy of its child, whose stored distances
+	// are to a routing object that no longer exists; readers may still be in the original
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	while (!top->isleaf() && top->size() <= 1){
+		MInternal<T,NROUTES,LEAFCAP> *root = (MInternal<T,NROUTES,LEAFCAP>*)top;
+		MNode<T,NROUTES,LEAFCAP> *child = NULL;
+		for (int i=0;i < m_nroutes && child == NULL;i++){
+			child = root->GetChildNode(i);
+		}
+
+		replaced.push_back(root);
+		if (child == NULL){
+			top = NULL;
+			break;
+		}
+
+		if (child->isleaf()){
+			std::vector<DBEntry<T>> entries;
+			((MLeaf<T,NROUTES,LEAFCAP>*)child)->GetEntries(entries);
+			for (auto &e : entries){
+				e.d = 0;
+			}
+			MLeaf<T,NROUTES,LEAFCAP> *leaf = m_leaves.New();
+			StoreEntries(leaf, entries);
+			top = leaf;
+		} else {
+			std::vector<RoutingObject<T>> routes;
+			((MInternal<T,NROUTES,LEAFCAP>*)child)->GetRoutes(routes);
+			MInternal<T,NROUTES,LEAFCAP> *internal = m_internals.New();
+			for (auto &route : routes){
+				route.d = 0;
+				int idx = internal->StoreRoute(route);
+				internal->SetChildNode((MNode<T,NROUTES,LEAFCAP>*)route.subtree, idx);
+			}
+			top = internal;
+		}
+		replaced.push_back(child);
+	}
+	m_top = top;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const int mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::DeleteEntry(const Entry<T> &entry){
+	std::unique_lock<std::mutex> lock(m_writer, std::defer_lock);
+	if (m_concurrent) lock.lock();
+
+	// covering balls overlap, so the key may sit under any route whose ball holds it;
+	// only this writer modifies nodes, so it reads them without latches
+	std::vector<std::pair<MLeaf<T,NROUTES,LEAFCAP>*,double>> leaves;
+	std::queue<NodeRef<T,NROUTES,LEAFCAP>> nodes;
+	QueryStats stats;
+	std::optional<T> buffer;
+	const T &key = with_pivots(entry.key, buffer, stats.n_distances);
+
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL)
+		nodes.push({ top, 0, 0 });
+
+	while (!nodes.empty()){
+		NodeRef<T,NROUTES,LEAFCAP> current = nodes.front();
+		nodes.pop();
+		if (!current.node->isleaf()){
+			((MInternal<T,NROUTES,LEAFCAP>*)current.node)->SelectRoutes(key, current.d, 0, nodes, stats);
+		} else {
+			leaves.push_back({ (MLeaf<T,NROUTES,LEAFCAP>*)current.node, current.d });
+		}
+	}
+	BuildCounter::Add(stats.n_distances);
+
+	int count = 0;
+	std::vector<MLeaf<T,NROUTES,LEAFCAP>*> changed;
+	for (auto &l : leaves){
+		if (m_concurrent) l.first->latch.lock();
+		const int n = l.first->DeleteEntry(entry.key, l.second);
+		if (m_concurrent) l.first->latch.unlock();
+		if (n > 0){
+			changed.push_back(l.first);
+			count += n;
+		}
+	}
+
+	// nodes replaced while condensing one leaf are retired only at the end,
+	// so a later leaf in changed can be checked against them
+	std::vector<MNode<T,NROUTES,LEAFCAP>*> replaced;
+	for (auto leaf : changed){
+		if (std::find(replaced.begin(), replaced.end(), leaf) == replaced.end())
+			condense(leaf, replaced);
+	}
+	for (auto n : replaced){
+		retire(n);
+	}
 
 	m_count -= count;
+	m_exact.Dropped(count);
+	if (m_exact.Due())
+		sweep_exact();
+
+	if (m_concurrent)
+		m_epoch.Reclaim();
+
 	return count;
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-void mt::MTree<T,NROUTES,LEAFCAP>::Clear(){
-	std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
-	if (m_top != NULL)
-		nodes.push(m_top);
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Clear(){
+	m_epoch.Drain();
 
-	while (!nodes.empty()){
-		MNode<T,NROUTES,LEAFCAP> *current = nodes.front();
-		if (typeid(*current) == typeid(MInternal<T,NROUTES,LEAFCAP>)){
-			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current;
-			for (int i=0;i < NROUTES;i++){
-				MNode<T,NROUTES,LEAFCAP> *child = current->GetChildNode(i);
-				if (child) nodes.push(child);
+	// keys owning resources need their destructors run, otherwise just drop the slabs
+	if (!std::is_trivially_destructible<T>::value){
+		std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
+		if (m_top != NULL)
+			nodes.push(m_top);
+
+		while (!nodes.empty()){
+			MNode<T,NROUTES,LEAFCAP> *current = nodes.front();
+			if (!current->isleaf()){
+				for (int i=0;i < m_nroutes;i++){
+					MNode<T,NROUTES,LEAFCAP> *child = current->GetChildNode(i);
+					if (child) nodes.push(child);
+				}
 			}
-			delete internal;		
-		} else if (typeid(*current) == typeid(MLeaf<T,NROUTES,LEAFCAP>)){
-			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current;
-			delete leaf;
+			delete_node(this, current);
+			nodes.pop();
+		}
+	}
+
+	m_leaves.Release();
+	m_internals.Release();
+	m_exact.Clear();
+	m_top = NULL;
+	m_count = 0;
+	m_has_pivots = false;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::sweep_exact(){
+	if constexpr (has_exact_key<T>::value){
+		// only the writer modifies nodes, so it reads them without latches
+		std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
+		MNode<T,NROUTES,LEAFCAP> *top = m_top;
+		if (top != NULL)
+			nodes.push(top);
+		while (!nodes.empty()){
+			MNode<T,NROUTES,LEAFCAP> *current = nodes.front();
+			nodes.pop();
+			if (current->isleaf()){
+				const MLeaf<T,NROUTES,LEAFCAP> *leaf = (const MLeaf<T,NROUTES,LEAFCAP>*)current;
+				for (int i=0;i < leaf->size();i++)
+					m_exact.Mark(leaf->Key(i));
+			} else {
+				const MInternal<T,NROUTES,LEAFCAP> *internal = (const MInternal<T,NROUTES,LEAFCAP>*)current;
+				for (int i=0;i < m_nroutes;i++){
+					MNode<T,NROUTES,LEAFCAP> *child = internal->GetChildNode(i);
+					if (child == NULL)
+						continue;
+					m_exact.Mark(internal->Route(i).key);
+					nodes.push(child);
+				}
+			}
+		}
+		for (auto &pivot : m_pivots){
+			m_exact.Mark(pivot);
+		}
+
+		// readers may still hold keys from deleted entries until the epoch moves on
+		std::vector<uint32_t> *slots = m_exact.Collect();
+		if (m_concurrent){
+			m_epoch.Retire(slots, &m_exact, &ExactStore<T>::Release);
 		} else {
-			throw std::logic_error("no such node type");
+			ExactStore<T>::Release(&m_exact, slots);
 		}
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+mt::FrozenMTree<T,NROUTES,LEAFCAP> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Freeze()const{
+	std::optional<EpochManager::Guard> guard;
+	if (m_concurrent) guard.emplace(m_epoch);
+
+	const int n_pivots = m_has_pivots ? is_pivoted<T>::count : 0;
+	return FrozenMTree<T,NROUTES,LEAFCAP>(m_top, m_pivots.data(), n_pivots);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::Entry<T>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::RangeQuery(T query, const double radius,
+																		  QueryStats *stats)const{
+	std::vector<Entry<T>> results;
+	RangeQuery(query, radius, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Visitor>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::RangeQuery(const T &query, const double radius, Visitor &&visit,
+											  QueryStats *stats)const{
+	std::optional<EpochManager::Guard> guard;
+	if (m_concurrent) guard.emplace(m_epoch);
+
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	std::optional<T> buffer;
+	const T &q = with_pivots(query, buffer, qstats.n_distances);
+
+	// each queued node carries the query's distance to its routing object, computed
+	// when its parent selected it, so the parent distance filter costs nothing
+	std::queue<NodeRef<T,NROUTES,LEAFCAP>> nodes;
+
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL)
+		nodes.push({ top, 0, 0 });
+
+	while (!nodes.empty()){
+		NodeRef<T,NROUTES,LEAFCAP> current = nodes.front();
 		nodes.pop();
+		MTREE_STAT(qstats.n_nodes++);
+		if (m_concurrent) current.node->latch.lock_shared();
+		if (!current.node->isleaf()){
+			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current.node;
+			internal->SelectRoutes(q, current.d, radius, nodes, qstats);
+		} else {
+			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current.node;
+			leaf->VisitEntries(q, current.d, radius, visit, qstats);
+		}
+		if (m_concurrent) current.node->latch.unlock_shared();
 	}
-	m_count = 0;
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-const std::vector<mt::Entry<T>> mt::MTree<T,NROUTES,LEAFCAP>::RangeQuery(T query, const double radius)const{
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::Entry<T>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::ApproxRangeQuery(const T &query,
+																				 const double radius,
+																				 const SearchLimits &limits,
+																				 QueryStats *stats)const{
 	std::vector<Entry<T>> results;
-	std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
+	ApproxRangeQuery(query, radius, limits, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Visitor>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::ApproxRangeQuery(const T &query, const double radius,
+													const SearchLimits &limits, Visitor &&visit,
+													QueryStats *stats)const{
+	std::optional<EpochManager::Guard> guard;
+	if (m_concurrent) guard.emplace(m_epoch);
+
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	std::optional<T> buffer;
+	const T &q = with_pivots(query, buffer, qstats.n_distances);
 
-	if (m_top != NULL)
-		nodes.push(m_top);
+	// best-first rather than breadth-first, so a budget is spent on the subtrees
+	// most likely to hold matches
+	NodeQueue<T,NROUTES,LEAFCAP> nodes;
+	const double shrink = limits.shrink();
+	unsigned long n_distances = 0, n_nodes = 0;
+
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL)
+		nodes.push({ top, 0, 0 });
 
 	while (!nodes.empty()){
-		MNode<T,NROUTES,LEAFCAP> *current = nodes.front();
-		if (typeid(*current) == typeid(MInternal<T,NROUTES,LEAFCAP>)){
-			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current;
-			internal->SelectRoutes(query, radius, nodes);
-		} else if (typeid(*current) == typeid(MLeaf<T,NROUTES,LEAFCAP>)){
-			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current;
-			leaf->SelectEntries(query, radius, results);
+		if (limits.exhausted(n_distances, n_nodes)){
+			MTREE_STAT(qstats.n_truncated++);
+			break;
+		}
+		NodeRef<T,NROUTES,LEAFCAP> current = nodes.top();
+		nodes.pop();
+		MTREE_STAT(qstats.n_nodes++);
+		n_nodes++;
+		if (m_concurrent) current.node->latch.lock_shared();
+		if (!current.node->isleaf()){
+			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current.node;
+			n_distances += internal->SelectRoutes(q, current.d, radius, nodes, qstats, shrink);
 		} else {
-			throw std::logic_error("no such node type");
+			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current.node;
+			n_distances += leaf->VisitEntries(q, current.d, radius, visit, qstats);
+		}
+		if (m_concurrent) current.node->latch.unlock_shared();
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename E>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::knn_search(const T &query, const int k, std::priority_queue<E> &heap,
+											  QueryStats &stats, const SearchLimits &limits)const{
+	NodeQueue<T,NROUTES,LEAFCAP> nodes;
+	const double shrink = limits.shrink();
+	unsigned long n_distances = 0, n_nodes = 0;
+
+	double radius = DBL_MAX;
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL && k > 0)
+		nodes.push({ top, 0, 0 });
+
+	while (!nodes.empty()){
+		if (limits.bound != NULL)
+			radius = std::min(radius, limits.bound->get());
+		NodeRef<T,NROUTES,LEAFCAP> current = nodes.top();
+		if (current.dmin > radius)
+			break;
+		if (limits.exhausted(n_distances, n_nodes)){
+			MTREE_STAT(stats.n_truncated++);
+			break;
 		}
 		nodes.pop();
+		MTREE_STAT(stats.n_nodes++);
+		n_nodes++;
+		if (m_concurrent) current.node->latch.lock_shared();
+		if (!current.node->isleaf()){
+			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current.node;
+			n_distances += internal->SelectRoutes(query, current.d, radius, nodes, stats, shrink);
+		} else {
+			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current.node;
+			n_distances += leaf->SelectEntries(query, current.d, k, radius, heap, stats);
+			if (limits.bound != NULL && (int)heap.size() == k)
+				limits.bound->Tighten(radius);
+		}
+		if (m_concurrent) current.node->latch.unlock_shared();
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename E, typename Visitor>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::visit_sorted(std::priority_queue<E> &heap, Visitor &visit){
+	std::vector<E> sorted(heap.size());
+	for (int i=(int)heap.size()-1;i >= 0;i--){
+		sorted[i] = heap.top();
+		heap.pop();
+	}
+	for (auto &e : sorted){
+		visit(e.id, key_of(e), e.dist);
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::NNEntry<T>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::KNNQuery(const T &query, const int k,
+																		   QueryStats *stats)const{
+	std::vector<NNEntry<T>> results;
+	KNNQuery(query, k, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key, dist });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Visitor>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::KNNQuery(const T &query, const int k, Visitor &&visit,
+											QueryStats *stats)const{
+	// unlimited budget and no shrinking make the search exact
+	ApproxKNNQuery(query, k, SearchLimits(), visit, stats);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::NNEntry<T>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::ApproxKNNQuery(const T &query, const int k,
+																				 const SearchLimits &limits,
+																				 QueryStats *stats)const{
+	std::vector<NNEntry<T>> results;
+	ApproxKNNQuery(query, k, limits, [&](const long long id, const T &key, const double dist){
+		results.push_back({ id, key, dist });
+	}, stats);
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Visitor>
+void mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::ApproxKNNQuery(const T &query, const int k, const SearchLimits &limits,
+												  Visitor &&visit, QueryStats *stats)const{
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	std::optional<T> buffer;
+	const T &q = with_pivots(query, buffer, qstats.n_distances);
+
+	// concurrent writers may overwrite leaf slots once a latch is released,
+	// so candidates hold copies of their keys in that mode
+	if (m_concurrent){
+		EpochManager::Guard guard(m_epoch);
+		std::priority_queue<NNEntry<T>> heap;
+		knn_search(q, k, heap, qstats, limits);
+		visit_sorted(heap, visit);
+	} else {
+		std::priority_queue<NNRef<T>> heap;
+		knn_search(q, k, heap, qstats, limits);
+		visit_sorted(heap, visit);
 	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<std::vector<mt::Entry<T>>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::BatchRangeQuery(const std::vector<T> &queries,
+																						   const double radius,
+																						   ThreadPool &pool)const{
+	std::vector<std::vector<Entry<T>>> results(queries.size());
+	pool.ParallelFor(queries.size(), [&](size_t i){
+		results[i] = RangeQuery(queries[i], radius);
+	});
 	return results;
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-const size_t mt::MTree<T,NROUTES,LEAFCAP>::size()const{
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<std::vector<mt::NNEntry<T>>> mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::BatchKNNQuery(const std::vector<T> &queries,
+																						   const int k,
+																						   ThreadPool &pool)const{
+	std::vector<std::vector<NNEntry<T>>> results(queries.size());
+	pool.ParallelFor(queries.size(), [&](size_t i){
+		results[i] = KNNQuery(queries[i], k);
+	});
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const size_t mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::size()const{
 	return m_count;
 }
 
-template<typename T, int NROUTES, int LEAFCAP>
-const size_t mt::MTree<T,NROUTES,LEAFCAP>::memory_usage()const{
-	std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
-	if (m_top != NULL)
-		nodes.push(m_top);
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+size_t mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::key_heap_bytes()const{
+	if constexpr (!has_heap_bytes<T>::value){
+		return m_exact.bytes();
+	} else {
+		std::optional<EpochManager::Guard> guard;
+		if (m_concurrent) guard.emplace(m_epoch);
 
-	int n_internal = 0, n_leaf = 0, n_entry = 0;
-	while (!nodes.empty()){
-		MNode<T,NROUTES,LEAFCAP> *node = nodes.front();
-		if (typeid(*node) == typeid(MInternal<T,NROUTES,LEAFCAP>)){
-				n_internal++;
-				for (int i=0;i < NROUTES;i++){
-					MNode<T,NROUTES,LEAFCAP> *child = node->GetChildNode(i);
+		size_t bytes = 0;
+		std::queue<MNode<T,NROUTES,LEAFCAP>*> nodes;
+		MNode<T,NROUTES,LEAFCAP> *top = m_top;
+		if (top != NULL)
+			nodes.push(top);
+		while (!nodes.empty()){
+			MNode<T,NROUTES,LEAFCAP> *current = nodes.front();
+			nodes.pop();
+			if (m_concurrent) current->latch.lock_shared();
+			if (current->isleaf()){
+				bytes += ((MLeaf<T,NROUTES,LEAFCAP>*)current)->HeapBytes();
+			} else {
+				bytes += ((MInternal<T,NROUTES,LEAFCAP>*)current)->HeapBytes();
+				for (int i=0;i < m_nroutes;i++){
+					MNode<T,NROUTES,LEAFCAP> *child = current->GetChildNode(i);
 					if (child) nodes.push(child);
 				}
-		} else if (typeid(*node) == typeid(MLeaf<T,NROUTES,LEAFCAP>)){
-			n_leaf++;
-			n_entry += node->size();
+			}
+			if (m_concurrent) current->latch.unlock_shared();
 		}
+		return bytes + m_exact.bytes();
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const size_t mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::memory_usage()const{
+	ArenaStats astats = allocator_stats();
+	return astats.bytes_reserved + astats.bytes_overhead + key_heap_bytes()
+		+ sizeof(MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const mt::TreeStats mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Stats()const{
+	std::optional<EpochManager::Guard> guard;
+	if (m_concurrent) guard.emplace(m_epoch);
+
+	TreeStats tstats;
+	tstats.fanout.assign(m_nroutes+1, 0);
+	tstats.leaf_fill.assign(m_leafcap+1, 0);
+	std::vector<std::vector<double>> radii;
+
+	std::queue<std::pair<MNode<T,NROUTES,LEAFCAP>*,size_t>> nodes;
+	MNode<T,NROUTES,LEAFCAP> *top = m_top;
+	if (top != NULL)
+		nodes.push({ top, 0 });
+
+	while (!nodes.empty()){
+		MNode<T,NROUTES,LEAFCAP> *current = nodes.front().first;
+		const size_t level = nodes.front().second;
 		nodes.pop();
+		if (tstats.levels.size() <= level){
+			tstats.levels.resize(level+1);
+			radii.resize(level+1);
+		}
+		LevelStats &lstats = tstats.levels[level];
+		lstats.n_nodes++;
+
+		if (m_concurrent) current->latch.lock_shared();
+		const int n = current->size();
+		lstats.n_slots += n;
+		if (current->isleaf()){
+			MLeaf<T,NROUTES,LEAFCAP> *leaf = (MLeaf<T,NROUTES,LEAFCAP>*)current;
+			lstats.n_leaves++;
+			tstats.n_leaves++;
+			tstats.n_entries += n;
+			tstats.leaf_fill[std::min(n, m_leafcap)]++;
+			tstats.bytes_keys += leaf->HeapBytes();
+		} else {
+			MInternal<T,NROUTES,LEAFCAP> *internal = (MInternal<T,NROUTES,LEAFCAP>*)current;
+			tstats.n_internal++;
+			tstats.fanout[std::min(n, m_nroutes)]++;
+			tstats.bytes_keys += internal->HeapBytes();
+			if (tstats.levels.size() <= level+1){
+				tstats.levels.resize(level+2);
+				radii.resize(level+2);
+			}
+			LevelStats &below = tstats.levels[level+1];
+
+			// balls of two siblings cannot meet when their distances to the parent's
+			// routing object already differ by more than both radii
+			for (int i=0;i < m_nroutes;i++){
+				const RoutingObject<T> &ri = internal->Route(i);
+				if (ri.subtree == NULL) continue;
+				radii[level+1].push_back(ri.cover_radius);
+				nodes.push({ (MNode<T,NROUTES,LEAFCAP>*)ri.subtree, level+1 });
+				for (int j=i+1;j < m_nroutes;j++){
+					const RoutingObject<T> &rj = internal->Route(j);
+					if (rj.subtree == NULL) continue;
+					below.n_sibling_pairs++;
+					const double reach = ri.cover_radius + rj.cover_radius;
+					if (std::abs(ri.d - rj.d) > reach) continue;
+					tstats.n_distances++;
+					if (ri.key.distance(rj.key) <= reach)
+						below.n_overlapping++;
+				}
+			}
+		}
+		if (m_concurrent) current->latch.unlock_shared();
 	}
 
-	return (n_internal*sizeof(MInternal<T,NROUTES,LEAFCAP>) + n_leaf*sizeof(MLeaf<T,NROUTES,LEAFCAP>)
-			+ m_count*sizeof(DBEntry<T>) + sizeof(MTree<T,NROUTES,LEAFCAP>));
+	for (size_t l=0;l < radii.size();l++){
+		std::vector<double> &r = radii[l];
+		if (r.empty()) continue;
+		std::sort(r.begin(), r.end());
+		for (int q=0;q <= 10;q++){
+			tstats.levels[l].radius.push_back(r[(r.size()-1)*q/10]);
+		}
+	}
+
+	tstats.height = tstats.levels.size();
+	if (tstats.n_leaves > 0)
+		tstats.mean_leaf_fill = (double)tstats.n_entries/(tstats.n_leaves*m_leafcap);
+
+	tstats.bytes_keys += m_exact.bytes();
+
+	ArenaStats astats = allocator_stats();
+	tstats.bytes_nodes = astats.bytes_in_use;
+	tstats.bytes_free = astats.bytes_reserved - astats.bytes_in_use;
+	tstats.bytes_total = astats.bytes_reserved + astats.bytes_overhead + tstats.bytes_keys
+		+ sizeof(MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>);
+	return tstats;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const mt::ArenaStats mt::MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::allocator_stats()const{
+	ArenaStats stats = m_leaves.stats();
+	stats += m_internals.stats();
+	return stats;
 }
 
 #endif
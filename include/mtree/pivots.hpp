@@ -0,0 +1,173 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _PIVOTS_H
+#define _PIVOTS_H
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include "mtree/entry.hpp"
+#include "mtree/serialize.hpp"
+
+namespace mt {
+
+	/**
+	 * key K with its distances to P global pivots, as in the PM-tree
+	 * a tree over Pivoted<K,P> keys picks the pivots itself and fills in pd: queries take
+	 * P pivot distances once, then skip entries and subtrees whose pivot distances rule
+	 * them out before calling K::distance
+	 **/
+	template<typename K, int P>
+	struct Pivoted {
+		static_assert(P > 0, "Pivoted needs at least one pivot");
+
+		float pd[P];    // below 0 until measured, which turns pivot pruning off
+		K key;
+
+		Pivoted(){}
+		Pivoted(const K &key):key(key){
+			std::fill(pd, pd + P, -1.0f);
+		}
+
+		const double distance(const Pivoted &other)const{
+			return key.distance(other.key);
+		}
+
+		static void distance_many(const Pivoted &query, const Pivoted *const keys[], const int n, double out[]){
+			const int block = 64;
+			const K *ks[block];
+			for (int i=0;i < n;i += block){
+				const int m = std::min(block, n - i);
+				for (int j=0;j < m;j++) ks[j] = &keys[i+j]->key;
+				mt::distance_many(query.key, ks, m, out + i);
+			}
+		}
+
+		size_t heap_bytes()const{
+			return mt::heap_bytes(key);
+		}
+
+		template<typename KK = K, typename = std::enable_if_t<has_distance_bound<KK>::value>>
+		double distance_bound(const Pivoted &query)const{
+			return key.distance_bound(query.key);
+		}
+	};
+
+	template<typename T>
+	struct is_pivoted : std::false_type {
+		static constexpr int count = 0;
+	};
+
+	template<typename K, int P>
+	struct is_pivoted<Pivoted<K,P>> : std::true_type {
+		static constexpr int count = P;
+	};
+
+	/**
+	 * least and greatest distance from each pivot to any entry under a route, the
+	 * PM-tree's hyper-ring; routes over Pivoted keys carry one (see RoutingObject)
+	 **/
+	template<typename K, int P>
+	struct PivotRing<Pivoted<K,P>> {
+		float lo[P];
+		float hi[P];
+
+		PivotRing(){
+			Reset();
+		}
+
+		void Reset(){
+			std::fill(lo, lo + P, FLT_MAX);
+			std::fill(hi, hi + P, 0.0f);
+		}
+
+		void Extend(const Pivoted<K,P> &key){
+			for (int p=0;p < P;p++){
+				lo[p] = std::min(lo[p], key.pd[p]);
+				hi[p] = std::max(hi[p], key.pd[p]);
+			}
+		}
+
+		void Extend(const PivotRing &other){
+			for (int p=0;p < P;p++){
+				lo[p] = std::min(lo[p], other.lo[p]);
+				hi[p] = std::max(hi[p], other.hi[p]);
+			}
+		}
+	};
+
+	// pivot distances are kept as floats; FLT_EPSILON of their size covers the rounding,
+	// so the bounds below never exceed the true distance
+	inline double pivot_slack(const double a, const double b){
+		return FLT_EPSILON*(a + b);
+	}
+
+	// lower bound on the distance between query and key from their pivot distances
+	template<typename T>
+	inline double pivot_bound(const T &query, const T &key){
+		if constexpr (is_pivoted<T>::value){
+			if (query.pd[0] < 0)
+				return 0;
+			double bound = 0;
+			for (int p=0;p < is_pivoted<T>::count;p++){
+				const double gap = std::abs(query.pd[p] - key.pd[p]) - pivot_slack(query.pd[p], key.pd[p]);
+				bound = std::max(bound, gap);
+			}
+			return bound;
+		} else {
+			return 0;
+		}
+	}
+
+	// lower bound on the distance between query and any entry within ring
+	template<typename T>
+	inline double pivot_bound(const T &query, const PivotRing<T> &ring){
+		if constexpr (is_pivoted<T>::value){
+			if (query.pd[0] < 0)
+				return 0;
+			double bound = 0;
+			for (int p=0;p < is_pivoted<T>::count;p++){
+				const double gap = std::max(ring.lo[p] - query.pd[p], query.pd[p] - ring.hi[p])
+					- pivot_slack(query.pd[p], ring.hi[p]);
+				bound = std::max(bound, gap);
+			}
+			return bound;
+		} else {
+			return 0;
+		}
+	}
+
+	template<typename K, int P>
+	struct Serializer<Pivoted<K,P>> {
+		static void write(std::ostream &out, const Pivoted<K,P> &key){
+			Serializer<K>::write(out, key.key);
+			out.write((const char*)key.pd, sizeof(key.pd));
+		}
+		static void read(std::istream &in, Pivoted<K,P> &key){
+			Serializer<K>::read(in, key.key);
+			in.read((char*)key.pd, sizeof(key.pd));
+		}
+	};
+}
+
+#endif /* _PIVOTS_H */
@@ -0,0 +1,355 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _QUANTIZE_H
+#define _QUANTIZE_H
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+#include "mtree/entry.hpp"
+#include "mtree/pivots.hpp"
+#include "mtree/serialize.hpp"
+
+namespace mt {
+
+#ifdef __FLT16_MAX__
+	typedef _Float16 half;
+#endif
+
+	/**
+	 * euclidean key K stored compressed: DIM coordinates as int8 codes scaled to the key's
+	 * largest magnitude, or as CODE (float, or half where the compiler has _Float16), next
+	 * to a pointer to the exact key.
+	 * K needs a data() member returning its DIM coordinates, and distance() must be the
+	 * euclidean distance over them.  Leaves hold only codes and pointers, so scans stay in a
+	 * few cache lines per entry; the exact keys live apart, in a store owned by the tree
+	 * (ExactStore below), and are read only for entries the codes cannot rule out.
+	 * Distances, and so all results, stay exact.
+	 * A key made from K points at it, which must outlive the key until it is inserted or
+	 * the query made with it returns; the tree copies the exact key into its store on
+	 * insert.  Keys in results point into the store and stay valid while their entry is in
+	 * the tree.
+	 **/
+	template<typename K, int DIM, typename CODE = int8_t>
+	struct Quantized {
+		static_assert(DIM > 0, "Quantized needs at least one coordinate");
+
+		typedef K exact_type;
+		static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+		CODE code[DIM];
+		float scale;                      // int8 codes: coordinate i is code[i]*scale, within scale/2
+		uint32_t slot;                    // of exact in the tree's store, NO_SLOT outside one
+		const K *exact;
+
+		Quantized():scale(0),slot(NO_SLOT),exact(NULL){}
+		Quantized(const K &key):slot(NO_SLOT),exact(&key){
+			const auto *v = key.data();
+			if constexpr (std::is_same<CODE, int8_t>::value){
+				double maxabs = 0;
+				for (int i=0;i < DIM;i++){
+					maxabs = std::max(maxabs, std::abs((double)v[i]));
+				}
+				scale = maxabs/127;
+				for (int i=0;i < DIM;i++){
+					const long c = (scale > 0) ? std::lround(v[i]/(double)scale) : 0;
+					code[i] = (int8_t)std::clamp(c, -127L, 127L);
+				}
+			} else {
+				scale = 1;
+				for (int i=0;i < DIM;i++){
+					code[i] = (CODE)v[i];
+				}
+			}
+		}
+
+		const K& get()const{
+			return *exact;
+		}
+
+		const double distance(const Quantized &other)const{
+			return exact->distance(*other.exact);
+		}
+
+		static void distance_many(const Quantized &query, const Quantized *const keys[], const int n, double out[]){
+			const int block = 64;
+			const K *ks[block];
+			for (int i=0;i < n;i += block){
+				const int m = std::min(block, n - i);
+				// exact keys are apart from the node; start fetching all of them before the first is needed
+				for (int j=0;j < m;j++){
+					ks[j] = keys[i+j]->exact;
+					for (size_t b=0;b < sizeof(K);b += 64) __builtin_prefetch((const char*)ks[j] + b);
+				}
+				mt::distance_many(*query.exact, ks, m, out + i);
+			}
+		}
+
+		// euclidean distance from query's exact coordinates to the box of values these
+		// codes could have come from; in float, which vectorizes, so each term gives up
+		// float rounding of the query coordinate on top of the code's own error
+		double distance_bound(const Quantized &query)const{
+			const auto *q = query.exact->data();
+			float sum = 0;
+			for (int i=0;i < DIM;i++){
+				const float qi = (float)q[i];
+				const float gap = std::abs(qi - decode(i)) - error(i) - std::abs(qi)*(2*FLT_EPSILON);
+				sum += std::max(gap, 0.0f)*std::max(gap, 0.0f);
+			}
+			return std::sqrt(sum)*(1 - DIM*FLT_EPSILON);
+		}
+
+	private:
+		float decode(const int i)const{
+			return (float)code[i]*scale;
+		}
+
+		// most a coordinate can differ from its decoded code, with room for rounding
+		float error(const int i)const{
+			if constexpr (std::is_same<CODE, int8_t>::value){
+				return scale*(0.5f + 256*FLT_EPSILON);
+			} else if constexpr (std::is_same<CODE, float>::value){
+				return std::abs(code[i])*FLT_EPSILON + 2*FLT_MIN;
+			}
+#ifdef __FLT16_MAX__
+			else if constexpr (std::is_same<CODE, half>::value){
+				return std::abs((float)code[i])*0x1p-10f + 0x1p-24f;    // half epsilon and least subnormal
+			}
+#endif
+			else {
+				static_assert(std::is_same<CODE, int8_t>::value, "Quantized codes are int8_t, float or half");
+				return 0;
+			}
+		}
+	};
+
+	// codes and the exact key; a key read points at a copy of its exact key that lasts
+	// until the next read on the thread, and trees take it into their store straight away
+	template<typename K, int DIM, typename CODE>
+	struct Serializer<Quantized<K,DIM,CODE>> {
+		static void write(std::ostream &out, const Quantized<K,DIM,CODE> &key){
+			out.write((const char*)key.code, sizeof(key.code));
+			out.write((const char*)&key.scale, sizeof(key.scale));
+			Serializer<K>::write(out, *key.exact);
+		}
+		static void read(std::istream &in, Quantized<K,DIM,CODE> &key){
+			static thread_local K exact;
+			in.read((char*)key.code, sizeof(key.code));
+			in.read((char*)&key.scale, sizeof(key.scale));
+			Serializer<K>::read(in, exact);
+			key.slot = Quantized<K,DIM,CODE>::NO_SLOT;
+			key.exact = &exact;
+		}
+	};
+
+	// the Quantized key within a key, itself or the key a Pivoted wraps
+	template<typename K, int DIM, typename CODE>
+	inline Quantized<K,DIM,CODE>& quantized_part(Quantized<K,DIM,CODE> &key){
+		return key;
+	}
+
+	template<typename K, int DIM, typename CODE>
+	inline const Quantized<K,DIM,CODE>& quantized_part(const Quantized<K,DIM,CODE> &key){
+		return key;
+	}
+
+	template<typename K, int P>
+	inline auto quantized_part(Pivoted<K,P> &key) -> decltype(quantized_part(key.key)){
+		return quantized_part(key.key);
+	}
+
+	template<typename K, int P>
+	inline auto quantized_part(const Pivoted<K,P> &key) -> decltype(quantized_part(key.key)){
+		return quantized_part(key.key);
+	}
+
+	// exact key type of keys with a Quantized part, kept in an ExactStore by trees over them
+	template<typename T, typename = void>
+	struct has_exact_key : std::false_type {};
+
+	template<typename T>
+	struct has_exact_key<T, std::void_t<decltype(quantized_part(std::declval<T&>()))>> : std::true_type {
+		typedef typename std::remove_reference_t<decltype(quantized_part(std::declval<T&>()))>::exact_type type;
+	};
+
+	// that exact key type, char for other keys
+	template<typename T, bool = has_exact_key<T>::value>
+	struct exact_key {
+		typedef char type;
+	};
+
+	template<typename T>
+	struct exact_key<T, true> {
+		typedef typename has_exact_key<T>::type type;
+	};
+
+	/**
+	 * exact keys of a tree's Quantized keys, in slots of fixed chunks: keys inserted
+	 * together sit side by side, and a slot never moves, so readers follow key pointers
+	 * without latches.  Keys copied into routes, pivots or results share their entry's
+	 * slot.  Deletes only count the slots they leave behind; once those reach a quarter of
+	 * the store, the tree marks every slot its keys still point at and hands the rest to
+	 * Release, through its epoch reclaimer when readers run concurrently.  Writer only.
+	 * Trees over other keys hold the empty store, whose calls do nothing
+	 **/
+	template<typename T, typename = void>
+	class ExactStore {
+	public:
+		const T& Adopt(const T &key, std::optional<T> &buffer){ return key; }
+		void Adopt(T &key){}
+		void Dropped(const size_t n){}
+		bool Due()const{ return false; }
+		void Mark(const T &key){}
+		std::vector<uint32_t>* Collect(){ return NULL; }
+		static void Release(void *store, void *slots){}
+		size_t bytes()const{ return 0; }
+		void Clear(){}
+	};
+
+	template<typename T>
+	class ExactStore<T, std::enable_if_t<has_exact_key<T>::value>> {
+	private:
+
+		typedef typename has_exact_key<T>::type K;
+
+		static constexpr uint32_t CHUNK = 1024;
+		enum : uint8_t { FREE, LIVE, RETIRED };
+
+		std::vector<std::unique_ptr<K[]>> m_chunks;
+		std::vector<uint8_t> m_state;
+		std::vector<bool> m_marks;
+		std::vector<uint32_t> m_free;     // freed slots, reused before new ones
+		size_t m_live = 0;
+		size_t m_dropped = 0;             // entries deleted since the last Collect
+
+		K& at(const uint32_t slot){
+			return m_chunks[slot/CHUNK][slot%CHUNK];
+		}
+
+	public:
+
+		// key as stored by the tree: with its exact key copied into a slot, in buffer
+		const T& Adopt(const T &key, std::optional<T> &buffer){
+			if (!buffer || &key != &*buffer)
+				buffer.emplace(key);
+			Adopt(*buffer);
+			return *buffer;
+		}
+
+		// copy key's exact key into a slot and point key at it
+		void Adopt(T &key){
+			auto &q = quantized_part(key);
+			uint32_t slot;
+			if (!m_free.empty()){
+				slot = m_free.back();
+				m_free.pop_back();
+			} else {
+				slot = m_state.size();
+				if (slot % CHUNK == 0)
+					m_chunks.emplace_back(new K[CHUNK]);
+				m_state.push_back(FREE);
+			}
+			at(slot) = *q.exact;
+			m_state[slot] = LIVE;
+			m_live++;
+			q.slot = slot;
+			q.exact = &at(slot);
+		}
+
+		// n entries deleted; their slots may still be shared by routes
+		void Dropped(const size_t n){
+			m_dropped += n;
+		}
+
+		// enough slots may have been let go to be worth a sweep
+		bool Due()const{
+			return m_dropped >= std::max((size_t)64, m_live/4);
+		}
+
+		// key's slot is still in use
+		void Mark(const T &key){
+			const uint32_t slot = quantized_part(key).slot;
+			if (slot >= m_state.size())
+				return;
+			if (m_marks.size() < m_state.size())
+				m_marks.resize(m_state.size(), false);
+			m_marks[slot] = true;
+		}
+
+		// live slots not marked since the last Collect, now retired for Release to free
+		std::vector<uint32_t>* Collect(){
+			std::vector<uint32_t> *slots = new std::vector<uint32_t>();
+			for (uint32_t i=0;i < m_state.size();i++){
+				if (m_state[i] == LIVE && (i >= m_marks.size() || !m_marks[i])){
+					m_state[i] = RETIRED;
+					slots->push_back(i);
+				}
+			}
+			m_live -= slots->size();
+			m_marks.clear();
+			m_dropped = 0;
+			return slots;
+		}
+
+		// give back slots from Collect once no reader can reach them
+		static void Release(void *store, void *slots){
+			ExactStore *s = (ExactStore*)store;
+			std::vector<uint32_t> *released = (std::vector<uint32_t>*)slots;
+			for (uint32_t slot : *released){
+				if constexpr (!std::is_trivially_destructible<K>::value)
+					s->at(slot) = K();
+				s->m_state[slot] = FREE;
+				s->m_free.push_back(slot);
+			}
+			delete released;
+		}
+
+		size_t bytes()const{
+			size_t bytes = m_chunks.size()*CHUNK*sizeof(K) + m_state.capacity() + m_free.capacity()*sizeof(uint32_t);
+			if constexpr (has_heap_bytes<K>::value){
+				for (uint32_t i=0;i < m_state.size();i++){
+					if (m_state[i] != FREE)
+						bytes += heap_bytes(m_chunks[i/CHUNK][i%CHUNK]);
+				}
+			}
+			return bytes;
+		}
+
+		// drop every slot; the tree holds no keys, and no reader any
+		void Clear(){
+			m_chunks.clear();
+			m_state.clear();
+			m_marks.clear();
+			m_free.clear();
+			m_live = 0;
+			m_dropped = 0;
+		}
+	};
+}
+
+#endif /* _QUANTIZE_H */
@@ -0,0 +1,71 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _SERIALIZE_H
+#define _SERIALIZE_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace mt {
+
+	/**
+	 * writes and reads a key of type T in binary form
+	 * the default copies the bytes of trivially copyable keys; specialize it for
+	 * any other key type:
+	 *     template<> struct mt::Serializer<KeyObject> {
+	 *         static void write(std::ostream &out, const KeyObject &key);
+	 *         static void read(std::istream &in, KeyObject &key);
+	 *     };
+	 **/
+	template<typename T>
+	struct Serializer {
+		static_assert(std::is_trivially_copyable<T>::value,
+					  "specialize mt::Serializer<T> for keys that are not trivially copyable");
+
+		static void write(std::ostream &out, const T &key){
+			out.write((const char*)&key, sizeof(T));
+		}
+		static void read(std::istream &in, T &key){
+			in.read((char*)&key, sizeof(T));
+		}
+	};
+
+	// fixed-size values in host byte order
+	template<typename V>
+	inline void write_value(std::ostream &out, const V &val){
+		static_assert(std::is_trivially_copyable<V>::value, "write_value needs a trivially copyable type");
+		out.write((const char*)&val, sizeof(V));
+	}
+
+	template<typename V>
+	inline V read_value(std::istream &in){
+		static_assert(std::is_trivially_copyable<V>::value, "read_value needs a trivially copyable type");
+		V val;
+		if (!in.read((char*)&val, sizeof(V)))
+			throw std::runtime_error("unexpected end of mtree file");
+		return val;
+	}
+}
+
+#endif /* _SERIALIZE_H */
@@ -0,0 +1,404 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _SHARDED_H
+#define _SHARDED_H
+
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mtree/mtree.hpp"
+
+namespace mt {
+
+	// how a ShardedMTree places entries: by a hash of the id, which spreads them evenly,
+	// or with the shard whose pivot is nearest the key, which lets queries skip shards
+	enum ShardRouting { SHARD_BY_HASH, SHARD_BY_PIVOT };
+
+	/**
+	 * n independent MTrees behind one index, so builds and queries use many cores
+	 * BulkLoad and InsertBatch build the shards in parallel; RangeQuery and KNNQuery fan out
+	 * over the shards and merge, k-NN searches sharing one KNNBound so each shard prunes
+	 * by the best k found anywhere.  work runs on the tree's own ThreadPool, which takes one
+	 * fan-out at a time: queries from several threads are safe but wait on each other.
+	 * like MTree without concurrent mode, no query may run during an update
+	 **/
+	template<typename T, int NROUTES=4, int LEAFCAP=50,
+			 typename PROMOTE=FarthestPromote, typename PARTITION=HyperplanePartition>
+	class ShardedMTree {
+	private:
+
+		typedef MTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION> Shard;
+
+		std::vector<std::unique_ptr<Shard>> m_shards;
+
+		const ShardRouting m_routing;
+
+		// SHARD_BY_PIVOT: one pivot per shard, and the largest distance from each pivot to an
+		// entry ever put in its shard; deletes leave it as is, so it only ever overestimates
+		std::vector<T> m_pivots;
+		std::vector<double> m_cover;
+
+		mutable ThreadPool m_pool;
+
+		static size_t hash_id(const long long id);
+
+		// pick pivots farthest-first over a sample of entries
+		void choose_pivots(const std::vector<Entry<T>> &entries);
+
+		// shard for each entry, growing the pivots' cover radii to take them in
+		void assign(const std::vector<Entry<T>> &entries, std::vector<int> &shards);
+
+		// distance from query to each pivot, added to stats
+		std::vector<double> pivot_distances(const T &query, QueryStats &stats)const;
+
+		// hand each shard its part of entries, then run build(shard, part) on every
+		// shard with a part, in parallel
+		template<typename Build>
+		void distribute(std::vector<Entry<T>> &&entries, Build build);
+
+	public:
+
+		// throws std::invalid_argument unless n_shards >= 1 and n_threads >= 1
+		explicit ShardedMTree(const int n_shards, const ShardRouting routing = SHARD_BY_HASH,
+							  const int n_threads = std::thread::hardware_concurrency());
+
+		ShardedMTree(const ShardedMTree&) = delete;
+		ShardedMTree& operator=(const ShardedMTree&) = delete;
+
+		// replace contents with entries, each shard bulk loaded in parallel; with
+		// SHARD_BY_PIVOT, pivots are chosen anew, far apart over entries
+		void BulkLoad(std::vector<Entry<T>> &&entries);
+
+		// with SHARD_BY_PIVOT, until every shard has a pivot each key not equal to one
+		// becomes the pivot of the next shard
+		void Insert(const Entry<T> &entry);
+
+		// MTree::InsertBatch on every shard at once
+		void InsertBatch(const std::vector<Entry<T>> &entries);
+
+		// remove every entry with entry's key, from every shard that can hold it
+		const int DeleteEntry(const Entry<T> &entry);
+
+		void Clear();
+
+		// queries add the distance computations, nodes and pruning of every shard to stats,
+		// and the pivot distances taken to skip shards
+		const std::vector<Entry<T>> RangeQuery(const T &query, const double radius, QueryStats *stats = NULL)const;
+
+		// k nearest neighbors of query over all shards, sorted by ascending distance
+		const std::vector<NNEntry<T>> KNNQuery(const T &query, const int k, QueryStats *stats = NULL)const;
+
+		const size_t size()const;
+
+		const size_t memory_usage()const;
+
+		int n_shards()const{ return (int)m_shards.size(); }
+
+		const Shard& shard(const int i)const{ return *m_shards[i]; }
+	};
+}
+
+/**
+ *  ShardedMTree implementation code
+ *
+ **/
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::ShardedMTree(const int n_shards, const ShardRouting routing,
+																	const int n_threads)
+	:m_routing(routing),m_pool(std::max(n_threads, 1)){
+	if (n_shards < 1)
+		throw std::invalid_argument("n_shards must be at least 1");
+	if (n_threads < 1)
+		throw std::invalid_argument("n_threads must be at least 1");
+	for (int i=0;i < n_shards;i++){
+		m_shards.emplace_back(new Shard());
+	}
+	m_cover.assign(n_shards, 0);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+size_t mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::hash_id(const long long id){
+	// splitmix64 finalizer, so ids in any pattern spread evenly
+	uint64_t x = (uint64_t)id;
+	x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+	return (size_t)(x ^ (x >> 31));
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::choose_pivots(const std::vector<Entry<T>> &entries){
+	const size_t n_shards = m_shards.size();
+	m_pivots.clear();
+	m_cover.assign(n_shards, 0);
+	if (entries.empty())
+		return;
+
+	const size_t n_samples = std::min(entries.size(), (size_t)1000);
+	const size_t stride = entries.size()/n_samples;
+	std::vector<double> mind(n_samples, DBL_MAX);
+	size_t next = 0;
+	while (m_pivots.size() < n_shards){
+		m_pivots.push_back(entries[next*stride].key);
+		double maxd = -1;
+		for (size_t i=0;i < n_samples;i++){
+			mind[i] = std::min(mind[i], m_pivots.back().distance(entries[i*stride].key));
+			if (mind[i] > maxd){
+				next = i;
+				maxd = mind[i];
+			}
+		}
+		BuildCounter::Add(n_samples);
+		// fewer distinct samples than shards: the rest are left without a pivot until inserts
+		if (maxd <= 0)
+			break;
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::assign(const std::vector<Entry<T>> &entries,
+																   std::vector<int> &shards){
+	const size_t n = entries.size();
+	shards.resize(n);
+	if (m_routing == SHARD_BY_HASH){
+		for (size_t i=0;i < n;i++){
+			shards[i] = (int)(hash_id(entries[i].id) % m_shards.size());
+		}
+		return;
+	}
+
+	// each key not equal to a pivot takes a shard of its own while there are shards left
+	size_t i = 0;
+	for (;i < n && m_pivots.size() < m_shards.size();i++){
+		int nearest = -1;
+		for (size_t p=0;p < m_pivots.size() && nearest < 0;p++){
+			if (m_pivots[p].distance(entries[i].key) == 0)
+				nearest = (int)p;
+		}
+		BuildCounter::Add(m_pivots.size());
+		if (nearest < 0){
+			nearest = (int)m_pivots.size();
+			m_pivots.push_back(entries[i].key);
+		}
+		shards[i] = nearest;
+	}
+
+	// then the nearest pivot, over blocks of entries in parallel
+	const size_t first = i, block = 4096;
+	const size_t n_blocks = (n - first + block - 1)/block;
+	const size_t n_pivots = m_pivots.size();
+	std::vector<double> cover(n_blocks*n_pivots, 0);
+	m_pool.ParallelFor(n_blocks, [&](size_t b){
+		double *bcover = &cover[b*n_pivots];
+		const size_t end = std::min(n, first + (b + 1)*block);
+		for (size_t j=first + b*block;j < end;j++){
+			double mind = DBL_MAX;
+			for (size_t p=0;p < n_pivots;p++){
+				const double d = m_pivots[p].distance(entries[j].key);
+				if (d < mind){
+					mind = d;
+					shards[j] = (int)p;
+				}
+			}
+			bcover[shards[j]] = std::max(bcover[shards[j]], mind);
+		}
+		BuildCounter::Add((end - first - b*block)*n_pivots);
+	});
+	for (size_t b=0;b < n_blocks;b++){
+		for (size_t p=0;p < n_pivots;p++){
+			m_cover[p] = std::max(m_cover[p], cover[b*n_pivots + p]);
+		}
+	}
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+std::vector<double> mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::pivot_distances(const T &query,
+																						   QueryStats &stats)const{
+	std::vector<double> pd(m_shards.size(), 0);
+	if (m_routing == SHARD_BY_PIVOT){
+		for (size_t p=0;p < m_pivots.size();p++){
+			pd[p] = m_pivots[p].distance(query);
+		}
+		MTREE_STAT(stats.n_distances += m_pivots.size());
+	}
+	return pd;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+template<typename Build>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::distribute(std::vector<Entry<T>> &&entries, Build build){
+	std::vector<int> shards;
+	assign(entries, shards);
+
+	std::vector<std::vector<Entry<T>>> parts(m_shards.size());
+	for (size_t i=0;i < entries.size();i++){
+		parts[shards[i]].push_back(std::move(entries[i]));
+	}
+	entries.clear();
+	entries.shrink_to_fit();
+
+	m_pool.ParallelFor(m_shards.size(), [&](size_t s){
+		if (!parts[s].empty())
+			build(*m_shards[s], parts[s]);
+	});
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::BulkLoad(std::vector<Entry<T>> &&entries){
+	Clear();
+	if (m_routing == SHARD_BY_PIVOT)
+		choose_pivots(entries);
+	distribute(std::move(entries), [](Shard &shard, std::vector<Entry<T>> &part){
+		shard.BulkLoad(std::move(part));
+	});
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Insert(const Entry<T> &entry){
+	std::vector<Entry<T>> one = { entry };
+	std::vector<int> shards;
+	assign(one, shards);
+	m_shards[shards[0]]->Insert(entry);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::InsertBatch(const std::vector<Entry<T>> &entries){
+	distribute(std::vector<Entry<T>>(entries), [](Shard &shard, std::vector<Entry<T>> &part){
+		shard.InsertBatch(part);
+	});
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const int mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::DeleteEntry(const Entry<T> &entry){
+	// a key is not tied to one shard: hashing goes by id, and a pivot nearer than the one
+	// it was put with may have come after it
+	QueryStats qstats;
+	const std::vector<double> pd = pivot_distances(entry.key, qstats);
+	BuildCounter::Add(qstats.n_distances);
+
+	std::vector<int> counts(m_shards.size(), 0);
+	m_pool.ParallelFor(m_shards.size(), [&](size_t s){
+		if (m_routing == SHARD_BY_PIVOT && (s >= m_pivots.size() || pd[s] > m_cover[s]))
+			return;
+		counts[s] = m_shards[s]->DeleteEntry(entry);
+	});
+	return std::accumulate(counts.begin(), counts.end(), 0);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+void mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::Clear(){
+	for (auto &shard : m_shards){
+		shard->Clear();
+	}
+	m_pivots.clear();
+	m_cover.assign(m_shards.size(), 0);
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::Entry<T>> mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::RangeQuery(const T &query,
+																				  const double radius,
+																				  QueryStats *stats)const{
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	const std::vector<double> pd = pivot_distances(query, qstats);
+
+	std::vector<std::vector<Entry<T>>> parts(m_shards.size());
+	std::vector<QueryStats> shard_stats(m_shards.size());
+	m_pool.ParallelFor(m_shards.size(), [&](size_t s){
+		if (m_routing == SHARD_BY_PIVOT && (s >= m_pivots.size() || pd[s] > m_cover[s] + radius))
+			return;
+		parts[s] = m_shards[s]->RangeQuery(query, radius, &shard_stats[s]);
+	});
+
+	std::vector<Entry<T>> results;
+	for (size_t s=0;s < m_shards.size();s++){
+		results.insert(results.end(), parts[s].begin(), parts[s].end());
+		qstats += shard_stats[s];
+	}
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const std::vector<mt::NNEntry<T>> mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::KNNQuery(const T &query,
+																				  const int k,
+																				  QueryStats *stats)const{
+	QueryStats local;
+	QueryStats &qstats = (stats != NULL) ? *stats : local;
+	const std::vector<double> pd = pivot_distances(query, qstats);
+
+	// shards are taken up in order, so with pivots the nearest start first and tighten
+	// the bound early
+	std::vector<size_t> order(m_shards.size());
+	std::iota(order.begin(), order.end(), 0);
+	if (m_routing == SHARD_BY_PIVOT){
+		std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b){
+			return pd[a] - m_cover[a] < pd[b] - m_cover[b];
+		});
+	}
+
+	KNNBound bound;
+	const SearchLimits limits(0, 0, 0, &bound);
+	std::vector<std::vector<NNEntry<T>>> parts(m_shards.size());
+	std::vector<QueryStats> shard_stats(m_shards.size());
+	m_pool.ParallelFor(m_shards.size(), [&](size_t i){
+		const size_t s = order[i];
+		if (m_routing == SHARD_BY_PIVOT && (s >= m_pivots.size() || pd[s] - m_cover[s] > bound.get()))
+			return;
+		parts[s] = m_shards[s]->ApproxKNNQuery(query, k, limits, &shard_stats[s]);
+	});
+
+	std::vector<NNEntry<T>> results;
+	for (size_t s=0;s < m_shards.size();s++){
+		results.insert(results.end(), parts[s].begin(), parts[s].end());
+		qstats += shard_stats[s];
+	}
+	std::sort(results.begin(), results.end(), [](const NNEntry<T> &a, const NNEntry<T> &b){
+		return a.dist < b.dist;
+	});
+	if ((int)results.size() > k)
+		results.resize(std::max(k, 0));
+	return results;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const size_t mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::size()const{
+	size_t n = 0;
+	for (auto &shard : m_shards){
+		n += shard->size();
+	}
+	return n;
+}
+
+template<typename T, int NROUTES, int LEAFCAP, typename PROMOTE, typename PARTITION>
+const size_t mt::ShardedMTree<T,NROUTES,LEAFCAP,PROMOTE,PARTITION>::memory_usage()const{
+	size_t n = m_pivots.capacity()*sizeof(T) + m_cover.capacity()*sizeof(double);
+	for (auto &shard : m_shards){
+		n += sizeof(Shard) + shard->memory_usage();
+	}
+	return n;
+}
+
+#endif /* _SHARDED_H */
@@ -0,0 +1,283 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _SPLIT_H
+#define _SPLIT_H
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cfloat>
+#include "mtree/entry.hpp"
+
+namespace mt {
+
+	/**
+	 * split policies, passed to MTree as the PROMOTE and PARTITION template parameters
+	 *
+	 * promote policies choose the keys of two new routing objects from the entries of
+	 * an overflowing node:
+	 *     void operator()(const std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1,
+	 *                     RoutingObject<T> &robj2);
+	 * entries[i].d is the distance to the node's current routing object (0 at the root)
+	 *
+	 * partition policies move entries into entries1 and entries2, setting each entry's d
+	 * to its new routing object and each routing object's cover_radius:
+	 *     void operator()(std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1,
+	 *                     RoutingObject<T> &robj2, std::vector<DBEntry<T>> &entries1,
+	 *                     std::vector<DBEntry<T>> &entries2);
+	 *
+	 * distances go through RoutingObject::distance, so they count as build operations
+	 **/
+
+	// repeatedly jump to the entry farthest from the current pick, 5 rounds
+	struct FarthestPromote {
+		template<typename T>
+		void operator()(const std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2);
+	};
+
+	// two distinct entries at random, no distance computations
+	struct RandomPromote {
+		std::minstd_rand gen;
+		template<typename T>
+		void operator()(const std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2);
+	};
+
+	// mM_RAD over a random sample: of all pairs among NSAMPLES sampled entries, the pair
+	// whose nearest pivot assignment gives the smallest larger covering radius
+	template<int NSAMPLES=5>
+	struct SampledMinMaxPromote {
+		std::minstd_rand gen;
+		template<typename T>
+		void operator()(const std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2);
+	};
+
+	// m_LB_DIST: the entries nearest to and farthest from the current routing object by
+	// stored distance d, no distance computations below the root
+	struct LBDistPromote {
+		template<typename T>
+		void operator()(const std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2);
+	};
+
+	// generalized hyperplane: each entry goes to its nearest routing object
+	struct HyperplanePartition {
+		template<typename T>
+		void operator()(std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2,
+						std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2);
+	};
+
+	// balanced: routing objects take turns claiming their nearest unassigned entry,
+	// so both sides get half the entries
+	struct BalancedPartition {
+		template<typename T>
+		void operator()(std::vector<DBEntry<T>> &entries, RoutingObject<T> &robj1, RoutingObject<T> &robj2,
+						std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2);
+	};
+}
+
+template<typename T>
+void mt::FarthestPromote::operator()(const std::vector<DBEntry<T>> &entries,
+									 RoutingObject<T> &robj1, RoutingObject<T> &robj2){
+	RoutingObject<T> routes[2];
+
+	int current = 0;
+	routes[current%2].key = entries[0].key;
+
+	const int n_iters = 5;
+	for (int i=0;i < n_iters;i++){
+		int maxpos = -1;
+		double maxd = 0;
+		const int slimit = entries.size();
+		for (int j=0;j < slimit;j++){
+			double d = routes[current%2].distance(entries[j].key);
+			if (d > maxd){
+				maxpos = j;
+				maxd = d;
+			}
+		}
+		if (maxpos < 0)     // all entries identical
+			maxpos = 0;
+		routes[++current%2].key = entries[maxpos].key;
+	}
+
+	robj1.key = routes[0].key;
+	robj2.key = routes[1].key;
+	robj1.d = 0;
+	robj2.d = 0;
+}
+
+template<typename T>
+void mt::RandomPromote::operator()(const std::vector<DBEntry<T>> &entries,
+								   RoutingObject<T> &robj1, RoutingObject<T> &robj2){
+	const int n = entries.size();
+	std::uniform_int_distribution<int> first(0, n-1);
+	std::uniform_int_distribution<int> second(0, n-2);
+	const int i = first(gen);
+	int j = second(gen);
+	if (j >= i) j++;
+
+	robj1 = RoutingObject<T>(entries[i].id, entries[i].key);
+	robj2 = RoutingObject<T>(entries[j].id, entries[j].key);
+}
+
+template<int NSAMPLES>
+template<typename T>
+void mt::SampledMinMaxPromote<NSAMPLES>::operator()(const std::vector<DBEntry<T>> &entries,
+													RoutingObject<T> &robj1, RoutingObject<T> &robj2){
+	const int n = entries.size();
+	const int s = std::min(n, NSAMPLES);
+
+	// partial shuffle of indices brings the sample to the front
+	std::vector<int> idx(n);
+	for (int i=0;i < n;i++) idx[i] = i;
+	for (int i=0;i < s;i++){
+		std::uniform_int_distribution<int> distrib(i, n-1);
+		std::swap(idx[i], idx[distrib(gen)]);
+	}
+
+	std::vector<double> dists(s*n);
+	for (int a=0;a < s;a++){
+		RoutingObject<T> robj(entries[idx[a]].id, entries[idx[a]].key);
+		for (int i=0;i < n;i++){
+			dists[a*n+i] = robj.distance(entries[i].key);
+		}
+	}
+
+	int best1 = 0, best2 = (s > 1) ? 1 : 0;
+	double best = DBL_MAX;
+	for (int a=0;a < s;a++){
+		for (int b=a+1;b < s;b++){
+			double r1 = 0, r2 = 0;
+			for (int i=0;i < n;i++){
+				const double d1 = dists[a*n+i], d2 = dists[b*n+i];
+				if (d1 < d2){
+					if (d1 > r1) r1 = d1;
+				} else {
+					if (d2 > r2) r2 = d2;
+				}
+			}
+			if (std::max(r1, r2) < best){
+				best = std::max(r1, r2);
+				best1 = a;
+				best2 = b;
+			}
+		}
+	}
+
+	robj1 = RoutingObject<T>(entries[idx[best1]].id, entries[idx[best1]].key);
+	robj2 = RoutingObject<T>(entries[idx[best2]].id, entries[idx[best2]].key);
+}
+
+template<typename T>
+void mt::LBDistPromote::operator()(const std::vector<DBEntry<T>> &entries,
+								   RoutingObject<T> &robj1, RoutingObject<T> &robj2){
+	const int n = entries.size();
+	int minpos = 0, maxpos = 0;
+	for (int i=1;i < n;i++){
+		if (entries[i].d < entries[minpos].d) minpos = i;
+		if (entries[i].d > entries[maxpos].d) maxpos = i;
+	}
+
+	// no routing object above the root, so d carries no information there:
+	// take the entry farthest from an arbitrary one instead
+	if (entries[minpos].d == entries[maxpos].d){
+		RoutingObject<T> robj(entries[0].id, entries[0].key);
+		double maxd = -1;
+		minpos = 0;
+		for (int i=1;i < n;i++){
+			const double d = robj.distance(entries[i].key);
+			if (d > maxd){
+				maxpos = i;
+				maxd = d;
+			}
+		}
+	}
+
+	robj1 = RoutingObject<T>(entries[minpos].id, entries[minpos].key);
+	robj2 = RoutingObject<T>(entries[maxpos].id, entries[maxpos].key);
+}
+
+template<typename T>
+void mt::HyperplanePartition::operator()(std::vector<DBEntry<T>> &entries,
+										 RoutingObject<T> &robj1, RoutingObject<T> &robj2,
+										 std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2){
+	double radius1 = 0;
+	double radius2 = 0;
+	for (int i=0;i < (int)entries.size();i++){
+		double d1 = robj1.distance(entries[i].key); //distance(entries[i].key, robj1.key);
+		double d2 = robj2.distance(entries[i].key); //distance(entries[i].key, robj2.key);
+		if (d1 < d2){
+			entries1.push_back({ entries[i].id, entries[i].key, d1 });
+			if (d1 > radius1) radius1 = d1;
+		} else {
+			entries2.push_back({ entries[i].id, entries[i].key, d2 });
+			if (d2 > radius2) radius2 = d2;
+		}
+	}
+
+	robj1.cover_radius = radius1;
+	robj2.cover_radius = radius2;
+	entries.clear();
+}
+
+template<typename T>
+void mt::BalancedPartition::operator()(std::vector<DBEntry<T>> &entries,
+									   RoutingObject<T> &robj1, RoutingObject<T> &robj2,
+									   std::vector<DBEntry<T>> &entries1, std::vector<DBEntry<T>> &entries2){
+	const int n = entries.size();
+	std::vector<std::pair<double,int>> near1(n), near2(n);
+	for (int i=0;i < n;i++){
+		near1[i] = { robj1.distance(entries[i].key), i };
+		near2[i] = { robj2.distance(entries[i].key), i };
+	}
+	std::vector<double> d1(n), d2(n);
+	for (int i=0;i < n;i++){
+		d1[i] = near1[i].first;
+		d2[i] = near2[i].first;
+	}
+	std::sort(near1.begin(), near1.end());
+	std::sort(near2.begin(), near2.end());
+
+	std::vector<bool> taken(n, false);
+	double radius1 = 0;
+	double radius2 = 0;
+	int p1 = 0, p2 = 0;
+	for (int count=0;count < n;count++){
+		if (count % 2 == 0){
+			while (taken[near1[p1].second]) p1++;
+			const int i = near1[p1].second;
+			taken[i] = true;
+			entries1.push_back({ entries[i].id, entries[i].key, d1[i] });
+			if (d1[i] > radius1) radius1 = d1[i];
+		} else {
+			while (taken[near2[p2].second]) p2++;
+			const int i = near2[p2].second;
+			taken[i] = true;
+			entries2.push_back({ entries[i].id, entries[i].key, d2[i] });
+			if (d2[i] > radius2) radius2 = d2[i];
+		}
+	}
+
+	robj1.cover_radius = radius1;
+	robj2.cover_radius = radius2;
+	entries.clear();
+}
+
+#endif /* _SPLIT_H */
@@ -0,0 +1,242 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <cfloat>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+
+// define MTREE_NO_STATS to compile out all counting
+#ifdef MTREE_NO_STATS
+#define MTREE_STAT(expr) ((void)0)
+#else
+#define MTREE_STAT(expr) ((void)(expr))
+#endif
+
+namespace mt {
+
+	/**
+	 * counters for a single query, filled in when passed to RangeQuery or KNNQuery
+	 **/
+	struct QueryStats {
+		unsigned long n_distances;      // distance computations
+		unsigned long n_nodes;          // nodes visited
+		unsigned long n_pruned_parent;  // entries and routes skipped by the parent distance bound
+		unsigned long n_pruned_cover;   // routes whose covering ball misses the query
+		unsigned long n_pruned_pivot;   // entries and routes skipped by pivot distances (pivots.hpp)
+		unsigned long n_pruned_bound;   // entries and routes skipped by the key's distance_bound (quantize.hpp)
+		unsigned long n_truncated;      // approximate queries stopped by their budget
+
+		QueryStats():n_distances(0),n_nodes(0),n_pruned_parent(0),n_pruned_cover(0),n_pruned_pivot(0),
+					 n_pruned_bound(0),n_truncated(0){}
+
+		QueryStats& operator+=(const QueryStats &other){
+			n_distances += other.n_distances;
+			n_nodes += other.n_nodes;
+			n_pruned_parent += other.n_pruned_parent;
+			n_pruned_cover += other.n_pruned_cover;
+			n_pruned_pivot += other.n_pruned_pivot;
+			n_pruned_bound += other.n_pruned_bound;
+			n_truncated += other.n_truncated;
+			return *this;
+		}
+	};
+
+	/**
+	 * k-th nearest distance shared by k-NN searches over parts of one data set, as the
+	 * shards of a ShardedMTree: a search holding k neighbors tightens it to its k-th
+	 * distance, and every search prunes by it, since nothing farther makes the merged k
+	 **/
+	struct KNNBound {
+		std::atomic<double> radius;
+
+		KNNBound():radius(DBL_MAX){}
+
+		double get()const{
+			return radius.load(std::memory_order_relaxed);
+		}
+
+		void Tighten(const double r){
+			double current = get();
+			while (r < current && !radius.compare_exchange_weak(current, r, std::memory_order_relaxed));
+		}
+	};
+
+	/**
+	 * bounds on an approximate query; a zero budget is unlimited
+	 * budgets are checked before each node, so a query may overrun by one node's distances
+	 **/
+	struct SearchLimits {
+		unsigned long max_distances;
+		unsigned long max_nodes;
+		double epsilon;                 // cover radii shrink by 1+epsilon when pruning
+		KNNBound *bound;                // shared with k-NN searches over other shards, when given;
+		                                // prunes without losing exactness
+
+		SearchLimits(const unsigned long max_distances=0, const unsigned long max_nodes=0, const double epsilon=0,
+					 KNNBound *bound=NULL)
+			:max_distances(max_distances),max_nodes(max_nodes),epsilon(epsilon),bound(bound){}
+
+		bool exhausted(const unsigned long n_distances, const unsigned long n_nodes)const{
+			return (max_distances > 0 && n_distances >= max_distances) || (max_nodes > 0 && n_nodes >= max_nodes);
+		}
+
+		double shrink()const{
+			return 1.0/(1.0 + epsilon);
+		}
+	};
+
+	/**
+	 * one level of a tree in TreeStats, the root being level 0
+	 * cover radii are those of the routes leading into the level's nodes, so level 0 has none
+	 **/
+	struct LevelStats {
+		size_t n_nodes;
+		size_t n_leaves;
+		size_t n_slots;                 // routes held by internal nodes plus entries held by leaves
+		std::vector<double> radius;     // cover radius quantiles 0%, 10%, ... 100%; empty at level 0
+		size_t n_sibling_pairs;         // pairs of routes sharing a parent, one level up
+		size_t n_overlapping;           // of those, pairs whose covering balls intersect
+
+		LevelStats():n_nodes(0),n_leaves(0),n_slots(0),n_sibling_pairs(0),n_overlapping(0){}
+
+		double overlap()const{
+			return n_sibling_pairs ? (double)n_overlapping/n_sibling_pairs : 0;
+		}
+	};
+
+	/**
+	 * shape and memory of a whole tree, from MTree::Stats()
+	 **/
+	struct TreeStats {
+		size_t n_entries;
+		size_t height;                  // levels, 0 when empty
+		size_t n_internal;
+		size_t n_leaves;
+		std::vector<LevelStats> levels;
+		std::vector<size_t> fanout;     // element i counts internal nodes with i routes
+		std::vector<size_t> leaf_fill;  // element i counts leaves with i entries
+		double mean_leaf_fill;          // entries per leaf over the leaf capacity
+
+		size_t bytes_nodes;             // node memory in use
+		size_t bytes_free;              // pool memory reserved but not in use
+		size_t bytes_keys;              // heap memory owned by keys (has_heap_bytes), exact keys included
+		size_t bytes_total;             // everything the tree holds, itself included
+
+		unsigned long n_distances;      // computed between sibling routes to measure overlap
+
+		TreeStats():n_entries(0),height(0),n_internal(0),n_leaves(0),mean_leaf_fill(0),
+					bytes_nodes(0),bytes_free(0),bytes_keys(0),bytes_total(0),n_distances(0){}
+	};
+
+	/**
+	 * process-wide count of distance computations made while building trees
+	 * each thread adds to its own cache line; Total() sums every thread's count on demand
+	 **/
+	class BuildCounter {
+	private:
+
+		struct alignas(64) Slot {
+			std::atomic<unsigned long> count;
+			Slot():count(0){}
+		};
+
+		// slots outlive their threads so Total() keeps their counts; exited
+		// threads hand their slot on to the next thread that starts counting
+		struct Registry {
+			std::mutex mtx;
+			std::vector<std::unique_ptr<Slot>> slots;
+			std::vector<Slot*> unused;
+			std::atomic<unsigned long> base;
+			Registry():base(0){}
+		};
+
+		struct Handle {
+			Slot *slot;
+			Handle();
+			~Handle();
+		};
+
+		static Registry& registry(){
+			static Registry reg;
+			return reg;
+		}
+
+		static Slot& local(){
+			thread_local Handle handle;
+			return *handle.slot;
+		}
+
+		static unsigned long sum();
+
+	public:
+
+		// only the owning thread writes its slot, so no read-modify-write is needed
+		static void Add(const unsigned long n){
+#ifndef MTREE_NO_STATS
+			Slot &slot = local();
+			slot.count.store(slot.count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#endif
+		}
+
+		// build distance computations since the last Reset
+		static unsigned long Total(){
+			return sum() - registry().base.load();
+		}
+
+		static void Reset(){
+			registry().base.store(sum());
+		}
+	};
+}
+
+inline mt::BuildCounter::Handle::Handle(){
+	Registry &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mtx);
+	if (!reg.unused.empty()){
+		slot = reg.unused.back();
+		reg.unused.pop_back();
+	} else {
+		reg.slots.emplace_back(new Slot());
+		slot = reg.slots.back().get();
+	}
+}
+
+inline mt::BuildCounter::Handle::~Handle(){
+	Registry &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mtx);
+	reg.unused.push_back(slot);
+}
+
+inline unsigned long mt::BuildCounter::sum(){
+	Registry &reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mtx);
+	unsigned long total = 0;
+	for (auto &slot : reg.slots){
+		total += slot->count.load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+#endif /* _STATS_H */
@@ -0,0 +1,141 @@
+/**
+    MTree distance-based indexing structure
+    Copyright (C) 2022  David G. Starkweather starkdg@gmx.com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+**/
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace mt {
+
+	/**
+	 * fixed set of worker threads for running index-parallel loops
+	 * the calling thread joins in, so a pool of n threads runs n-1 workers
+	 **/
+	class ThreadPool {
+	private:
+
+		std::vector<std::thread> workers;
+
+		std::mutex call_mtx;   // serializes ParallelFor callers
+		std::mutex mtx;
+		std::condition_variable cv_start, cv_done;
+
+		std::function<void(size_t)> job;
+		size_t n_items;
+		std::atomic<size_t> next;
+		unsigned long generation;
+		int n_busy;
+		bool stop;
+
+		void drain();
+
+		void run();
+
+	public:
+
+		ThreadPool(const int n_threads = std::thread::hardware_concurrency());
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		const int size()const;
+
+		// call fn(i) for i in [0, n) across the pool; returns when all calls are done
+		void ParallelFor(const size_t n, std::function<void(size_t)> fn);
+	};
+}
+
+inline mt::ThreadPool::ThreadPool(const int n_threads)
+	:n_items(0),next(0),generation(0),n_busy(0),stop(false){
+	for (int i=1;i < n_threads;i++){
+		workers.emplace_back(&ThreadPool::run, this);
+	}
+}
+
+inline mt::ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv_start.notify_all();
+	for (auto &w : workers){
+		w.join();
+	}
+}
+
+inline const int mt::ThreadPool::size()const{
+	return workers.size() + 1;
+}
+
+inline void mt::ThreadPool::drain(){
+	size_t i;
+	while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n_items){
+		job(i);
+	}
+}
+
+inline void mt::ThreadPool::run(){
+	unsigned long seen = 0;
+	while (true){
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_start.wait(lock, [&]{ return stop || generation != seen; });
+			if (stop)
+				return;
+			seen = generation;
+			n_busy++;
+		}
+
+		drain();
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			n_busy--;
+		}
+		cv_done.notify_one();
+	}
+}
+
+inline void mt::ThreadPool::ParallelFor(const size_t n, std::function<void(size_t)> fn){
+	std::lock_guard<std::mutex> call_lock(call_mtx);
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_done.wait(lock, [&]{ return n_busy == 0; });
+		job = std::move(fn);
+		n_items = n;
+		next.store(0);
+		generation++;
+	}
+	cv_start.notify_all();
+
+	drain();
+
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_done.wait(lock, [&]{ return n_busy == 0; });
+}
+
+#endif /* _THREADPOOL_H */
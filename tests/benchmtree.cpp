@@ -0,0 +1,482 @@
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include "mtree/mtree.hpp"
+
+using namespace std;
+using namespace mt;
+
+const int NR = 4;
+const int LC = 50;
+
+static mt19937_64 m_gen(1);
+
+// vectors as read or generated, g_dim floats each
+static int g_dim = 16;
+static vector<float> g_vectors;
+
+// keys hold their vector inline, as an index would; other dimensions are padded
+// with zeros up to the next DIM, which leaves l2 distances unchanged
+template<int DIM>
+struct VecKey {
+	float v[DIM];
+	const double distance(const VecKey &other)const{
+		return l2(v, other.v, DIM);
+	}
+	static void distance_many(const VecKey &query, const VecKey *const keys[], const int n, double out[]){
+		l2_many(query.v, keys, n, DIM, [](const VecKey *k){ return k->v; }, out);
+	}
+};
+
+struct options {
+	string dataset = "uniform";   // uniform, clustered or a vector file
+	int n = 100000;               // entries indexed
+	int n_queries = 1000;
+	int k = 10;
+	double radius = -1;           // below 0: median k-th neighbour distance
+	int n_mixed = 10000;
+	int n_deletes = 10000;
+	string format = "text";       // text, json or csv
+	string out;                   // stdout when empty
+};
+
+struct result {
+	string workload;
+	vector<double> latencies;     // microsecs per operation
+	double seconds = 0;           // wall time of the whole workload
+	double distances = 0;         // distance computations per operation
+	double memory = 0;            // MB
+	double speedup = 0;           // mean scan latency over mean latency, 0 if none
+	double recall = -1;           // fraction of the exact k nearest found, below 0 if exact
+};
+
+double percentile(vector<double> sorted, const double p){
+	if (sorted.empty()) return 0;
+	std::sort(sorted.begin(), sorted.end());
+	const size_t rank = (size_t)std::ceil(p/100.0*sorted.size());
+	return sorted[std::min(sorted.size()-1, rank > 0 ? rank-1 : 0)];
+}
+
+double mean(const vector<double> &values){
+	double sum = 0;
+	for (double v : values) sum += v;
+	return values.empty() ? 0 : sum/values.size();
+}
+
+// fvecs files hold an int32 dimension before each vector of floats; any other
+// file is read as raw float32 vectors of g_dim components
+void read_vectors(const string &path, const size_t count){
+	ifstream in(path, ios::binary);
+	if (!in){
+		cerr << "unable to open " << path << endl;
+		exit(1);
+	}
+	const bool fvecs = path.size() > 6 && path.compare(path.size()-6, 6, ".fvecs") == 0;
+	vector<float> v;
+	while (g_vectors.size() < count*g_dim){
+		if (fvecs){
+			int32_t dim;
+			if (!in.read((char*)&dim, sizeof(dim))) break;
+			if (g_vectors.empty()) g_dim = dim;
+			if (dim != g_dim){
+				cerr << path << ": mixed dimensions" << endl;
+				exit(1);
+			}
+		}
+		v.resize(g_dim);
+		if (!in.read((char*)v.data(), g_dim*sizeof(float))) break;
+		g_vectors.insert(g_vectors.end(), v.begin(), v.end());
+	}
+}
+
+void generate_vectors(const string &dataset, const size_t count){
+	uniform_real_distribution<float> uniform(-1.0, 1.0);
+	normal_distribution<float> noise(0, 0.1);
+	const int n_clusters = 100;
+	vector<float> centers(n_clusters*g_dim);
+	for (auto &c : centers) c = uniform(m_gen);
+
+	g_vectors.resize(count*g_dim);
+	for (size_t i=0;i < count;i++){
+		const float *center = &centers[(m_gen() % n_clusters)*g_dim];
+		for (int j=0;j < g_dim;j++){
+			g_vectors[i*g_dim+j] = (dataset == "clustered") ? center[j] + noise(m_gen) : uniform(m_gen);
+		}
+	}
+}
+
+// k nearest by linear scan, in blocks through distance_many
+template<typename Key>
+vector<IdDist> scan_knn(const vector<Key> &keys, const int n, const Key &query, const int k){
+	const int block = 256;
+	const Key *ptrs[block];
+	double dists[block];
+	priority_queue<pair<double,long long>> heap;
+	for (int i=0;i < n;i += block){
+		const int m = std::min(block, n - i);
+		for (int j=0;j < m;j++) ptrs[j] = &keys[i+j];
+		Key::distance_many(query, ptrs, m, dists);
+		for (int j=0;j < m;j++){
+			if ((int)heap.size() < k || dists[j] < heap.top().first){
+				heap.push({ dists[j], i+j });
+				if ((int)heap.size() > k) heap.pop();
+			}
+		}
+	}
+	vector<IdDist> nearest(heap.size());
+	for (int i=heap.size()-1;i >= 0;i--){
+		nearest[i] = { heap.top().second, heap.top().first };
+		heap.pop();
+	}
+	return nearest;
+}
+
+template<typename Key>
+size_t scan_range(const vector<Key> &keys, const int n, const Key &query, const double radius){
+	const int block = 256;
+	const Key *ptrs[block];
+	double dists[block];
+	size_t count = 0;
+	for (int i=0;i < n;i += block){
+		const int m = std::min(block, n - i);
+		for (int j=0;j < m;j++) ptrs[j] = &keys[i+j];
+		Key::distance_many(query, ptrs, m, dists);
+		for (int j=0;j < m;j++){
+			if (dists[j] <= radius) count++;
+		}
+	}
+	return count;
+}
+
+// time op once per call, adding its latency to r
+template<typename Op>
+void timed(result &r, Op op){
+	auto s = chrono::steady_clock::now();
+	op();
+	auto e = chrono::steady_clock::now();
+	r.latencies.push_back(chrono::duration<double, micro>(e - s).count());
+}
+
+template<int DIM>
+vector<result> run_benchmarks(options &opts){
+	typedef VecKey<DIM> Key;
+	const int n = opts.n;
+	const int nq = opts.n_queries;
+	vector<Key> keys(n + nq);
+	for (int i=0;i < n + nq;i++){
+		std::fill(keys[i].v, keys[i].v + DIM, 0.0f);
+		std::copy(&g_vectors[(size_t)i*g_dim], &g_vectors[(size_t)(i+1)*g_dim], keys[i].v);
+	}
+	const Key *queries = &keys[n];
+
+	vector<result> results;
+	MTree<Key,NR,LC> mtree;
+
+	// build: one insert at a time
+	{
+		result r;
+		r.workload = "build";
+		BuildCounter::Reset();
+		auto s = chrono::steady_clock::now();
+		for (int i=0;i < n;i++){
+			timed(r, [&]{ mtree.Insert({ i, keys[i] }); });
+		}
+		r.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		r.distances = (double)BuildCounter::Total()/n;
+		r.memory = mtree.memory_usage()/1000000.0;
+		results.push_back(r);
+	}
+
+	// k-NN, scan first to calibrate the default radius
+	vector<double> kth;
+	vector<vector<IdDist>> exact(nq);
+	double knn_latency = 0;
+	{
+		result scan, tree;
+		scan.workload = "scan_knn";
+		tree.workload = "knn";
+		auto s = chrono::steady_clock::now();
+		for (int i=0;i < nq;i++){
+			timed(scan, [&]{
+				exact[i] = scan_knn(keys, n, queries[i], opts.k);
+				kth.push_back(exact[i].back().dist);
+			});
+		}
+		scan.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		scan.distances = n;
+		scan.memory = (double)n*g_dim*sizeof(float)/1000000.0;
+
+		QueryStats qstats;
+		vector<IdDist> hits;
+		s = chrono::steady_clock::now();
+		for (int i=0;i < nq;i++){
+			hits.clear();
+			timed(tree, [&]{ mtree.KNNQuery(queries[i], opts.k, CollectIdDists(hits), &qstats); });
+		}
+		tree.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		tree.distances = (double)qstats.n_distances/nq;
+		tree.memory = mtree.memory_usage()/1000000.0;
+		tree.speedup = mean(scan.latencies)/mean(tree.latencies);
+		knn_latency = mean(tree.latencies);
+		results.push_back(scan);
+		results.push_back(tree);
+	}
+
+	if (opts.radius < 0)
+		opts.radius = percentile(kth, 50);
+
+	// range
+	{
+		result scan, tree;
+		scan.workload = "scan_range";
+		tree.workload = "range";
+		auto s = chrono::steady_clock::now();
+		for (int i=0;i < nq;i++){
+			timed(scan, [&]{ scan_range(keys, n, queries[i], opts.radius); });
+		}
+		scan.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		scan.distances = n;
+		scan.memory = (double)n*g_dim*sizeof(float)/1000000.0;
+
+		QueryStats qstats;
+		vector<long long> ids;
+		s = chrono::steady_clock::now();
+		for (int i=0;i < nq;i++){
+			ids.clear();
+			timed(tree, [&]{ mtree.RangeQuery(queries[i], opts.radius, CollectIds(ids), &qstats); });
+		}
+		tree.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		tree.distances = (double)qstats.n_distances/nq;
+		tree.memory = mtree.memory_usage()/1000000.0;
+		tree.speedup = mean(scan.latencies)/mean(tree.latencies);
+		results.push_back(scan);
+		results.push_back(tree);
+	}
+
+	// approximate k-NN: recall against distances, for budgets and for cover radii shrunk by 1+epsilon
+	{
+		vector<pair<string,SearchLimits>> sweep;
+		for (double frac : { 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2 }){
+			const unsigned long budget = std::max(1UL, (unsigned long)(frac*n));
+			sweep.push_back({ "budget_" + to_string(budget), SearchLimits(budget) });
+		}
+		for (double eps : { 0.25, 0.5, 1.0, 2.0, 4.0 }){
+			ostringstream name;
+			name << "eps_" << eps;
+			sweep.push_back({ name.str(), SearchLimits(0, 0, eps) });
+		}
+
+		for (auto &s : sweep){
+			result r;
+			r.workload = s.first;
+			QueryStats qstats;
+			vector<IdDist> hits;
+			size_t n_found = 0, n_wanted = 0;
+			auto start = chrono::steady_clock::now();
+			for (int i=0;i < nq;i++){
+				hits.clear();
+				timed(r, [&]{ mtree.ApproxKNNQuery(queries[i], opts.k, s.second, CollectIdDists(hits), &qstats); });
+				// ties at the k-th distance count as found
+				for (auto &h : hits){
+					if (h.dist <= exact[i].back().dist) n_found++;
+				}
+				n_wanted += exact[i].size();
+			}
+			r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			r.distances = (double)qstats.n_distances/nq;
+			r.memory = mtree.memory_usage()/1000000.0;
+			r.speedup = knn_latency/mean(r.latencies);
+			r.recall = (double)std::min(n_found, n_wanted)/n_wanted;
+			results.push_back(r);
+		}
+	}
+
+	// mixed: 80% k-NN, 10% delete, 10% reinsert of a deleted entry
+	{
+		result r;
+		r.workload = "mixed";
+		vector<long long> present(n), deleted;
+		for (int i=0;i < n;i++) present[i] = i;
+		uniform_int_distribution<int> pick(0, 99);
+		QueryStats qstats;
+		vector<IdDist> hits;
+		BuildCounter::Reset();
+		auto s = chrono::steady_clock::now();
+		for (int i=0;i < opts.n_mixed;i++){
+			const int p = pick(m_gen);
+			if (p < 10 && present.size() > 1){
+				const size_t j = m_gen() % present.size();
+				const long long id = present[j];
+				present[j] = present.back();
+				present.pop_back();
+				deleted.push_back(id);
+				timed(r, [&]{ mtree.DeleteEntry({ id, keys[id] }); });
+			} else if (p < 20 && !deleted.empty()){
+				const long long id = deleted.back();
+				deleted.pop_back();
+				present.push_back(id);
+				timed(r, [&]{ mtree.Insert({ id, keys[id] }); });
+			} else {
+				hits.clear();
+				timed(r, [&]{ mtree.KNNQuery(queries[i % nq], opts.k, CollectIdDists(hits), &qstats); });
+			}
+		}
+		r.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		r.distances = (double)(qstats.n_distances + BuildCounter::Total())/opts.n_mixed;
+		r.memory = mtree.memory_usage()/1000000.0;
+		results.push_back(r);
+
+		for (long long id : deleted){
+			mtree.Insert({ id, keys[id] });
+		}
+	}
+
+	// delete
+	{
+		result r;
+		r.workload = "delete";
+		vector<long long> ids(n);
+		for (int i=0;i < n;i++) ids[i] = i;
+		shuffle(ids.begin(), ids.end(), m_gen);
+		const int n_deletes = std::min(opts.n_deletes, n);
+		BuildCounter::Reset();
+		auto s = chrono::steady_clock::now();
+		for (int i=0;i < n_deletes;i++){
+			timed(r, [&]{ mtree.DeleteEntry({ ids[i], keys[ids[i]] }); });
+		}
+		r.seconds = chrono::duration<double>(chrono::steady_clock::now() - s).count();
+		r.distances = (double)BuildCounter::Total()/std::max(n_deletes, 1);
+		r.memory = mtree.memory_usage()/1000000.0;
+		results.push_back(r);
+	}
+
+	return results;
+}
+
+string json_escape(const string &s){
+	string escaped;
+	for (char c : s){
+		if (c == '"' || c == '\\') escaped += '\\';
+		escaped += c;
+	}
+	return escaped;
+}
+
+void write_results(ostream &out, const options &opts, const vector<result> &results){
+	if (opts.format == "json"){
+		out << "{\"dataset\": \"" << json_escape(opts.dataset) << "\", \"n\": " << opts.n
+			<< ", \"dim\": " << g_dim << ", \"queries\": " << opts.n_queries << ", \"k\": " << opts.k
+			<< ", \"radius\": " << opts.radius << ", \"results\": [" << endl;
+		for (size_t i=0;i < results.size();i++){
+			const result &r = results[i];
+			out << "  {\"workload\": \"" << r.workload << "\", \"ops\": " << r.latencies.size()
+				<< ", \"p50_us\": " << percentile(r.latencies, 50)
+				<< ", \"p95_us\": " << percentile(r.latencies, 95)
+				<< ", \"p99_us\": " << percentile(r.latencies, 99)
+				<< ", \"mean_us\": " << mean(r.latencies)
+				<< ", \"throughput\": " << r.latencies.size()/r.seconds
+				<< ", \"distances\": " << r.distances
+				<< ", \"memory_mb\": " << r.memory
+				<< ", \"speedup\": " << r.speedup
+				<< ", \"recall\": " << (r.recall < 0 ? 1.0 : r.recall) << "}" << (i+1 < results.size() ? "," : "") << endl;
+		}
+		out << "]}" << endl;
+	} else if (opts.format == "csv"){
+		out << "dataset,n,dim,workload,ops,p50_us,p95_us,p99_us,mean_us,throughput,distances,memory_mb,speedup,recall" << endl;
+		for (auto &r : results){
+			out << opts.dataset << "," << opts.n << "," << g_dim << "," << r.workload << "," << r.latencies.size()
+				<< "," << percentile(r.latencies, 50) << "," << percentile(r.latencies, 95)
+				<< "," << percentile(r.latencies, 99) << "," << mean(r.latencies)
+				<< "," << r.latencies.size()/r.seconds << "," << r.distances
+				<< "," << r.memory << "," << r.speedup << "," << (r.recall < 0 ? 1.0 : r.recall) << endl;
+		}
+	} else {
+		out << "dataset: " << opts.dataset << ", N = " << opts.n << ", dim = " << g_dim
+			<< ", queries = " << opts.n_queries << ", k = " << opts.k << ", radius = " << opts.radius << endl;
+		out << setw(14) << left << "workload" << right << setw(8) << "ops"
+			<< setw(11) << "p50 us" << setw(11) << "p95 us" << setw(11) << "p99 us" << setw(11) << "mean us"
+			<< setw(12) << "ops/sec" << setw(12) << "distances" << setw(10) << "MB" << setw(9) << "speedup" << setw(8) << "recall" << endl;
+		for (auto &r : results){
+			out << setw(14) << left << r.workload << right << setw(8) << r.latencies.size()
+				<< setprecision(4)
+				<< setw(11) << percentile(r.latencies, 50) << setw(11) << percentile(r.latencies, 95)
+				<< setw(11) << percentile(r.latencies, 99) << setw(11) << mean(r.latencies)
+				<< setw(12) << r.latencies.size()/r.seconds << setw(12) << r.distances
+				<< setw(10) << r.memory << setw(9);
+			if (r.speedup > 0) out << r.speedup; else out << "-";
+			out << setw(8);
+			if (r.recall >= 0) out << r.recall; else out << "-";
+			out << endl;
+		}
+	}
+}
+
+int main(int argc, char **argv){
+	options opts;
+	for (int i=1;i < argc;i++){
+		const string arg = argv[i];
+		if (i+1 >= argc){
+			cout << "usage: " << argv[0] << " [--dataset uniform|clustered|FILE] [--dim D] [--n N]"
+				 << " [--queries Q] [--k K] [--radius R] [--mixed M] [--deletes D]"
+				 << " [--format text|json|csv] [--out FILE]" << endl;
+			return 1;
+		}
+		const string val = argv[++i];
+		if (arg == "--dataset") opts.dataset = val;
+		else if (arg == "--dim") g_dim = atoi(val.c_str());
+		else if (arg == "--n") opts.n = atoi(val.c_str());
+		else if (arg == "--queries") opts.n_queries = atoi(val.c_str());
+		else if (arg == "--k") opts.k = atoi(val.c_str());
+		else if (arg == "--radius") opts.radius = atof(val.c_str());
+		else if (arg == "--mixed") opts.n_mixed = atoi(val.c_str());
+		else if (arg == "--deletes") opts.n_deletes = atoi(val.c_str());
+		else if (arg == "--format") opts.format = val;
+		else if (arg == "--out") opts.out = val;
+		else {
+			cerr << "unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	// queries are held out from the end of the dataset
+	const size_t count = opts.n + opts.n_queries;
+	if (opts.dataset == "uniform" || opts.dataset == "clustered"){
+		generate_vectors(opts.dataset, count);
+	} else {
+		read_vectors(opts.dataset, count);
+		if (g_vectors.size() < count*g_dim){
+			cerr << opts.dataset << ": only " << g_vectors.size()/g_dim << " vectors, need " << count << endl;
+			return 1;
+		}
+	}
+
+	vector<result> results;
+	if (g_dim <= 8) results = run_benchmarks<8>(opts);
+	else if (g_dim <= 16) results = run_benchmarks<16>(opts);
+	else if (g_dim <= 32) results = run_benchmarks<32>(opts);
+	else if (g_dim <= 64) results = run_benchmarks<64>(opts);
+	else if (g_dim <= 128) results = run_benchmarks<128>(opts);
+	else if (g_dim <= 256) results = run_benchmarks<256>(opts);
+	else if (g_dim <= 512) results = run_benchmarks<512>(opts);
+	else if (g_dim <= 1024) results = run_benchmarks<1024>(opts);
+	else {
+		cerr << "dimension " << g_dim << " above 1024" << endl;
+		return 1;
+	}
+	if (opts.out.empty()){
+		write_results(cout, opts, results);
+	} else {
+		ofstream out(opts.out);
+		write_results(out, opts, results);
+	}
+	return 0;
+}
@@ -9,7 +9,17 @@
 #include <ratio>
 #include <cmath>
 #include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <shared_mutex>
+#include <functional>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "mtree/mtree.hpp"
+#include "mtree/sharded.hpp"
 
 #define KEYLEN 16
 
@@ -46,14 +56,30 @@ struct KeyObject {
 		return *this;
 	}
 	const double distance(const KeyObject &other)const{
-		double sum = 0;
-		for (int i=0;i < KEYLEN;i++){
-			sum += pow(key[i] - other.key[i], 2.0);
-		}
-		return sqrt(sum);
+		return l2(key, other.key, KEYLEN);
+	}
+	static void distance_many(const KeyObject &query, const KeyObject *const keys[], const int n, double out[]){
+		l2_many(query.key, keys, n, KEYLEN, [](const KeyObject *k){ return k->key; }, out);
+	}
+	const double* data()const{
+		return key;
 	}
 };
 
+// keys are plain values: saved bytewise and mapped in place
+template<>
+struct mt::Serializer<KeyObject> {
+	static void write(std::ostream &out, const KeyObject &k){
+		out.write((const char*)k.key, KEYLEN*sizeof(double));
+	}
+	static void read(std::istream &in, KeyObject &k){
+		in.read((char*)k.key, KEYLEN*sizeof(double));
+	}
+};
+
+template<>
+struct mt::is_mappable<KeyObject> : std::true_type {};
+
 struct perfmetric {
 	double avg_build_ops;
 	double avg_build_time;
@@ -75,7 +101,7 @@ int generate_data(vector<Entry<KeyObject>> &entries, const int n){
 	double buf[KEYLEN];
 	for (int i=0;i < n;i++){
 		generate_center(buf);
-		Entry<KeyObject> entry = { .id = m_id++, .key = KeyObject(buf) };
+		Entry<KeyObject> entry = { m_id++, KeyObject(buf) };
 		entries.push_back(entry);
 	}
 	return entries.size();
@@ -87,7 +113,7 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, double center[], const i
 	uniform_real_distribution<double> m_eps(-diff, diff);
 
 	double val[KEYLEN];
-	entries.push_back({ .id = g_id++, .key = KeyObject(center) });
+	entries.push_back({ g_id++, KeyObject(center) });
 	for (int i=0;i < n-1;i++){
 		memcpy(val, center, KEYLEN*sizeof(double));
 		if (radius > 0){
@@ -95,13 +121,13 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, double center[], const i
 				val[j] = center[j] + m_eps(m_gen);
 			}
 		}
-		entries.push_back({ .id = g_id++, .key = KeyObject(val) });
+		entries.push_back({ g_id++, KeyObject(val) });
 	}
 	return n;
 }
 
 void do_run(const int index, const int n_entries, const int n_clusters,
-			const int clustersize, const double radius, vector<struct perfmetric> &metrics){
+			const int clustersize, const double radius, const bool bulk, vector<struct perfmetric> &metrics){
 	m_id = 1;
 	g_id = 100000000;
 
@@ -109,7 +135,7 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 
 	size_t sz = 0;
 	chrono::duration<double, nano> total(0);
-	RoutingObject<KeyObject>::n_build_ops = 0;
+	BuildCounter::Reset();
 
 	vector<Entry<KeyObject>> entries;
 	generate_data(entries, n_entries);
@@ -117,8 +143,12 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 
 	int count = 0;
 	auto s = chrono::steady_clock::now();
-	for (auto &e : entries){
-		mtree.Insert(e);
+	if (bulk){
+		mtree.BulkLoad(std::move(entries));
+	} else {
+		for (auto &e : entries){
+			mtree.Insert(e);
+		}
 	}
 	auto e = chrono::steady_clock::now();
 	total += (e - s);
@@ -127,7 +157,7 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 
 	struct perfmetric m;
 	
-	m.avg_build_ops = 100.0*((double)RoutingObject<KeyObject>::n_build_ops/(double)sz); 
+	m.avg_build_ops = 100.0*((double)BuildCounter::Total()/(double)sz); 
 	m.avg_build_time = total.count()/(double)sz;
 	
 	cout << "(" << index << ") build tree: " << setw(10) << setprecision(6) << m.avg_build_ops << "% opers "
@@ -148,11 +178,11 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 		assert(sz == n_entries + clustersize*(i+1));
 	}
 
-	DBEntry<KeyObject>::n_query_ops = 0;
+	QueryStats qstats;
 	chrono::duration<double, milli> querytime(0);
 	for (int i=0;i < n_clusters;i++){
 		auto s = chrono::steady_clock::now();
-		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), radius);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), radius, &qstats);
 		auto e = chrono::steady_clock::now();
 		querytime += (e - s);
 
@@ -160,11 +190,14 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 		assert(nresults == clustersize);
 	}
 
-	m.avg_query_ops = 100.0*((double)DBEntry<KeyObject>::n_query_ops/(double)n_clusters/(double)sz);
+	m.avg_query_ops = 100.0*((double)qstats.n_distances/(double)n_clusters/(double)sz);
 	m.avg_query_time = (double)querytime.count()/(double)n_clusters;
 
 	cout << " query ops " << dec << setprecision(6) << m.avg_query_ops << "% opers   " 
 		 << "query time: " << dec << setprecision(6) << m.avg_query_time << " millisecs" << endl;
+	cout << "    per query: " << qstats.n_nodes/n_clusters << " nodes visited, "
+		 << qstats.n_pruned_parent/n_clusters << " pruned by parent distance, "
+		 << qstats.n_pruned_cover/n_clusters << " pruned by cover radius" << endl;
 
 
 	m.avg_memory_used = mtree.memory_usage();
@@ -175,8 +208,10 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 	assert(mtree.size() == 0);
 }
 
-void do_experiment(const int n, const int n_runs, const int n_entries, const int n_clusters, const int clustersize, const double radius){
+void do_experiment(const int n, const int n_runs, const int n_entries, const int n_clusters,
+				   const int clustersize, const double radius, const bool bulk){
 	cout << "------------------ " << n << " -------------------" << endl;
+	cout << "build: " << (bulk ? "BulkLoad" : "Insert") << endl;
 	cout << "dataset size, N = " << n_entries  << endl;
 	cout << "no. clusters: " << n_clusters << endl;
 	cout  << "cluster size " << clustersize << endl;
@@ -185,7 +220,7 @@ void do_experiment(const int n, const int n_runs, const int n_entries, const int
 
 	vector<perfmetric> metrics;
 	for (int i=0;i < n_runs;i++){
-		do_run(i+1, n_entries, n_clusters, clustersize, radius, metrics);
+		do_run(i+1, n_entries, n_clusters, clustersize, radius, bulk, metrics);
 	}
 
 	double avg_build_ops = 0;
@@ -208,8 +243,804 @@ void do_experiment(const int n, const int n_runs, const int n_entries, const int
 	cout << "-------------------------------------------------" << endl << endl;
 }
 
+void do_batch_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ batch queries -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << "  k: " << k << endl;
+
+	MTree<KeyObject,NR,LC> mtree;
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+	for (auto &e : entries){
+		mtree.Insert(e);
+	}
+	entries.clear();
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	const int max_threads = thread::hardware_concurrency();
+	for (int n_threads=1;;n_threads *= 2){
+		if (n_threads > max_threads) n_threads = max_threads;
+		ThreadPool pool(n_threads);
+
+		auto s = chrono::steady_clock::now();
+		vector<vector<Entry<KeyObject>>> results = mtree.BatchRangeQuery(queries, radius, pool);
+		auto e = chrono::steady_clock::now();
+		chrono::duration<double> rangetime = e - s;
+
+		s = chrono::steady_clock::now();
+		vector<vector<NNEntry<KeyObject>>> nearest = mtree.BatchKNNQuery(queries, k, pool);
+		e = chrono::steady_clock::now();
+		chrono::duration<double> knntime = e - s;
+
+		cout << "threads: " << setw(3) << n_threads
+			 << "  range: " << setw(10) << setprecision(6) << n_queries/rangetime.count() << " queries/sec"
+			 << "  knn: " << setw(10) << setprecision(6) << n_queries/knntime.count() << " queries/sec" << endl;
+		if (n_threads >= max_threads)
+			break;
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// ingest n_inserts entries from one writer while the remaining threads run range queries
+// against the index; concurrent mode vs. a non-concurrent tree behind one shared_mutex
+template<typename Tree>
+void do_mixed_run(Tree &mtree, const int n_inserts, const int n_readers, const double radius,
+				  function<void()> lock, function<void()> unlock,
+				  function<void()> lock_shared, function<void()> unlock_shared){
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_inserts);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < 100;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	atomic<bool> writing(true);
+	atomic<long> n_queries(0);
+	vector<thread> readers;
+	for (int r=0;r < n_readers;r++){
+		readers.emplace_back([&, r]{
+			int i = r;
+			while (writing.load()){
+				lock_shared();
+				vector<Entry<KeyObject>> results = mtree.RangeQuery(queries[i++ % queries.size()], radius);
+				unlock_shared();
+				n_queries++;
+			}
+		});
+	}
+
+	auto s = chrono::steady_clock::now();
+	for (auto &e : entries){
+		lock();
+		mtree.Insert(e);
+		unlock();
+	}
+	auto e = chrono::steady_clock::now();
+	writing = false;
+	for (auto &t : readers){
+		t.join();
+	}
+	chrono::duration<double> total = e - s;
+
+	cout << "inserts: " << setw(10) << setprecision(6) << n_inserts/total.count() << " /sec   "
+		 << "queries: " << setw(10) << setprecision(6) << n_queries.load()/total.count() << " /sec"
+		 << " (" << n_readers << " readers)" << endl;
+}
+
+void do_concurrent_experiment(const int n_entries, const int n_inserts, const double radius){
+	cout << "------------------ concurrent insert/query -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. inserts: " << n_inserts << endl;
+	cout << "radius: " << radius << endl;
+
+	const int n_readers = max(1, (int)thread::hardware_concurrency() - 1);
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	cout << "single shared_mutex:   ";
+	{
+		MTree<KeyObject,NR,LC> mtree;
+		for (auto &e : entries){
+			mtree.Insert(e);
+		}
+		shared_mutex mtx;
+		do_mixed_run(mtree, n_inserts, n_readers, radius,
+					 [&]{ mtx.lock(); }, [&]{ mtx.unlock(); },
+					 [&]{ mtx.lock_shared(); }, [&]{ mtx.unlock_shared(); });
+		mtree.Clear();
+	}
+
+	cout << "concurrent mode:       ";
+	{
+		MTree<KeyObject,NR,LC> mtree(true);
+		for (auto &e : entries){
+			mtree.Insert(e);
+		}
+		auto none = []{};
+		do_mixed_run(mtree, n_inserts, n_readers, radius, none, none, none, none);
+		mtree.Clear();
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// range query time returning copied entries vs. handing ids and distances to a visitor
+void do_visitor_experiment(const int n_entries, const int n_queries){
+	cout << "------------------ result delivery -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+	MTree<KeyObject,NR,LC> mtree(std::move(entries));
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	const int n_rad = 4;
+	const double rad[n_rad] = { 1.0, 1.5, 2.0, 2.5 };
+	vector<IdDist> id_dists;
+	for (int i=0;i < n_rad;i++){
+		size_t n_found = 0;
+		auto s = chrono::steady_clock::now();
+		for (auto &q : queries){
+			n_found += mtree.RangeQuery(q, rad[i]).size();
+		}
+		auto e = chrono::steady_clock::now();
+		chrono::duration<double, milli> copytime = e - s;
+
+		s = chrono::steady_clock::now();
+		for (auto &q : queries){
+			id_dists.clear();
+			mtree.RangeQuery(q, rad[i], CollectIdDists(id_dists));
+		}
+		e = chrono::steady_clock::now();
+		chrono::duration<double, milli> visittime = e - s;
+
+		cout << "radius: " << setw(5) << rad[i] << "  avg results: " << setw(8) << n_found/n_queries
+			 << "  entries: " << setw(8) << setprecision(4) << copytime.count()/n_queries << " ms"
+			 << "  id+dist visitor: " << setw(8) << setprecision(4) << visittime.count()/n_queries << " ms" << endl;
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// build ops, build time and query cost of a tree built by Insert with the given split policies
+template<typename PROMOTE, typename PARTITION>
+void do_split_run(const string &name, const vector<Entry<KeyObject>> &entries, const vector<KeyObject> &queries,
+				  const double radius){
+	MTree<KeyObject,NR,LC,PROMOTE,PARTITION> mtree;
+
+	BuildCounter::Reset();
+	auto s = chrono::steady_clock::now();
+	for (auto &e : entries){
+		mtree.Insert(e);
+	}
+	auto e = chrono::steady_clock::now();
+	chrono::duration<double, nano> buildtime = e - s;
+	const double build_ops = 100.0*(double)BuildCounter::Total()/(double)entries.size();
+
+	QueryStats qstats;
+	vector<long long> ids;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		ids.clear();
+		mtree.RangeQuery(q, radius, CollectIds(ids), &qstats);
+	}
+	e = chrono::steady_clock::now();
+	chrono::duration<double, milli> querytime = e - s;
+	const double query_ops = 100.0*(double)qstats.n_distances/(double)queries.size()/(double)entries.size();
+	TreeStats tstats = mtree.Stats();
+
+	cout << setw(24) << left << name << right
+		 << " build: " << setw(10) << setprecision(6) << build_ops << "% opers "
+		 << setw(10) << setprecision(6) << buildtime.count()/entries.size() << " nanosecs"
+		 << "   query: " << setw(10) << setprecision(6) << query_ops << "% opers "
+		 << setw(10) << setprecision(6) << querytime.count()/queries.size() << " millisecs"
+		 << "   height: " << tstats.height
+		 << "   1-route nodes: " << tstats.fanout[1] << "/" << tstats.n_internal
+		 << "   MEM: " << fixed << setprecision(2) << mtree.memory_usage()/1000000.0 << "MB" << endl;
+	cout.unsetf(ios::fixed);
+}
+
+void do_split_experiment(const int n_entries, const int n_queries, const double radius){
+	cout << "------------------ split policies -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	do_split_run<FarthestPromote,HyperplanePartition>("farthest/hyperplane", entries, queries, radius);
+	do_split_run<RandomPromote,HyperplanePartition>("random/hyperplane", entries, queries, radius);
+	do_split_run<SampledMinMaxPromote<>,HyperplanePartition>("mM_RAD/hyperplane", entries, queries, radius);
+	do_split_run<LBDistPromote,HyperplanePartition>("m_LB_DIST/hyperplane", entries, queries, radius);
+	do_split_run<FarthestPromote,BalancedPartition>("farthest/balanced", entries, queries, radius);
+	do_split_run<RandomPromote,BalancedPartition>("random/balanced", entries, queries, radius);
+	do_split_run<SampledMinMaxPromote<>,BalancedPartition>("mM_RAD/balanced", entries, queries, radius);
+	do_split_run<LBDistPromote,BalancedPartition>("m_LB_DIST/balanced", entries, queries, radius);
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// query cost and leaf count of one tree through rounds of deleting half its entries and
+// inserting as many new ones
+void do_churn_experiment(const int n_entries, const int n_queries, const double radius){
+	cout << "------------------ delete churn -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	MTree<KeyObject,NR,LC> mtree;
+	for (auto &e : entries){
+		mtree.Insert(e);
+	}
+
+	const int n_rounds = 4;
+	for (int round=0;round <= n_rounds;round++){
+		double delete_ops = 0, delete_time = 0;
+		if (round > 0){
+			shuffle(entries.begin(), entries.end(), m_gen);
+			const int n_deletes = entries.size()/2;
+			BuildCounter::Reset();
+			auto s = chrono::steady_clock::now();
+			for (int i=0;i < n_deletes;i++){
+				mtree.DeleteEntry(entries.back());
+				entries.pop_back();
+			}
+			auto e = chrono::steady_clock::now();
+			delete_ops = (double)BuildCounter::Total()/n_deletes;
+			delete_time = chrono::duration<double, nano>(e - s).count()/n_deletes;
+			generate_data(entries, n_deletes);
+			for (int i=entries.size()-n_deletes;i < (int)entries.size();i++){
+				mtree.Insert(entries[i]);
+			}
+		}
+
+		size_t n_leaves = 0;
+		for (size_t count : mtree.DepthHistogram()) n_leaves += count;
+
+		QueryStats qstats;
+		vector<long long> ids;
+		for (auto &q : queries){
+			ids.clear();
+			mtree.RangeQuery(q, radius, CollectIds(ids), &qstats);
+		}
+		cout << "round " << round
+			 << "   delete: " << setw(8) << setprecision(4) << delete_ops << " opers " << setw(8) << delete_time << " nanosecs"
+			 << "   query: " << setw(10) << setprecision(6) << (double)qstats.n_distances/queries.size() << " opers"
+			 << "   leaves: " << n_leaves << " (" << setprecision(3) << (double)mtree.size()/n_leaves << " per leaf)"
+			 << "   depth: " << mtree.DepthHistogram().size()-1 << endl;
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// build and query costs with P global pivots, P = 0 for plain keys
+template<typename Key>
+void do_pivots_run(const int n_pivots, const vector<Entry<KeyObject>> &entries, const vector<KeyObject> &queries,
+				   const double radius, const int k){
+	MTree<Key,NR,LC> mtree;
+	BuildCounter::Reset();
+	auto s = chrono::steady_clock::now();
+	for (auto &e : entries){
+		mtree.Insert({ e.id, Key(e.key) });
+	}
+	auto e = chrono::steady_clock::now();
+	const double build_ops = (double)BuildCounter::Total()/entries.size();
+	const double build_time = chrono::duration<double, nano>(e - s).count()/entries.size();
+
+	QueryStats range_stats, knn_stats;
+	vector<long long> ids;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		ids.clear();
+		mtree.RangeQuery(Key(q), radius, CollectIds(ids), &range_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double range_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	vector<IdDist> hits;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		hits.clear();
+		mtree.KNNQuery(Key(q), k, CollectIdDists(hits), &knn_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double knn_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	cout << "P = " << setw(2) << n_pivots
+		 << "   build: " << setw(8) << setprecision(4) << build_ops << " opers " << setw(8) << build_time << " nanosecs"
+		 << "   range: " << setw(8) << setprecision(5) << (double)range_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << range_time << " microsecs"
+		 << "   knn: " << setw(8) << setprecision(5) << (double)knn_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << knn_time << " microsecs"
+		 << "   MEM: " << fixed << setprecision(2) << mtree.memory_usage()/1000000.0 << "MB" << endl;
+	cout.unsetf(ios::fixed);
+}
+
+void do_pivots_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ pivots -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << ", k = " << k << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	do_pivots_run<KeyObject>(0, entries, queries, radius, k);
+	do_pivots_run<Pivoted<KeyObject,2>>(2, entries, queries, radius, k);
+	do_pivots_run<Pivoted<KeyObject,4>>(4, entries, queries, radius, k);
+	do_pivots_run<Pivoted<KeyObject,8>>(8, entries, queries, radius, k);
+	do_pivots_run<Pivoted<KeyObject,16>>(16, entries, queries, radius, k);
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// cost of adding n_inserts entries to a tree of n_entries, one Insert at a time or in
+// InsertBatch calls of batch_size, and of range queries on the tree that results
+void do_ingest_run(const vector<Entry<KeyObject>> &entries, const int n_entries, const int batch_size,
+				   const vector<KeyObject> &queries, const double radius){
+	MTree<KeyObject,NR,LC> mtree;
+	mtree.InsertBatch(entries.begin(), entries.begin() + n_entries);
+
+	BuildCounter::Reset();
+	auto s = chrono::steady_clock::now();
+	if (batch_size <= 1){
+		for (int i=n_entries;i < (int)entries.size();i++){
+			mtree.Insert(entries[i]);
+		}
+	} else {
+		for (int i=n_entries;i < (int)entries.size();i += batch_size){
+			const int end = min((int)entries.size(), i + batch_size);
+			mtree.InsertBatch(entries.begin() + i, entries.begin() + end);
+		}
+	}
+	auto e = chrono::steady_clock::now();
+	const int n_inserts = entries.size() - n_entries;
+	const double build_ops = (double)BuildCounter::Total()/n_inserts;
+	const double build_time = chrono::duration<double, nano>(e - s).count()/n_inserts;
+
+	QueryStats qstats;
+	vector<long long> ids;
+	for (auto &q : queries){
+		ids.clear();
+		mtree.RangeQuery(q, radius, CollectIds(ids), &qstats);
+	}
+
+	cout << ((batch_size <= 1) ? string("Insert") : "batch " + to_string(batch_size))
+		 << "   " << setw(8) << setprecision(4) << build_ops << " opers " << setw(8) << build_time << " nanosecs"
+		 << "   query: " << setw(10) << setprecision(6) << (double)qstats.n_distances/queries.size() << " opers"
+		 << "   depth: " << mtree.DepthHistogram().size()-1 << endl;
+}
+
+void do_ingest_experiment(const int n_entries, const int n_inserts, const int n_queries, const double radius){
+	cout << "------------------ batch insert -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << " + " << n_inserts << " inserted" << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries + n_inserts);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	for (int batch_size : { 1, 1000, 10000, 100000 }){
+		do_ingest_run(entries, n_entries, batch_size, queries, radius);
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// bulk load entries into as many shards as threads, then time range and k-NN queries,
+// one at a time, each fanned out over the shards
+void do_sharded_run(const vector<Entry<KeyObject>> &entries, const ShardRouting routing, const int n_threads,
+					const vector<KeyObject> &queries, const double radius, const int k){
+	ShardedMTree<KeyObject,NR,LC> mtree(n_threads, routing, n_threads);
+	vector<Entry<KeyObject>> copy(entries);
+	auto s = chrono::steady_clock::now();
+	mtree.BulkLoad(std::move(copy));
+	auto e = chrono::steady_clock::now();
+	const double build_time = chrono::duration<double>(e - s).count();
+
+	QueryStats range_stats, knn_stats;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		mtree.RangeQuery(q, radius, &range_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double range_rate = queries.size()/chrono::duration<double>(e - s).count();
+
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		mtree.KNNQuery(q, k, &knn_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double knn_rate = queries.size()/chrono::duration<double>(e - s).count();
+
+	cout << ((routing == SHARD_BY_HASH) ? " hash" : "pivot") << "  threads: " << setw(3) << n_threads
+		 << "   build: " << setw(7) << setprecision(4) << build_time << " secs"
+		 << "   range: " << setw(8) << setprecision(5) << range_rate << " queries/sec "
+		 << setw(8) << (double)range_stats.n_distances/queries.size() << " opers"
+		 << "   knn: " << setw(8) << setprecision(5) << knn_rate << " queries/sec "
+		 << setw(8) << (double)knn_stats.n_distances/queries.size() << " opers" << endl;
+}
+
+void do_sharded_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ sharded -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << "  k: " << k << endl;
+	cout << "hardware threads: " << thread::hardware_concurrency() << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	for (ShardRouting routing : { SHARD_BY_HASH, SHARD_BY_PIVOT }){
+		for (int n_threads : { 1, 2, 4, 8, 16, 32 }){
+			do_sharded_run(entries, routing, n_threads, queries, radius, k);
+		}
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// range and k-NN query latency of one tree, mutable or frozen
+template<typename Tree>
+void do_frozen_run(const string &name, const Tree &mtree, const size_t memory, const vector<KeyObject> &queries,
+				   const double radius, const int k){
+	QueryStats range_stats, knn_stats;
+	vector<long long> ids;
+	auto s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		ids.clear();
+		mtree.RangeQuery(q, radius, CollectIds(ids), &range_stats);
+	}
+	auto e = chrono::steady_clock::now();
+	const double range_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	vector<IdDist> hits;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		hits.clear();
+		mtree.KNNQuery(q, k, CollectIdDists(hits), &knn_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double knn_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	cout << setw(8) << name
+		 << "   range: " << setw(8) << setprecision(5) << (double)range_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << range_time << " microsecs"
+		 << "   knn: " << setw(8) << setprecision(5) << (double)knn_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << knn_time << " microsecs"
+		 << "   MEM: " << setprecision(4) << memory/1000000.0 << "MB" << endl;
+}
+
+void do_frozen_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ frozen -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << "  k: " << k << endl;
+
+	MTree<KeyObject,NR,LC> mtree;
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+	for (auto &e : entries){
+		mtree.Insert(e);
+	}
+	entries.clear();
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	auto s = chrono::steady_clock::now();
+	FrozenMTree<KeyObject,NR,LC> frozen = mtree.Freeze();
+	auto e = chrono::steady_clock::now();
+	cout << "freeze: " << setprecision(4) << chrono::duration<double, milli>(e - s).count() << " millisecs" << endl;
+
+	// alternate, so both see the same cache and clock conditions
+	for (int run=0;run < 2;run++){
+		do_frozen_run("mutable", mtree, mtree.memory_usage(), queries, radius, k);
+		do_frozen_run("frozen", frozen, frozen.memory_usage(), queries, radius, k);
+	}
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// minor and major page faults of this process so far
+static void page_faults(long &minor, long &major){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	minor = usage.ru_minflt;
+	major = usage.ru_majflt;
+}
+
+// drop the file's pages from the page cache, so the next run starts cold
+static void evict(const string &path){
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0){
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+// range queries over a tree mapped cold from path, then again warm, and warm k-NN queries;
+// faults are per query
+void do_mapped_run(const string &name, const string &path, const MapAdvice advice, const vector<KeyObject> &queries,
+				   const double radius, const int k){
+	evict(path);
+	auto s = chrono::steady_clock::now();
+	FrozenMTree<KeyObject,NR,LC> mapped;
+	mapped.Map(path, advice);
+	auto e = chrono::steady_clock::now();
+	const double startup = chrono::duration<double, milli>(e - s).count();
+
+	cout << setw(10) << name << "   map: " << setw(8) << setprecision(4) << startup << " millisecs";
+	vector<long long> ids;
+	vector<IdDist> hits;
+	for (const char *pass : { "cold", "warm", "knn" }){
+		long minor0, major0, minor1, major1;
+		page_faults(minor0, major0);
+		s = chrono::steady_clock::now();
+		for (auto &q : queries){
+			ids.clear();
+			hits.clear();
+			if (string(pass) == "knn")
+				mapped.KNNQuery(q, k, CollectIdDists(hits));
+			else
+				mapped.RangeQuery(q, radius, CollectIds(ids));
+		}
+		e = chrono::steady_clock::now();
+		page_faults(minor1, major1);
+		cout << "   " << pass << ": " << setw(8) << setprecision(5)
+			 << chrono::duration<double, micro>(e - s).count()/queries.size() << " microsecs "
+			 << setw(7) << setprecision(4) << (double)(minor1 - minor0)/queries.size() << " faults "
+			 << setw(6) << (double)(major1 - major0)/queries.size() << " major";
+	}
+	cout << endl;
+}
+
+void do_mapped_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ mapped -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << "  k: " << k << endl;
+
+	const string tree_path = "perfmtree.idx", frozen_path = "perfmtree.frozen";
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+	{
+		MTree<KeyObject,NR,LC> mtree;
+		vector<Entry<KeyObject>> entries;
+		generate_data(entries, n_entries);
+		for (auto &e : entries){
+			mtree.Insert(e);
+		}
+		mtree.Save(tree_path);
+		mtree.Freeze().Save(frozen_path);
+	}
+
+	// the heap tree must read and rebuild every node before its first query
+	evict(tree_path);
+	MTree<KeyObject,NR,LC> loaded;
+	auto s = chrono::steady_clock::now();
+	loaded.Load(tree_path);
+	auto e = chrono::steady_clock::now();
+	cout << "    Load   startup: " << setprecision(4) << chrono::duration<double, milli>(e - s).count() << " millisecs"
+		 << "   MEM: " << loaded.memory_usage()/1000000.0 << "MB" << endl;
+	loaded.Clear();
+
+	do_mapped_run("normal", frozen_path, ADVISE_NORMAL, queries, radius, k);
+	do_mapped_run("random", frozen_path, ADVISE_RANDOM, queries, radius, k);
+	do_mapped_run("willneed", frozen_path, ADVISE_WILLNEED, queries, radius, k);
+	do_mapped_run("hotroutes", frozen_path, ADVISE_HOT_ROUTES, queries, radius, k);
+
+	remove(tree_path.c_str());
+	remove(frozen_path.c_str());
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+// query costs and memory of one key encoding; node bytes are the hot leaves and routes,
+// key bytes the exact keys quantized trees keep apart
+template<typename Key>
+void do_quantized_run(const string &name, const vector<Entry<KeyObject>> &entries, const vector<KeyObject> &queries,
+					  const double radius, const int k){
+	MTree<Key,NR,LC> mtree;
+	auto s = chrono::steady_clock::now();
+	for (auto &e : entries){
+		mtree.Insert({ e.id, Key(e.key) });
+	}
+	auto e = chrono::steady_clock::now();
+	const double build_time = chrono::duration<double, nano>(e - s).count()/entries.size();
+
+	QueryStats range_stats, knn_stats;
+	vector<long long> ids;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		ids.clear();
+		mtree.RangeQuery(Key(q), radius, CollectIds(ids), &range_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double range_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	vector<IdDist> hits;
+	s = chrono::steady_clock::now();
+	for (auto &q : queries){
+		hits.clear();
+		mtree.KNNQuery(Key(q), k, CollectIdDists(hits), &knn_stats);
+	}
+	e = chrono::steady_clock::now();
+	const double knn_time = chrono::duration<double, micro>(e - s).count()/queries.size();
+
+	TreeStats tstats = mtree.Stats();
+	cout << setw(8) << name
+		 << "   build: " << setw(8) << setprecision(4) << build_time << " nanosecs"
+		 << "   range: " << setw(8) << setprecision(5) << (double)range_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << range_time << " microsecs"
+		 << "   knn: " << setw(8) << setprecision(5) << (double)knn_stats.n_distances/queries.size() << " opers "
+		 << setw(8) << knn_time << " microsecs"
+		 << fixed << setprecision(2)
+		 << "   nodes: " << tstats.bytes_nodes/1000000.0 << "MB"
+		 << "   keys: " << tstats.bytes_keys/1000000.0 << "MB"
+		 << "   MEM: " << mtree.memory_usage()/1000000.0 << "MB" << endl;
+	cout.unsetf(ios::fixed);
+}
+
+void do_quantized_experiment(const int n_entries, const int n_queries, const double radius, const int k){
+	cout << "------------------ quantized keys -------------------" << endl;
+	cout << "dataset size, N = " << n_entries << endl;
+	cout << "no. queries: " << n_queries << endl;
+	cout << "radius: " << radius << ", k = " << k << endl;
+
+	vector<Entry<KeyObject>> entries;
+	generate_data(entries, n_entries);
+
+	double buf[KEYLEN];
+	vector<KeyObject> queries;
+	for (int i=0;i < n_queries;i++){
+		generate_center(buf);
+		queries.push_back(KeyObject(buf));
+	}
+
+	do_quantized_run<KeyObject>("exact", entries, queries, radius, k);
+	do_quantized_run<Quantized<KeyObject,KEYLEN>>("int8", entries, queries, radius, k);
+#ifdef __FLT16_MAX__
+	do_quantized_run<Quantized<KeyObject,KEYLEN,half>>("half", entries, queries, radius, k);
+#endif
+	do_quantized_run<Quantized<KeyObject,KEYLEN,float>>("float", entries, queries, radius, k);
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
 int main(int argc, char **argv){
 
+	// build mode: insert (default), bulk, or compare to run each experiment both ways
+	// batch runs the parallel query throughput experiment, optionally for given index size
+	// concurrent measures insert and query rates with one writer and concurrent readers
+	// visitor compares range queries returning entries with the id+distance visitor
+	// split compares build and query costs across split policies
+	// churn tracks query cost and leaf fill through rounds of deletes and inserts
+	// pivots compares build, query costs and memory over pivot counts
+	// quantized compares query costs and memory of exact and quantized keys
+	// ingest compares Insert with InsertBatch over batch sizes
+	// sharded reports ShardedMTree build and query rates from 1 to 32 threads
+	// frozen compares query latency and memory of a tree and its frozen copy
+	// mapped compares startup, latency and page faults of a mapped frozen tree over madvise hints
+	string mode = (argc > 1) ? argv[1] : "insert";
+	if (mode == "batch"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_batch_experiment(n_entries, 1000, 0.04, 10);
+		return 0;
+	}
+	if (mode == "concurrent"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_concurrent_experiment(n_entries, 100000, 0.04);
+		return 0;
+	}
+	if (mode == "visitor"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_visitor_experiment(n_entries, 100);
+		return 0;
+	}
+	if (mode == "split"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_split_experiment(n_entries, 100, 0.4);
+		return 0;
+	}
+	if (mode == "churn"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_churn_experiment(n_entries, 100, 0.4);
+		return 0;
+	}
+	if (mode == "pivots"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_pivots_experiment(n_entries, 100, 0.4, 10);
+		return 0;
+	}
+	if (mode == "quantized"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_quantized_experiment(n_entries, 100, 0.4, 10);
+		return 0;
+	}
+	if (mode == "ingest"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_ingest_experiment(n_entries, n_entries/2, 100, 0.4);
+		return 0;
+	}
+	if (mode == "sharded"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 16000000;
+		do_sharded_experiment(n_entries, 100, 0.4, 10);
+		return 0;
+	}
+	if (mode == "frozen"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_frozen_experiment(n_entries, 100, 0.4, 10);
+		return 0;
+	}
+	if (mode == "mapped"){
+		const int n_entries = (argc > 2) ? atoi(argv[2]) : 1000000;
+		do_mapped_experiment(n_entries, 100, 0.04, 10);
+		return 0;
+	}
+	if (mode != "insert" && mode != "bulk" && mode != "compare"){
+		cout << "usage: " << argv[0] << " [insert|bulk|compare|batch [N]|concurrent [N]|visitor [N]|split [N]|churn [N]|pivots [N]|quantized [N]|ingest [N]|sharded [N]|frozen [N]|mapped [N]]" << endl;
+		return 1;
+	}
+	vector<bool> builds;
+	if (mode != "bulk") builds.push_back(false);
+	if (mode != "insert") builds.push_back(true);
 
 	cout << "MTree data structure with parameters: " << endl;
 	cout << "    no. routes in internal nodes: " << NR << endl;
@@ -224,7 +1055,9 @@ int main(int argc, char **argv){
 	const int n_runs = 5;
 
 	for (int i=0;i < N;i++){
-		do_experiment(i+1, n_runs, n_entries[i], n_clusters, clustersize, radius);
+		for (bool bulk : builds){
+			do_experiment(i+1, n_runs, n_entries[i], n_clusters, clustersize, radius, bulk);
+		}
 	}
 
 	cout << "Experiments for various radius queries" << endl;
@@ -234,7 +1067,9 @@ int main(int argc, char **argv){
 	const double rad[n_rad] = { 0, 0.02, 0.04, 0.06, 0.08, 0.10, 0.20, 0.40, 0.60, 0.80, 1.0 };
 
 	for (int i=0;i < n_rad;i++){
-		do_experiment(i+1, n_runs, M, n_clusters, clustersize, rad[i]);
+		for (bool bulk : builds){
+			do_experiment(i+1, n_runs, M, n_clusters, clustersize, rad[i], bulk);
+		}
 	}
 	
 	return 0;
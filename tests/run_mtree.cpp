@@ -37,6 +37,9 @@ struct KeyObject {
 	const double distance(const KeyObject other)const{
 		return __builtin_popcountll(key^other.key);
 	}
+	static void distance_many(const KeyObject &query, const KeyObject *const keys[], const int n, double out[]){
+		hamming_many(&query.key, keys, n, 1, [](const KeyObject *k){ return &k->key; }, out);
+	}
 };
 
 struct perfmetric {
@@ -51,7 +54,7 @@ struct perfmetric {
 int generate_data(vector<Entry<KeyObject>> &entries, const int N){
 
 	for (int i=0;i < N;i++){
-		Entry<KeyObject> entry = { .id = m_id++, .key = KeyObject(m_distrib(m_gen)) };
+		Entry<KeyObject> entry = { m_id++, KeyObject(m_distrib(m_gen)) };
 		entries.push_back(entry);
 	}
 
@@ -65,7 +68,7 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, const uint64_t center,
 		
 	uint64_t mask = 0x01;
 
-	entries.push_back({ .id = g_id++, .key = KeyObject(center) });
+	entries.push_back({ g_id++, KeyObject(center) });
 	for (int i=0;i < n-1;i++){
 		uint64_t val = center;
 		if (radius > 0){
@@ -74,7 +77,7 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, const uint64_t center,
 				val ^= (mask << bitindex_distr(m_gen));
 			}
 		}
-		entries.push_back({ .id = g_id++, .key = KeyObject(val) });
+		entries.push_back({ g_id++, KeyObject(val) });
 	}
 	return n;
 }
@@ -88,7 +91,7 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 
 	int sz;
 	chrono::duration<double, nano> total(0);
-	RoutingObject<KeyObject>::n_build_ops = 0;
+	BuildCounter::Reset();
 
 	vector<Entry<KeyObject>> entries;
 	generate_data(entries, n_entries);
@@ -105,7 +108,7 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 
 	struct perfmetric m;
 	
-	m.avg_build_ops = 100.0*((double)RoutingObject<KeyObject>::n_build_ops/(double)sz); 
+	m.avg_build_ops = 100.0*((double)BuildCounter::Total()/(double)sz); 
 	m.avg_build_time = total.count()/(double)sz;
 	
 	cout << "(" << index << ") build tree: " << setw(10) << setprecision(6) << m.avg_build_ops << "% opers "
@@ -127,12 +130,12 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 		assert(sz == n_entries + cluster_size*(i+1));
 	}
 
-	DBEntry<KeyObject>::n_query_ops = 0;
+	QueryStats qstats;
 	chrono::duration<double, milli> querytime(0);
 	for (int i=0;i < n_clusters;i++){
 
 		auto s = chrono::steady_clock::now();
-		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), radius);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), radius, &qstats);
 		auto e = chrono::steady_clock::now();
 		querytime += (e - s);
 
@@ -140,7 +143,7 @@ void do_run(const int index, const int n_entries, const int n_clusters,
 		assert(nresults >= cluster_size);
 	}
 
-	m.avg_query_ops = 100.0*((double)DBEntry<KeyObject>::n_query_ops/(double)n_clusters/(double)sz);
+	m.avg_query_ops = 100.0*((double)qstats.n_distances/(double)n_clusters/(double)sz);
 	m.avg_query_time = (double)querytime.count()/(double)n_clusters;
 
 	cout << " query ops " << dec << setprecision(6) << m.avg_query_ops << "% opers   " 
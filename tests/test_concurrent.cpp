@@ -0,0 +1,219 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include "mtree/mtree.hpp"
+
+using namespace std;
+using namespace mt;
+
+static long long m_id = 1;
+static long long g_id = 1000001;
+
+static random_device m_rd;
+static mt19937_64 m_gen(m_rd());
+static uniform_real_distribution<double> m_distrib(-1.0, 1.0);
+static uniform_real_distribution<double> m_eps(-0.03, 0.03);
+
+double Radius = 0.10;
+
+#define KEYLEN 10
+
+struct KeyObject {
+	double key[KEYLEN];
+	KeyObject(){};
+	KeyObject(const double key[]){
+		memcpy(this->key, key, KEYLEN*sizeof(double));
+	}
+	KeyObject(const KeyObject &other){
+		memcpy(key, other.key, KEYLEN*sizeof(double));
+	}
+	KeyObject& operator=(const KeyObject &other){
+		memcpy(key, other.key, KEYLEN*sizeof(double));
+		return *this;
+	}
+	const double distance(const KeyObject &other)const{
+		double d = 0;
+		for (int i=0;i < KEYLEN;i++){
+			d += pow(key[i] - other.key[i], 2.0);
+		}
+		return sqrt(d);
+	}
+	const double* data()const{
+		return key;
+	}
+};
+
+int generate_center(double center[], mt19937_64 &gen){
+	for (int i=0;i < KEYLEN;i++){
+		center[i] = m_distrib(gen);
+	}
+	return 1;
+}
+
+int generate_cluster(vector<Entry<KeyObject>> &entries, double center[], int N){
+	entries.push_back({ g_id++, KeyObject(center) });
+	for (int i=0;i < N-1;i++){
+		double v[KEYLEN];
+		for (int j=0;j < KEYLEN;j++){
+			v[j] = center[j] + m_eps(m_gen);
+		}
+		entries.push_back({ g_id++, KeyObject(v) });
+	}
+	return N;
+}
+
+int main(int argc, char **argv){
+
+	const int nroutes = 4;
+	const int leafcap = 10;
+
+	MTree<KeyObject, nroutes, leafcap> mtree(true);
+
+	cout << "Preload: " << endl;
+	const int N = 2000;
+	double buf[KEYLEN];
+	for (int i=0;i < N;i++){
+		generate_center(buf, m_gen);
+		mtree.Insert({ m_id++, KeyObject(buf) });
+	}
+
+	const int NClusters = 20;
+	const int ClusterSize = 5;
+	double centers[NClusters][KEYLEN];
+	vector<vector<Entry<KeyObject>>> clusters(NClusters);
+	for (int i=0;i < NClusters;i++){
+		generate_center(centers[i], m_gen);
+		generate_cluster(clusters[i], centers[i], ClusterSize);
+		for (auto &e : clusters[i]){
+			mtree.Insert(e);
+		}
+	}
+	assert(mtree.size() == N + NClusters*ClusterSize);
+
+	cout << "Run writers and readers" << endl;
+	const int NWriters = 2;
+	const int NReaders = 4;
+	const int NInserts = 5000;
+
+	atomic<int> n_writing(NWriters);
+	atomic<long> n_deleted(0);
+	atomic<long> n_queries(0);
+
+	vector<thread> threads;
+	for (int w=0;w < NWriters;w++){
+		threads.emplace_back([&, w]{
+			mt19937_64 gen(w);
+			vector<Entry<KeyObject>> inserted;
+			double buf[KEYLEN];
+			for (int i=0;i < NInserts;i++){
+				generate_center(buf, gen);
+				Entry<KeyObject> e(10000000LL*(w+1) + i, KeyObject(buf));
+				inserted.push_back(e);
+				if (w == 0){
+					mtree.Insert(e);
+				} else if (i % 50 == 49){   // the second writer inserts in batches
+					mtree.InsertBatch(inserted.end() - 50, inserted.end());
+				}
+				if (i % 50 == 49){
+					n_deleted += mtree.DeleteEntry(inserted[gen() % inserted.size()]);
+				}
+			}
+			n_writing--;
+		});
+	}
+
+	for (int r=0;r < NReaders;r++){
+		threads.emplace_back([&, r]{
+			int i = r;
+			while (n_writing.load() > 0){
+				const int c = i++ % NClusters;
+				vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[c]), Radius);
+				for (auto &e : clusters[c]){
+					int found = 0;
+					for (auto &res : results){
+						if (res.id == e.id) found++;
+					}
+					assert(found == 1);
+				}
+
+				vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(KeyObject(centers[c]), ClusterSize);
+				assert(nearest.size() == ClusterSize);
+				assert(nearest[0].dist == 0);
+				assert(nearest.back().dist <= Radius);
+				n_queries++;
+			}
+		});
+	}
+
+	for (auto &t : threads){
+		t.join();
+	}
+
+	cout << "no. queries: " << n_queries.load() << endl;
+	cout << "no. deleted: " << n_deleted.load() << endl;
+	cout << "tree size: " << mtree.size() << endl;
+	assert((long)mtree.size() == N + NClusters*ClusterSize + NWriters*NInserts - n_deleted.load());
+
+	for (int i=0;i < NClusters;i++){
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), Radius);
+		assert(results.size() >= ClusterSize);
+	}
+
+	cout << "Clear All Entries" << endl;
+	mtree.Clear();
+	assert(mtree.size() == 0);
+
+	cout << "Quantized keys with deletes" << endl;
+	{
+		// exact keys of deleted entries go back to the store only once readers are done
+		typedef Quantized<KeyObject, KEYLEN> QKey;
+		MTree<QKey, nroutes, leafcap> qtree(true);
+		vector<Entry<KeyObject>> entries;
+		for (int i=0;i < N;i++){
+			generate_center(buf, m_gen);
+			entries.push_back({ m_id++, KeyObject(buf) });
+			qtree.Insert({ entries.back().id, QKey(entries.back().key) });
+		}
+
+		atomic<bool> churning(true);
+		thread writer([&]{
+			mt19937_64 gen(7);
+			for (int i=0;i < N/2;i++){
+				const Entry<KeyObject> &e = entries[gen() % entries.size()];
+				if (qtree.DeleteEntry({ e.id, QKey(e.key) }) > 0)
+					qtree.Insert({ e.id, QKey(e.key) });
+			}
+			churning = false;
+		});
+		vector<thread> readers;
+		for (int r=0;r < NReaders;r++){
+			readers.emplace_back([&, r]{
+				int i = r;
+				while (churning.load()){
+					const KeyObject &query = entries[i++ % entries.size()].key;
+					qtree.RangeQuery(QKey(query), 2*Radius, [&](long long id, const QKey &key, double dist){
+						assert(key.get().distance(query) == dist && dist <= 2*Radius);
+					});
+				}
+			});
+		}
+		writer.join();
+		for (auto &t : readers){
+			t.join();
+		}
+		assert(qtree.size() == entries.size());
+		for (auto &e : entries){
+			assert(qtree.KNNQuery(QKey(e.key), 1)[0].dist == 0);
+		}
+	}
+
+	cout << "Done." << endl;
+
+	return 0;
+}
@@ -29,12 +29,55 @@ struct KeyObject {
 	const double distance(const KeyObject &other)const{
 		return __builtin_popcountll(key^other.key);
 	}
+	static void distance_many(const KeyObject &query, const KeyObject *const keys[], const int n, double out[]){
+		hamming_many(&query.key, keys, n, 1, [](const KeyObject *k){ return &k->key; }, out);
+	}
 };
 
+// check distance kernels against plain loops over all tail lengths
+void test_kernels(){
+	uniform_real_distribution<double> vals(-1.0, 1.0);
+	for (int dim=1;dim <= 40;dim++){
+		vector<double> a(dim), b(dim);
+		vector<float> fa(dim), fb(dim);
+		vector<uint64_t> ua(dim), ub(dim);
+		double sum = 0, fsum = 0;
+		int bits = 0;
+		for (int i=0;i < dim;i++){
+			a[i] = vals(gen);
+			b[i] = vals(gen);
+			fa[i] = a[i];
+			fb[i] = b[i];
+			ua[i] = distrib(gen);
+			ub[i] = distrib(gen);
+			sum += (a[i] - b[i])*(a[i] - b[i]);
+			fsum += (fa[i] - fb[i])*(fa[i] - fb[i]);
+			bits += __builtin_popcountll(ua[i]^ub[i]);
+		}
+		assert(abs(l2_sq(a.data(), b.data(), dim) - sum) <= 1e-12*sum);
+		assert(abs(l2_sq(fa.data(), fb.data(), dim) - fsum) <= 1e-5*fsum);
+		assert(hamming(ua.data(), ub.data(), dim) == bits);
+
+		const double *keys[2] = { b.data(), a.data() };
+		double out[2];
+		l2_many(a.data(), keys, 2, dim, [](const double *k){ return k; }, out);
+		assert(out[0] == l2(a.data(), b.data(), dim) && out[1] == 0);
+	}
+
+	double ds[13] = { 0.5, 0.1, 0.35, 0.3, 0.2, 0.45, 0.0, 0.31, 0.29, 0.3, 1.0, 0.25, 0.3 };
+	int idx[13];
+	int n = filter_band(ds, 13, 0.3, 0.05, idx);
+	assert(n == 7);
+	for (int i=0;i < n;i++){
+		assert(abs(ds[idx[i]] - 0.3) <= 0.05);
+		assert(i == 0 || idx[i-1] < idx[i]);
+	}
+}
+
 int generate_data(vector<Entry<KeyObject>> &entries, const int N){
 
 	for (int i=0;i < N;i++){
-		Entry<KeyObject> entry { .id = m_id++, .key = KeyObject(distrib(gen)) };
+		Entry<KeyObject> entry { m_id++, KeyObject(distrib(gen)) };
 		entries.push_back(entry);
 	}
 
@@ -47,20 +90,22 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, uint64_t center, int N,
 		
 	uint64_t mask = 0x01;
 
-	entries.push_back({ .id = g_id++, .key = KeyObject(center) });
+	entries.push_back({ g_id++, KeyObject(center) });
 	for (int i=0;i < N-1;i++){
 		uint64_t val = center;
 		int dist = radius_distr(gen);
 		for (int j=0;j < dist;j++){
 			val ^= (mask << bitindex_distr(gen));
 		}
-		entries.push_back({ .id = g_id++, .key = KeyObject(val) });
+		entries.push_back({ g_id++, KeyObject(val) });
 	}
 	return N;
 }
 
 int main(int argc, char **argv){
 
+	test_kernels();
+
 	const int nroutes = 2;
 	const int leafcap = 10;
 	
@@ -72,11 +117,11 @@ int main(int argc, char **argv){
 	generate_data(entries, N);
 	assert(entries.size() == N);
 
-	RoutingObject<KeyObject>::n_build_ops = 0;
+	BuildCounter::Reset();
 	for (auto e: entries){
 		mtree.Insert(e);
 	}
-	cout << "no. distance ops: " << RoutingObject<KeyObject>::n_build_ops << endl;
+	cout << "no. distance ops: " << BuildCounter::Total() << endl;
 	
 	entries.clear();
 
@@ -110,17 +155,30 @@ int main(int argc, char **argv){
 	sz = mtree.size();
 	assert(sz == N + NClusters*ClusterSize);
 	
-	DBEntry<KeyObject>::n_query_ops = 0;
+	QueryStats qstats;
 	
 	for (int i=0;i < NClusters;i++){
 		cout << "Query[" << dec << i << "] " << hex << centers[i] << endl;
-		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(KeyObject(centers[i])), MaxRadius);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(KeyObject(centers[i])), MaxRadius, &qstats);
 		cout << "=>Found: " << dec << results.size() << " entries" << endl;
 		assert(results.size() >= ClusterSize);
 		results.clear();
 	}
 
-	cout << "avg. no. ops: " << (double)DBEntry<KeyObject>::n_query_ops/(double)NClusters/(double)sz  << endl;
+	cout << "avg. no. ops: " << (double)qstats.n_distances/(double)NClusters/(double)sz  << endl;
+#ifndef MTREE_NO_STATS
+	assert(qstats.n_distances > 0 && qstats.n_nodes >= NClusters);
+#endif
+
+	for (int i=0;i < NClusters;i++){
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(KeyObject(centers[i]), ClusterSize);
+		assert(nearest.size() == ClusterSize);
+		assert(nearest[0].dist == 0);
+		for (int j=1;j < ClusterSize;j++){
+			assert(nearest[j-1].dist <= nearest[j].dist);
+		}
+		assert(nearest[ClusterSize-1].dist <= MaxRadius);
+	}
 	
 	size_t nbytes = mtree.memory_usage();
 	cout << "bytes in use: " << nbytes << " bytes" << endl;
@@ -2,9 +2,19 @@
 #include <iomanip>
 #include <random>
 #include <vector>
+#include <memory>
 #include <cassert>
 #include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
 #include "mtree/mtree.hpp"
+#include "mtree/sharded.hpp"
 
 using namespace std;
 using namespace mt;
@@ -41,8 +51,24 @@ struct KeyObject {
 		}
 		return sqrt(d);
 	}
+	const double* data()const{
+		return key;
+	}
+};
+
+template<>
+struct mt::Serializer<KeyObject> {
+	static void write(std::ostream &out, const KeyObject &k){
+		out.write((const char*)k.key, KEYLEN*sizeof(double));
+	}
+	static void read(std::istream &in, KeyObject &k){
+		in.read((char*)k.key, KEYLEN*sizeof(double));
+	}
 };
 
+template<>
+struct mt::is_mappable<KeyObject> : std::true_type {};
+
 
 int generate_center(double center[]){
 	for (int i=0;i < KEYLEN;i++){
@@ -55,16 +81,35 @@ int generate_data(vector<Entry<KeyObject>> &entries, const int N){
 	double buf[KEYLEN];
 	for (int i=0;i < N;i++){
 		generate_center(buf);
-		Entry<KeyObject> entry = { .id = m_id++, .key = KeyObject(buf) };
+		Entry<KeyObject> entry = { m_id++, KeyObject(buf) };
 		entries.push_back(entry);
 	}
 	return entries.size();
 }
 
 
+// key owning heap memory, to check memory accounting
+struct HeapKey {
+	vector<double> v;
+	const double distance(const HeapKey &other)const{
+		return fabs(v[0] - other.v[0]);
+	}
+	size_t heap_bytes()const{
+		return v.capacity()*sizeof(double);
+	}
+};
+
+// key sharing its value, to check that removed keys are let go
+struct SharedKey {
+	shared_ptr<const double> v;
+	const double distance(const SharedKey &other)const{
+		return fabs(*v - *other.v);
+	}
+};
+
 int generate_cluster(vector<Entry<KeyObject>> &entries, double center[], int N){
 
-	entries.push_back({ .id = g_id++, .key = KeyObject(center) });
+	entries.push_back({ g_id++, KeyObject(center) });
 	for (int i=0;i < N-1;i++){
 
 		double v[KEYLEN];
@@ -72,11 +117,92 @@ int generate_cluster(vector<Entry<KeyObject>> &entries, double center[], int N){
 			v[j] = center[j] + m_eps(m_gen);
 		}
 	
-		entries.push_back({ .id = g_id++, .key = KeyObject(v) });
+		entries.push_back({ g_id++, KeyObject(v) });
 	}
 	return N;
 }
 
+// all leaves at one depth, as BulkLoad leaves them
+bool balanced(const vector<size_t> &histogram){
+	int n_depths = 0;
+	for (size_t count : histogram){
+		if (count > 0) n_depths++;
+	}
+	return n_depths == 1;
+}
+
+// tree built by Insert with split policies must answer range queries exactly
+template<typename Tree>
+void check_split_policy(const vector<Entry<KeyObject>> &entries, const KeyObject &query){
+	Tree tree;
+	for (auto &e : entries){
+		tree.Insert(e);
+	}
+	assert(tree.size() == entries.size());
+	for (auto &e : entries){
+		bool found = false;
+		tree.RangeQuery(e.key, 0, [&](const long long id, const KeyObject &key, const double dist){
+			if (id == e.id) found = true;
+		});
+		assert(found);
+	}
+
+	const double radius = 1.0;
+	size_t expected = 0;
+	for (auto &e : entries){
+		if (e.key.distance(query) <= radius) expected++;
+	}
+	assert(tree.RangeQuery(query, radius).size() == expected);
+	assert(tree.KNNQuery(query, 1)[0].dist == tree.KNNQuery(query, 2)[0].dist);
+}
+
+// deleting most entries in random order must find each one, shed leaves and leave
+// the rest searchable
+template<typename Tree>
+void check_churn(vector<Entry<KeyObject>> entries, const KeyObject &query){
+	Tree tree;
+	for (auto &e : entries){
+		tree.Insert(e);
+	}
+	vector<size_t> depths = tree.DepthHistogram();
+	size_t n_leaves = 0;
+	for (size_t count : depths) n_leaves += count;
+
+	shuffle(entries.begin(), entries.end(), m_gen);
+	const size_t n_keep = entries.size()/10;
+	while (entries.size() > n_keep){
+		assert(tree.DeleteEntry(entries.back()) == 1);
+		entries.pop_back();
+		assert(tree.size() == entries.size());
+	}
+
+	size_t n_left = 0;
+	for (size_t count : tree.DepthHistogram()) n_left += count;
+	cout << "churn leaves: " << n_leaves << " -> " << n_left << endl;
+	assert(n_left < n_leaves/2);
+
+	for (auto &e : entries){
+		bool found = false;
+		tree.RangeQuery(e.key, 0, [&](const long long id, const KeyObject &key, const double dist){
+			if (id == e.id) found = true;
+		});
+		assert(found);
+	}
+	const double radius = 1.0;
+	size_t expected = 0;
+	for (auto &e : entries){
+		if (e.key.distance(query) <= radius) expected++;
+	}
+	assert(tree.RangeQuery(query, radius).size() == expected);
+
+	for (auto &e : entries){
+		assert(tree.DeleteEntry(e) == 1);
+	}
+	assert(tree.size() == 0 && tree.RangeQuery(query, radius).size() == 0);
+	tree.Insert(entries[0]);
+	assert(tree.KNNQuery(query, 1).size() == 1);
+}
+
 int main(int argc, char **argv){
 
 	const int nroutes = 2;
@@ -90,12 +216,13 @@ int main(int argc, char **argv){
 	generate_data(entries, N);
 	assert(entries.size() == N);
 
-	RoutingObject<KeyObject>::n_build_ops = 0;
+	BuildCounter::Reset();
 	for (auto e: entries){
 		mtree.Insert(e);
 	}
-	cout << "no. distance ops: " << RoutingObject<KeyObject>::n_build_ops << endl;
+	cout << "no. distance ops: " << BuildCounter::Total() << endl;
 	
+	vector<Entry<KeyObject>> all_entries(entries);
 	entries.clear();
 
 	int sz = mtree.size();
@@ -118,6 +245,7 @@ int main(int argc, char **argv){
 		
 		for (auto e : cluster){
 			mtree.Insert(e);
+			all_entries.push_back(e);
 		}
 
 		sz = mtree.size();
@@ -127,22 +255,815 @@ int main(int argc, char **argv){
 
 	sz = mtree.size();
 	assert(sz == N + NClusters*ClusterSize);
+
+	vector<size_t> depths = mtree.DepthHistogram();
+	cout << "leaf depths:";
+	for (size_t i=0;i < depths.size();i++){
+		if (depths[i] > 0) cout << " " << i << ":" << depths[i];
+	}
+	cout << endl;
+	assert(depths.size() > 2);
 	
-	DBEntry<KeyObject>::n_query_ops = 0;
+	QueryStats qstats;
 	
 	for (int i=0;i < NClusters;i++){
 		cout << "Query[" << dec << i << "] " << endl;
-		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(KeyObject(centers[i])), Radius);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(KeyObject(centers[i])), Radius, &qstats);
 		cout << "=>Found: " << dec << results.size() << " entries" << endl;
 		assert(results.size() >= ClusterSize);
 		results.clear();
 	}
 
-	cout << "avg. no. ops: " << (double)DBEntry<KeyObject>::n_query_ops/(double)NClusters << endl;
+	cout << "avg. no. ops: " << (double)qstats.n_distances/(double)NClusters << endl;
+
+	const int K = 8;
+	for (int i=0;i < NClusters;i++){
+		cout << "KNN Query[" << dec << i << "] " << endl;
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(KeyObject(centers[i]), K);
+		assert(nearest.size() == K);
+
+		vector<double> dists;
+		for (auto &e : all_entries){
+			dists.push_back(e.key.distance(KeyObject(centers[i])));
+		}
+		sort(dists.begin(), dists.end());
+		for (int j=0;j < K;j++){
+			assert(nearest[j].dist == dists[j]);
+			assert(nearest[j].key.distance(KeyObject(centers[i])) == nearest[j].dist);
+		}
+		cout << "=>Found: " << nearest.size() << " nearest, max dist " << nearest.back().dist << endl;
+	}
+	assert(mtree.KNNQuery(KeyObject(centers[0]), 0).size() == 0);
+
+	cout << "Query stats" << endl;
+	{
+		QueryStats range_stats, knn_stats;
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(KeyObject(centers[1]), K, &knn_stats);
+		mtree.RangeQuery(KeyObject(centers[1]), nearest.back().dist, &range_stats);
+#ifndef MTREE_NO_STATS
+		assert(range_stats.n_nodes > 0 && range_stats.n_distances > 0);
+		assert(knn_stats.n_nodes > 0 && knn_stats.n_distances > 0);
+#endif
+		// a radius covering everything measures every entry and prunes nothing
+		QueryStats all_stats;
+		mtree.RangeQuery(KeyObject(centers[1]), 1000.0, &all_stats);
+#ifndef MTREE_NO_STATS
+		assert(all_stats.n_pruned_parent == 0 && all_stats.n_pruned_cover == 0);
+		assert(all_stats.n_distances >= (size_t)sz);
+#endif
+
+		// identical builds on two threads count the same build ops in each thread's slot
+		vector<Entry<KeyObject>> copy(all_entries.begin(), all_entries.begin() + N);
+		BuildCounter::Reset();
+		{
+			MTree<KeyObject, nroutes, leafcap> t1;
+			for (auto &e : copy) t1.Insert(e);
+		}
+		const unsigned long n_ops = BuildCounter::Total();
+		thread th([&]{
+			MTree<KeyObject, nroutes, leafcap> t2;
+			for (auto &e : copy) t2.Insert(e);
+		});
+		th.join();
+#ifndef MTREE_NO_STATS
+		assert(n_ops > 0 && BuildCounter::Total() == 2*n_ops);
+#endif
+	}
+	assert(mtree.KNNQuery(KeyObject(centers[0]), 2*sz).size() == (size_t)sz);
+
+	cout << "Approximate queries" << endl;
+	for (int i=0;i < NClusters;i++){
+		KeyObject query(centers[i]);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(query, 4*Radius);
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+		vector<long long> exact_ids;
+		for (auto &e : results) exact_ids.push_back(e.id);
+		sort(exact_ids.begin(), exact_ids.end());
+
+		// no limits is exact
+		assert(mtree.ApproxRangeQuery(query, 4*Radius, SearchLimits()).size() == results.size());
+		vector<NNEntry<KeyObject>> approx_nn = mtree.ApproxKNNQuery(query, K, SearchLimits());
+		assert(approx_nn.size() == nearest.size());
+		for (int j=0;j < (int)nearest.size();j++){
+			assert(approx_nn[j].dist == nearest[j].dist);
+		}
+
+		// a budget stops the search within one node of it, reporting only true matches
+		for (const SearchLimits &limits : { SearchLimits(50), SearchLimits(0, 3), SearchLimits(0, 0, 1.0) }){
+			QueryStats range_stats, knn_stats;
+			vector<Entry<KeyObject>> approx = mtree.ApproxRangeQuery(query, 4*Radius, limits, &range_stats);
+			assert(approx.size() <= results.size());
+			for (auto &e : approx){
+				assert(binary_search(exact_ids.begin(), exact_ids.end(), e.id));
+			}
+			approx_nn = mtree.ApproxKNNQuery(query, K, limits, &knn_stats);
+			assert(approx_nn.size() <= (size_t)K);
+			for (int j=0;j < (int)approx_nn.size();j++){
+				assert(approx_nn[j].dist >= nearest[j].dist);
+				assert(approx_nn[j].key.distance(query) == approx_nn[j].dist);
+			}
+#ifndef MTREE_NO_STATS
+			if (limits.max_distances > 0){
+				assert(range_stats.n_distances < limits.max_distances + leafcap);
+				assert(knn_stats.n_distances < limits.max_distances + leafcap);
+			}
+			if (limits.max_nodes > 0){
+				assert(range_stats.n_nodes <= limits.max_nodes && knn_stats.n_nodes <= limits.max_nodes);
+			}
+#endif
+		}
+	}
+
+	cout << "Batch queries" << endl;
+	ThreadPool pool(4);
+	vector<KeyObject> queries;
+	for (int i=0;i < NClusters;i++){
+		queries.push_back(KeyObject(centers[i]));
+	}
+	vector<vector<Entry<KeyObject>>> batch = mtree.BatchRangeQuery(queries, Radius, pool);
+	vector<vector<NNEntry<KeyObject>>> batch_nn = mtree.BatchKNNQuery(queries, K, pool);
+	assert(batch.size() == NClusters && batch_nn.size() == NClusters);
+	for (int i=0;i < NClusters;i++){
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(queries[i], Radius);
+		assert(batch[i].size() == results.size());
+		for (int j=0;j < (int)results.size();j++){
+			assert(batch[i][j].id == results[j].id);
+		}
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(queries[i], K);
+		assert(batch_nn[i].size() == nearest.size());
+		for (int j=0;j < (int)nearest.size();j++){
+			assert(batch_nn[i][j].dist == nearest[j].dist);
+		}
+	}
+
+	cout << "Visitor queries" << endl;
+	for (int i=0;i < NClusters;i++){
+		KeyObject query(centers[i]);
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(query, Radius);
+
+		vector<long long> ids;
+		mtree.RangeQuery(query, Radius, CollectIds(ids));
+		vector<IdDist> id_dists;
+		mtree.RangeQuery(query, Radius, CollectIdDists(id_dists));
+		int n_visited = 0;
+		mtree.RangeQuery(query, Radius, [&](const long long id, const KeyObject &key, const double dist){
+			assert(id == results[n_visited].id);
+			assert(key.distance(query) == dist && dist <= Radius);
+			n_visited++;
+		});
+		assert(n_visited == (int)results.size());
+		assert(ids.size() == results.size() && id_dists.size() == results.size());
+		for (int j=0;j < (int)results.size();j++){
+			assert(ids[j] == results[j].id && id_dists[j].id == results[j].id);
+			assert(id_dists[j].dist == results[j].key.distance(query));
+		}
+
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+		id_dists.clear();
+		mtree.KNNQuery(query, K, CollectIdDists(id_dists));
+		assert(id_dists.size() == nearest.size());
+		for (int j=0;j < (int)nearest.size();j++){
+			assert(id_dists[j].id == nearest[j].id && id_dists[j].dist == nearest[j].dist);
+		}
+	}
+
+	cout << "Split policies" << endl;
+	{
+		KeyObject query(centers[2]);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, FarthestPromote, HyperplanePartition>>(all_entries, query);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, RandomPromote, HyperplanePartition>>(all_entries, query);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, SampledMinMaxPromote<>, HyperplanePartition>>(all_entries, query);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, LBDistPromote, HyperplanePartition>>(all_entries, query);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, FarthestPromote, BalancedPartition>>(all_entries, query);
+		check_split_policy<MTree<KeyObject, nroutes, leafcap, LBDistPromote, BalancedPartition>>(all_entries, query);
+
+		cout << "Delete churn" << endl;
+		check_churn<MTree<KeyObject, nroutes, leafcap>>(all_entries, query);
+		check_churn<MTree<KeyObject, 4, leafcap>>(all_entries, query);
+		check_churn<MTree<KeyObject, 4, leafcap, LBDistPromote, BalancedPartition>>(all_entries, query);
+
+		// balanced partition splits a leaf of leafcap+1 entries into halves
+		vector<DBEntry<KeyObject>> split_entries, entries1, entries2;
+		for (int i=0;i <= leafcap;i++){
+			split_entries.push_back({ all_entries[i].id, all_entries[i].key, 0 });
+		}
+		RoutingObject<KeyObject> robj1, robj2;
+		FarthestPromote()(split_entries, robj1, robj2);
+		BalancedPartition()(split_entries, robj1, robj2, entries1, entries2);
+		assert((int)entries1.size() == (leafcap+2)/2 && (int)entries2.size() == (leafcap+1)/2);
+		for (auto &e : entries1){
+			assert(e.d == e.key.distance(robj1.key) && e.d <= robj1.cover_radius);
+		}
+	}
+
+	cout << "Bulk load" << endl;
+	vector<Entry<KeyObject>> bulk_entries(all_entries);
+	MTree<KeyObject, nroutes, leafcap> mtree2(std::move(bulk_entries));
+	assert(mtree2.size() == (size_t)sz);
+	for (int i=0;i < NClusters;i++){
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), Radius);
+		vector<Entry<KeyObject>> results2 = mtree2.RangeQuery(KeyObject(centers[i]), Radius);
+		assert(results.size() == results2.size());
+
+		vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(KeyObject(centers[i]), K);
+		vector<NNEntry<KeyObject>> nearest2 = mtree2.KNNQuery(KeyObject(centers[i]), K);
+		for (int j=0;j < K;j++){
+			assert(nearest[j].dist == nearest2[j].dist);
+		}
+	}
+
+	cout << "Batch insert" << endl;
+	{
+		// every entry is found where its routes' cover radii say it can be, and queries
+		// answer as on the tree built one insert at a time
+		auto check_batch = [&](auto &tree){
+			assert(tree.size() == all_entries.size());
+			for (auto &e : all_entries){
+				vector<long long> ids;
+				tree.RangeQuery(e.key, 0, CollectIds(ids));
+				assert(find(ids.begin(), ids.end(), e.id) != ids.end());
+			}
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				vector<long long> ids, bids;
+				mtree.RangeQuery(query, 2*Radius, CollectIds(ids));
+				tree.RangeQuery(query, 2*Radius, CollectIds(bids));
+				sort(ids.begin(), ids.end());
+				sort(bids.begin(), bids.end());
+				assert(ids == bids);
+
+				vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+				vector<NNEntry<KeyObject>> bnearest = tree.KNNQuery(query, K);
+				for (int j=0;j < K;j++){
+					assert(nearest[j].dist == bnearest[j].dist);
+				}
+			}
+		};
+
+		vector<Entry<KeyObject>> shuffled(all_entries);
+		shuffle(shuffled.begin(), shuffled.end(), m_gen);
+
+		// a few entries one at a time into the lone leaf, then batches that split leaves many ways
+		MTree<KeyObject, nroutes, leafcap> btree;
+		btree.InsertBatch(shuffled.begin(), shuffled.begin() + 5);
+		btree.InsertBatch(shuffled.begin() + 5, shuffled.begin() + 40);
+		btree.InsertBatch(vector<Entry<KeyObject>>(shuffled.begin() + 40, shuffled.end()));
+		check_batch(btree);
+
+		// all but the first leaf in one batch, growing many levels at once
+		MTree<KeyObject, 8, 40> wide(3, 6);
+		wide.InsertBatch(shuffled);
+		assert(wide.DepthHistogram().size() > 3);
+		check_batch(wide);
+
+		// many equal keys are halved over leaves rather than split off one at a time
+		MTree<KeyObject, nroutes, leafcap> same;
+		vector<Entry<KeyObject>> copies;
+		for (int i=0;i < 50*leafcap;i++){
+			copies.push_back({ i, all_entries[0].key });
+		}
+		same.InsertBatch(copies.begin(), copies.begin() + leafcap + 1);
+		same.InsertBatch(copies.begin() + leafcap + 1, copies.end());
+		assert(same.size() == copies.size());
+		// halving puts the leaves about log2 of their count below the full root's route
+		vector<size_t> same_depths = same.DepthHistogram();
+		size_t n_same = 0;
+		for (size_t count : same_depths) n_same += count;
+		assert(same_depths.size() <= 3 + log2(n_same));
+		assert(same.RangeQuery(all_entries[0].key, 0).size() == copies.size());
+	}
+
+	cout << "Sharded" << endl;
+	{
+		// the same answers as the single tree whichever way entries are placed
+		auto check_shards = [&](ShardedMTree<KeyObject, nroutes, leafcap> &tree, const size_t n){
+			assert(tree.size() == n);
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				for (double radius : { 0.0, Radius, 4*Radius }){
+					vector<long long> ids, sids;
+					mtree.RangeQuery(query, radius, CollectIds(ids));
+					for (auto &e : tree.RangeQuery(query, radius)) sids.push_back(e.id);
+					sort(ids.begin(), ids.end());
+					sort(sids.begin(), sids.end());
+					assert(ids == sids);
+				}
+				vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+				vector<NNEntry<KeyObject>> snearest = tree.KNNQuery(query, K);
+				assert(nearest.size() == snearest.size());
+				for (int j=0;j < (int)nearest.size();j++){
+					assert(nearest[j].dist == snearest[j].dist);
+				}
+			}
+		};
+
+		for (ShardRouting routing : { SHARD_BY_HASH, SHARD_BY_PIVOT }){
+			ShardedMTree<KeyObject, nroutes, leafcap> inserted(3, routing, 4);
+			for (auto &e : all_entries) inserted.Insert(e);
+			check_shards(inserted, all_entries.size());
+
+			ShardedMTree<KeyObject, nroutes, leafcap> batched(5, routing, 2);
+			batched.InsertBatch(vector<Entry<KeyObject>>(all_entries.begin(), all_entries.begin() + 3));
+			batched.InsertBatch(vector<Entry<KeyObject>>(all_entries.begin() + 3, all_entries.end()));
+			check_shards(batched, all_entries.size());
+
+			ShardedMTree<KeyObject, nroutes, leafcap> bulk(4, routing, 3);
+			bulk.BulkLoad(vector<Entry<KeyObject>>(all_entries));
+			check_shards(bulk, all_entries.size());
+			for (int s=0;s < bulk.n_shards();s++){
+				assert(bulk.shard(s).size() > 0);
+			}
+
+			for (auto &e : all_entries){
+				assert(bulk.DeleteEntry(e) >= 1);
+			}
+			assert(bulk.size() == 0 && bulk.KNNQuery(KeyObject(centers[0]), K).empty());
+		}
+
+		// a search tightens a shared bound to its k-th distance; one starting with the bound
+		// already there finds the same neighbors for fewer distances
+		KNNBound bound;
+		QueryStats plain, bounded;
+		KeyObject query(centers[0]);
+		vector<NNEntry<KeyObject>> nearest = mtree.ApproxKNNQuery(query, K, SearchLimits(0, 0, 0, &bound), &plain);
+		assert(bound.get() == nearest.back().dist);
+		vector<NNEntry<KeyObject>> again = mtree.ApproxKNNQuery(query, K, SearchLimits(0, 0, 0, &bound), &bounded);
+		assert(again.size() == nearest.size() && again.back().dist == nearest.back().dist);
+		assert(bounded.n_distances <= plain.n_distances);
+
+		bool thrown = false;
+		try {
+			ShardedMTree<KeyObject> none(0);
+		} catch (const invalid_argument &ex){
+			thrown = true;
+		}
+		assert(thrown);
+	}
+
+	cout << "Freeze" << endl;
+	{
+		// same answers, distances and work as the tree it was frozen from, in less memory
+		FrozenMTree<KeyObject, nroutes, leafcap> frozen = mtree.Freeze();
+		assert(frozen.size() == mtree.size() && frozen.height() == (int)mtree.DepthHistogram().size());
+		assert(frozen.memory_usage() < mtree.memory_usage());
+		for (int i=0;i < NClusters;i++){
+			KeyObject query(centers[i]);
+			for (double radius : { 0.0, Radius, 4*Radius }){
+				QueryStats qstats, fstats;
+				vector<long long> ids, fids;
+				mtree.RangeQuery(query, radius, CollectIds(ids), &qstats);
+				frozen.RangeQuery(query, radius, CollectIds(fids), &fstats);
+				assert(ids == fids && qstats.n_distances == fstats.n_distances);
+			}
+			QueryStats qstats, fstats;
+			vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K, &qstats);
+			vector<NNEntry<KeyObject>> fnearest = frozen.KNNQuery(query, K, &fstats);
+			assert(nearest.size() == fnearest.size() && qstats.n_distances == fstats.n_distances);
+			for (int j=0;j < (int)nearest.size();j++){
+				assert(nearest[j].id == fnearest[j].id && nearest[j].dist == fnearest[j].dist);
+			}
+		}
+
+		// a copy, untouched by later changes; moves hand the block over
+		MTree<KeyObject, nroutes, leafcap> changing;
+		for (auto &e : all_entries) changing.Insert(e);
+		FrozenMTree<KeyObject, nroutes, leafcap> before = changing.Freeze();
+		changing.Clear();
+		FrozenMTree<KeyObject, nroutes, leafcap> moved(std::move(before));
+		assert(before.size() == 0 && before.RangeQuery(all_entries[0].key, Radius).empty());
+		assert(moved.size() == all_entries.size() && moved.RangeQuery(all_entries[0].key, 0).size() >= 1);
+
+		FrozenMTree<KeyObject, nroutes, leafcap> empty = changing.Freeze();
+		assert(empty.size() == 0 && empty.height() == 0 && empty.KNNQuery(all_entries[0].key, K).empty());
+
+		// mapped from a file, queried in place with the same answers under every hint
+		const string frozen_path = "testmtree2.frozen";
+		frozen.Save(frozen_path);
+		for (MapAdvice advice : { ADVISE_NORMAL, ADVISE_RANDOM, ADVISE_SEQUENTIAL, ADVISE_WILLNEED, ADVISE_HOT_ROUTES }){
+			FrozenMTree<KeyObject, nroutes, leafcap> mapped;
+			mapped.Map(frozen_path, advice);
+			assert(mapped.mapped() && mapped.size() == frozen.size() && mapped.height() == frozen.height());
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				vector<long long> ids, mids;
+				frozen.RangeQuery(query, 2*Radius, CollectIds(ids));
+				mapped.RangeQuery(query, 2*Radius, CollectIds(mids));
+				assert(ids == mids);
+				vector<NNEntry<KeyObject>> nearest = frozen.KNNQuery(query, K);
+				vector<NNEntry<KeyObject>> mnearest = mapped.KNNQuery(query, K);
+				for (int j=0;j < (int)nearest.size();j++){
+					assert(nearest[j].id == mnearest[j].id && nearest[j].dist == mnearest[j].dist);
+				}
+			}
+			FrozenMTree<KeyObject, nroutes, leafcap> handed(std::move(mapped));
+			assert(handed.mapped() && !mapped.mapped() && handed.RangeQuery(all_entries[0].key, 0).size() >= 1);
+		}
+
+		// files of other key sizes or capacities, cut short, or missing are refused
+		auto refused = [](auto &&tree, const string &file){
+			try {
+				tree.Map(file);
+			} catch (const runtime_error &ex){
+				return tree.size() == 0 && !tree.mapped();
+			}
+			return false;
+		};
+		assert(refused(FrozenMTree<KeyObject, nroutes, leafcap/2>(), frozen_path));
+		assert(refused(FrozenMTree<Pivoted<KeyObject, 2>, nroutes, leafcap>(), frozen_path));
+		assert(refused(FrozenMTree<KeyObject, nroutes, leafcap>(), "no-such-file.frozen"));
+		FILE *fp = fopen(frozen_path.c_str(), "r+");
+		fseek(fp, 0, SEEK_END);
+		const long file_size = ftell(fp);
+		fclose(fp);
+		assert(truncate(frozen_path.c_str(), file_size - 64) == 0);
+		assert(refused(FrozenMTree<KeyObject, nroutes, leafcap>(), frozen_path));
+
+		// as are files whose header, nodes or routes point outside the file or back up the tree
+		auto patched = [&](const uint64_t at, const void *value, const size_t size){
+			frozen.Save(frozen_path);
+			FILE *fp = fopen(frozen_path.c_str(), "r+");
+			fseek(fp, at, SEEK_SET);
+			fwrite(value, size, 1, fp);
+			fclose(fp);
+			return refused(FrozenMTree<KeyObject, nroutes, leafcap>(), frozen_path);
+		};
+		frozen.Save(frozen_path);
+		FrozenHeader header;
+		fp = fopen(frozen_path.c_str(), "r");
+		assert(fread(&header, sizeof(header), 1, fp) == 1);
+		fclose(fp);
+		assert(header.height > 1);
+		const uint64_t misaligned = header.keys + 8, huge = UINT64_MAX/8 + 1;
+		const uint32_t far = (uint32_t)header.n_routes, self = 0, past = (uint32_t)header.n_nodes;
+		const uint16_t over = nroutes + 1;
+		assert(patched(offsetof(FrozenHeader, keys), &misaligned, sizeof(misaligned)));
+		assert(patched(offsetof(FrozenHeader, n_routes), &huge, sizeof(huge)));
+		assert(patched(header.nodes, &far, sizeof(far)));              // root's first route
+		assert(patched(header.nodes + 4, &over, sizeof(over)));        // root's route count
+		assert(patched(header.routes + 16, &self, sizeof(self)));      // child of root's first route
+		assert(patched(header.routes + 16, &past, sizeof(past)));
+
+		empty.Save(frozen_path);
+		FrozenMTree<KeyObject, nroutes, leafcap> mapped_empty;
+		mapped_empty.Map(frozen_path);
+		assert(mapped_empty.size() == 0 && mapped_empty.RangeQuery(all_entries[0].key, Radius).empty());
+		remove(frozen_path.c_str());
+	}
+
+	cout << "Save and load" << endl;
+	const string path = "testmtree2.idx";
+	mtree.Save(path);
+	MTree<KeyObject, nroutes, leafcap> mtree3;
+	unsigned long n_ops = BuildCounter::Total();
+	mtree3.Load(path);
+	assert(BuildCounter::Total() == n_ops);
+	assert(mtree3.size() == (size_t)sz);
+	assert(mtree3.memory_usage() <= mtree.memory_usage());
+	for (int i=0;i < NClusters;i++){
+		vector<Entry<KeyObject>> results = mtree.RangeQuery(KeyObject(centers[i]), Radius);
+		vector<Entry<KeyObject>> results3 = mtree3.RangeQuery(KeyObject(centers[i]), Radius);
+		assert(results.size() == results3.size());
+		for (int j=0;j < (int)results.size();j++){
+			assert(results[j].id == results3[j].id);
+		}
+	}
+	MTree<KeyObject, nroutes+1, leafcap> mtree5;
+	mtree5.Load(path);
+	assert(mtree5.size() == (size_t)sz && mtree5.nroutes() == nroutes && mtree5.leafcap() == leafcap);
+	MTree<KeyObject, nroutes, leafcap-1> mtree4;
+	bool rejected = false;
+	try {
+		mtree4.Load(path);
+	} catch (const runtime_error &err){
+		rejected = true;
+	}
+	assert(rejected && mtree4.size() == 0);
+	remove(path.c_str());
+
+	cout << "Runtime capacities" << endl;
+	{
+		bool rejected = false;
+		try {
+			MTree<KeyObject, 8, 40> bad(9, 40);
+		} catch (const invalid_argument &err){
+			rejected = true;
+		}
+		assert(rejected);
+
+		MTree<KeyObject, 8, 40> tuned(3, 6);
+		assert(tuned.nroutes() == 3 && tuned.leafcap() == 6);
+		for (auto &e : all_entries){
+			tuned.Insert(e);
+		}
+		vector<size_t> depths = tuned.DepthHistogram();
+		size_t n_leaves = 0;
+		for (size_t count : depths) n_leaves += count;
+		assert(n_leaves >= all_entries.size()/6);
+		KeyObject query(centers[3]);
+		assert(tuned.RangeQuery(query, Radius).size() == mtree.RangeQuery(query, Radius).size());
+
+		// nodes sized to the capacities chosen, as in a tree compiled with them
+		MTree<KeyObject, 3, 6> fixed;
+		for (auto &e : all_entries){
+			fixed.Insert(e);
+		}
+		assert(tuned.allocator_stats().n_nodes == fixed.allocator_stats().n_nodes);
+		assert(tuned.allocator_stats().bytes_in_use == fixed.allocator_stats().bytes_in_use);
+
+		vector<Entry<KeyObject>> copy(all_entries);
+		MTree<KeyObject, 8, 40> bulk(3, 6);
+		bulk.BulkLoad(move(copy));
+		assert(bulk.size() == all_entries.size() && balanced(bulk.DepthHistogram()));
+		assert(bulk.DepthHistogram().back() >= all_entries.size()/6);
+		assert(bulk.RangeQuery(query, Radius).size() == mtree.RangeQuery(query, Radius).size());
+	}
+
+	cout << "Pivots" << endl;
+	{
+		typedef Pivoted<KeyObject, 4> PKey;
+		vector<Entry<PKey>> pentries;
+		for (auto &e : all_entries) pentries.push_back({ e.id, PKey(e.key) });
+
+		MTree<PKey, nroutes, leafcap> ptree;
+		for (auto &e : pentries) ptree.Insert(e);
+		vector<Entry<PKey>> copy(pentries);
+		MTree<PKey, nroutes, leafcap> pbulk(move(copy));
+		assert(ptree.size() == pentries.size() && balanced(pbulk.DepthHistogram()));
+
+		// same answers as the plain tree, with some entries and routes ruled out by pivots
+		auto check_same = [&](MTree<PKey, nroutes, leafcap> &tree, QueryStats &pstats){
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				for (double radius : { 0.0, Radius, 4*Radius }){
+					vector<long long> ids, pids;
+					mtree.RangeQuery(query, radius, CollectIds(ids));
+					tree.RangeQuery(PKey(query), radius, CollectIds(pids), &pstats);
+					sort(ids.begin(), ids.end());
+					sort(pids.begin(), pids.end());
+					assert(ids == pids);
+				}
+				vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+				vector<NNEntry<PKey>> pnearest = tree.KNNQuery(PKey(query), K, &pstats);
+				assert(nearest.size() == pnearest.size());
+				for (int j=0;j < (int)nearest.size();j++){
+					assert(nearest[j].dist == pnearest[j].dist);
+				}
+			}
+		};
+		QueryStats insert_stats, bulk_stats;
+		check_same(ptree, insert_stats);
+		check_same(pbulk, bulk_stats);
+#ifndef MTREE_NO_STATS
+		assert(insert_stats.n_pruned_pivot > 0 && bulk_stats.n_pruned_pivot > 0);
+#endif
+
+		QueryStats tree_stats, frozen_stats;
+		// frozen with the pivots, through a file
+		FrozenMTree<PKey, nroutes, leafcap> pfrozen;
+		ptree.Freeze().Save(path);
+		pfrozen.Map(path);
+		remove(path.c_str());
+		for (int i=0;i < NClusters;i++){
+			PKey query(centers[i]);
+			vector<long long> ids, fids;
+			ptree.RangeQuery(query, 2*Radius, CollectIds(ids), &tree_stats);
+			pfrozen.RangeQuery(query, 2*Radius, CollectIds(fids), &frozen_stats);
+			assert(ids == fids);
+			vector<NNEntry<PKey>> nearest = ptree.KNNQuery(query, K);
+			vector<NNEntry<PKey>> fnearest = pfrozen.KNNQuery(query, K);
+			for (int j=0;j < (int)nearest.size();j++){
+				assert(nearest[j].dist == fnearest[j].dist);
+			}
+		}
+#ifndef MTREE_NO_STATS
+		assert(frozen_stats.n_pruned_pivot > 0);
+		// each route or entry skipped is counted under exactly one bound
+		assert(frozen_stats.n_pruned_parent == tree_stats.n_pruned_parent);
+		assert(frozen_stats.n_pruned_pivot == tree_stats.n_pruned_pivot);
+		assert(frozen_stats.n_pruned_bound == tree_stats.n_pruned_bound);
+		assert(frozen_stats.n_distances == tree_stats.n_distances);
+#endif
+
+		// rings survive save and load, deletes and merges
+		ptree.Save(path);
+		MTree<PKey, nroutes, leafcap> ploaded;
+		ploaded.Load(path);
+		remove(path.c_str());
+		QueryStats load_stats;
+		check_same(ploaded, load_stats);
+
+		vector<Entry<PKey>> shuffled(pentries);
+		shuffle(shuffled.begin(), shuffled.end(), m_gen);
+		const size_t n_keep = shuffled.size()/3;
+		for (size_t i=n_keep;i < shuffled.size();i++){
+			assert(ploaded.DeleteEntry(shuffled[i]) >= 1);
+		}
+		for (int i=0;i < NClusters;i++){
+			PKey query(centers[i]);
+			size_t expected = 0;
+			for (size_t j=0;j < n_keep;j++){
+				if (shuffled[j].key.distance(query) <= 2*Radius) expected++;
+			}
+			assert(ploaded.RangeQuery(query, 2*Radius).size() == expected);
+		}
+	}
+
+	cout << "Quantized keys" << endl;
+	{
+		// the same answers as the plain tree, most entries ruled out from their codes alone
+		auto check_same = [&](auto &tree, auto *key_tag, QueryStats &qstats){
+			typedef typename std::remove_pointer<decltype(key_tag)>::type QKey;
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				for (double radius : { 0.0, Radius, 4*Radius }){
+					vector<long long> ids;
+					mtree.RangeQuery(query, radius, CollectIds(ids));
+					vector<Entry<QKey>> found = tree.RangeQuery(QKey(query), radius, &qstats);
+					vector<long long> qids;
+					for (auto &e : found){
+						assert(e.key.get().distance(query) <= radius);
+						qids.push_back(e.id);
+					}
+					sort(ids.begin(), ids.end());
+					sort(qids.begin(), qids.end());
+					assert(ids == qids);
+				}
+				vector<NNEntry<KeyObject>> nearest = mtree.KNNQuery(query, K);
+				vector<NNEntry<QKey>> qnearest = tree.KNNQuery(QKey(query), K, &qstats);
+				assert(nearest.size() == qnearest.size());
+				for (int j=0;j < (int)nearest.size();j++){
+					assert(nearest[j].dist == qnearest[j].dist);
+				}
+			}
+		};
+
+		typedef Quantized<KeyObject, KEYLEN> QKey;
+		MTree<QKey, nroutes, leafcap> qtree;
+		for (auto &e : all_entries) qtree.Insert({ e.id, QKey(e.key) });
+		assert(qtree.size() == all_entries.size());
+		QueryStats qstats;
+		check_same(qtree, (QKey*)NULL, qstats);
+#ifndef MTREE_NO_STATS
+		assert(qstats.n_pruned_bound > 0);
+#endif
+
+		// frozen keys carry copies of their exact keys, and outlive the tree
+		FrozenMTree<QKey, nroutes, leafcap> qfrozen;
+		{
+			MTree<QKey, nroutes, leafcap> qcopy;
+			for (auto &e : all_entries) qcopy.Insert({ e.id, QKey(e.key) });
+			qfrozen = qcopy.Freeze();
+		}
+		QueryStats frozen_stats;
+		check_same(qfrozen, (QKey*)NULL, frozen_stats);
+
+		// codes bound every distance from below
+		for (auto &e : all_entries){
+			QKey k(e.key), q(all_entries[0].key);
+			assert(k.distance_bound(q) <= k.distance(q));
+		}
+
+		// the exact keys are counted once, in the tree's store, whichever keys share them
+		TreeStats tstats = qtree.Stats();
+		assert(tstats.bytes_keys >= all_entries.size()*sizeof(KeyObject));
+		assert(tstats.bytes_keys <= (all_entries.size() + 1024)*sizeof(KeyObject)*11/10);
+
+		qtree.Save(path);
+		MTree<QKey, nroutes, leafcap> qloaded;
+		qloaded.Load(path);
+		remove(path.c_str());
+		QueryStats load_stats;
+		check_same(qloaded, (QKey*)NULL, load_stats);
+		for (int i=0;i < NClusters;i++){
+			assert(qloaded.DeleteEntry({ all_entries[i].id, QKey(all_entries[i].key) }) >= 1);
+		}
+		assert(qloaded.size() <= all_entries.size() - NClusters);
+
+		// deleted entries give their slots back for later inserts to reuse, but routes
+		// still over them keep theirs
+		vector<Entry<KeyObject>> churn;
+		generate_data(churn, 4000);
+		MTree<QKey, nroutes, leafcap> qchurn;
+		for (auto &e : churn) qchurn.Insert({ e.id, QKey(e.key) });
+		const size_t churn_bytes = qchurn.Stats().bytes_keys;
+		for (int round=0;round < 3;round++){
+			for (size_t i=round%2;i < churn.size();i += 2){
+				assert(qchurn.DeleteEntry({ churn[i].id, QKey(churn[i].key) }) >= 1);
+			}
+			for (int i=0;i < NClusters;i++){
+				KeyObject query(centers[i]);
+				size_t expected = 0;
+				for (size_t j=(round+1)%2;j < churn.size();j += 2){
+					if (churn[j].key.distance(query) <= 4*Radius) expected++;
+				}
+				vector<Entry<QKey>> found = qchurn.RangeQuery(QKey(query), 4*Radius);
+				assert(found.size() == expected);
+				for (auto &e : found){
+					assert(e.key.get().distance(query) <= 4*Radius);
+				}
+			}
+			for (size_t i=round%2;i < churn.size();i += 2){
+				qchurn.Insert({ churn[i].id, QKey(churn[i].key) });
+			}
+		}
+		assert(qchurn.size() == churn.size());
+		cout << "exact key bytes " << churn_bytes << " before churn, " << qchurn.Stats().bytes_keys << " after" << endl;
+		assert(qchurn.Stats().bytes_keys <= 2*churn_bytes);
+
+		MTree<Quantized<KeyObject, KEYLEN, float>, nroutes, leafcap> ftree;
+		for (auto &e : all_entries) ftree.Insert({ e.id, Quantized<KeyObject, KEYLEN, float>(e.key) });
+		QueryStats fstats;
+		check_same(ftree, (Quantized<KeyObject, KEYLEN, float>*)NULL, fstats);
+
+		MTree<Pivoted<QKey, 4>, nroutes, leafcap> pqtree;
+		for (auto &e : all_entries) pqtree.Insert({ e.id, Pivoted<QKey, 4>(QKey(e.key)) });
+		QueryStats pqstats;
+		for (int i=0;i < NClusters;i++){
+			KeyObject center(centers[i]);
+			Pivoted<QKey, 4> query{ QKey(center) };
+			vector<long long> ids, pqids;
+			mtree.RangeQuery(KeyObject(centers[i]), Radius, CollectIds(ids));
+			pqtree.RangeQuery(query, Radius, CollectIds(pqids), &pqstats);
+			assert(ids.size() == pqids.size());
+		}
+#ifndef MTREE_NO_STATS
+		assert(pqstats.n_pruned_pivot > 0 && pqstats.n_pruned_bound > 0);
+#endif
+	}
+
+	mtree2.Insert({ g_id++, KeyObject(centers[0]) });
+	assert(mtree2.size() == (size_t)sz + 1);
+	assert(mtree2.KNNQuery(KeyObject(centers[0]), 2)[1].dist == 0);
+	mtree2.Clear();
+	assert(mtree2.size() == 0);
 	
 	size_t nbytes = mtree.memory_usage();
 	cout << "bytes in use: " << nbytes << " bytes" << endl;
 
+	cout << "Tree stats" << endl;
+	{
+		TreeStats tstats = mtree.Stats();
+		vector<size_t> depths = mtree.DepthHistogram();
+		assert(tstats.n_entries == mtree.size());
+		assert(tstats.height == depths.size() && tstats.levels.back().n_leaves == depths.back());
+		assert(tstats.n_leaves + tstats.n_internal == mtree.allocator_stats().n_nodes);
+		assert(tstats.bytes_total == nbytes && tstats.bytes_keys == 0);
+		assert(tstats.bytes_nodes + tstats.bytes_free <= nbytes);
+
+		size_t n_routes = 0, n_filled = 0;
+		for (size_t i=0;i < tstats.fanout.size();i++) n_routes += i*tstats.fanout[i];
+		for (size_t i=0;i < tstats.leaf_fill.size();i++) n_filled += i*tstats.leaf_fill[i];
+		assert(n_filled == mtree.size() && n_routes + 1 == tstats.n_internal + tstats.n_leaves);
+		assert(tstats.mean_leaf_fill > 0 && tstats.mean_leaf_fill <= 1);
+
+		assert(tstats.levels[0].radius.empty());
+		for (size_t l=1;l < tstats.height;l++){
+			const LevelStats &level = tstats.levels[l];
+			assert(level.radius.size() == 11 && level.radius.front() <= level.radius.back());
+			assert(level.n_overlapping <= level.n_sibling_pairs);
+		}
+		cout << "height " << tstats.height << ", leaf fill " << tstats.mean_leaf_fill
+			 << ", leaf level overlap " << tstats.levels.back().overlap() << endl;
+
+		// bulk loading packs leaves close to leafcap
+		MTree<KeyObject, nroutes, leafcap> packed{vector<Entry<KeyObject>>(all_entries)};
+		TreeStats pstats = packed.Stats();
+		assert(pstats.mean_leaf_fill >= 0.75 && pstats.mean_leaf_fill > tstats.mean_leaf_fill);
+		cout << "bulk leaf fill " << pstats.mean_leaf_fill << endl;
+
+		// splits above the leaves leave no internal node with a lone route once a node
+		// holds more than two
+		MTree<KeyObject, 4, leafcap> wide;
+		for (int i=0;i < 20;i++){
+			for (auto &e : all_entries) wide.Insert({ e.id + i*g_id, e.key });
+		}
+		TreeStats wstats = wide.Stats();
+		assert(wstats.height > 3);
+		assert(wstats.fanout[0] == 0 && wstats.fanout[1] == 0);
+
+		MTree<HeapKey> heaptree;
+		for (int i=0;i < 200;i++){
+			heaptree.Insert({ i, HeapKey{ vector<double>(8, (double)i) } });
+		}
+		TreeStats hstats = heaptree.Stats();
+		assert(hstats.bytes_keys >= 200*8*sizeof(double));
+		assert(hstats.bytes_total == heaptree.memory_usage());
+		assert(heaptree.memory_usage() >= heaptree.allocator_stats().bytes_reserved + hstats.bytes_keys);
+
+		// a deleted key is released, not left behind in the slot it vacated
+		MTree<SharedKey> sharedtree;
+		vector<shared_ptr<const double>> values;
+		for (int i=0;i < 4;i++){
+			values.push_back(make_shared<const double>(i));
+			sharedtree.Insert({ i, SharedKey{ values.back() } });
+		}
+		assert(values[3].use_count() == 2);
+		assert(sharedtree.DeleteEntry({ 1, SharedKey{ values[1] } }) == 1);
+		assert(values[1].use_count() == 1 && values[3].use_count() == 2);
+		sharedtree.Clear();
+		assert(values[0].use_count() == 1 && values[3].use_count() == 1);
+	}
+
 	int ndels = mtree.DeleteEntry({0, KeyObject(centers[0]) });
 	cout << "no. deleted: " << ndels << endl;
 
@@ -156,6 +1077,7 @@ int main(int argc, char **argv){
 	cout << "=>Found: " << dec << results.size() << " entries" << endl;
 	for (int i=0;i < (int)results.size();i++){
 		cout << "    (" << dec << results[i].id << ") " << endl;
+		assert(ndels == 0 || results[i].key.distance(KeyObject(centers[0])) > 0);
 	}
 	assert((int)results.size() >= ClusterSize - ndels);	
 
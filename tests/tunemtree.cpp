@@ -0,0 +1,199 @@
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include "mtree/mtree.hpp"
+
+#define KEYLEN 16
+
+using namespace std;
+using namespace mt;
+
+// grid of capacities to try; the tuning trees are one instantiation with these
+// maximums, each built with nodes sized to its (nroutes, leafcap) pair
+const int MAX_NR = 32;
+const int MAX_LC = 256;
+const int grid_nroutes[] = { 2, 4, 8, 16, 32 };
+const int grid_leafcap[] = { 16, 32, 64, 128, 256 };
+
+const int n_queries = 100;
+const int K = 10;
+
+static random_device m_rd;
+static mt19937_64 m_gen(m_rd());
+
+// euclidean distance over KEYLEN doubles, as in perfmtree
+struct L2Key {
+	double key[KEYLEN];
+	const double distance(const L2Key &other)const{
+		return l2(key, other.key, KEYLEN);
+	}
+	static void distance_many(const L2Key &query, const L2Key *const keys[], const int n, double out[]){
+		l2_many(query.key, keys, n, KEYLEN, [](const L2Key *k){ return k->key; }, out);
+	}
+	static L2Key random(){
+		uniform_real_distribution<double> distrib(-1.0, 1.0);
+		L2Key k;
+		for (int i=0;i < KEYLEN;i++) k.key[i] = distrib(m_gen);
+		return k;
+	}
+};
+
+// hamming distance over 64-bit hashes, as in runmtree
+struct HammingKey {
+	uint64_t key;
+	const double distance(const HammingKey &other)const{
+		return __builtin_popcountll(key^other.key);
+	}
+	static void distance_many(const HammingKey &query, const HammingKey *const keys[], const int n, double out[]){
+		hamming_many(&query.key, keys, n, 1, [](const HammingKey *k){ return &k->key; }, out);
+	}
+	static HammingKey random(){
+		uniform_int_distribution<uint64_t> distrib(0);
+		return { distrib(m_gen) };
+	}
+};
+
+struct tuneresult {
+	int nroutes;
+	int leafcap;
+	double build_ops;     // distances per entry
+	double build_time;    // nanosecs per entry
+	double query_ops;     // distances per query
+	double query_time;    // microsecs per query
+	double memory;        // MB of nodes in use
+};
+
+// n keys read as raw binary records from path, or generated when path is empty
+template<typename Key>
+vector<Key> load_keys(const string &path, const int n){
+	vector<Key> keys;
+	if (path.empty()){
+		for (int i=0;i < n;i++){
+			keys.push_back(Key::random());
+		}
+		return keys;
+	}
+
+	ifstream in(path, ios::binary);
+	if (!in){
+		cerr << "unable to open " << path << endl;
+		exit(1);
+	}
+	Key k;
+	while ((int)keys.size() < n && in.read((char*)&k, sizeof(Key))){
+		keys.push_back(k);
+	}
+	shuffle(keys.begin(), keys.end(), m_gen);
+	return keys;
+}
+
+template<typename Key>
+tuneresult tune_run(const vector<Key> &keys, const int n_entries, const int nroutes, const int leafcap){
+	MTree<Key,MAX_NR,MAX_LC> mtree(nroutes, leafcap);
+
+	BuildCounter::Reset();
+	auto s = chrono::steady_clock::now();
+	for (int i=0;i < n_entries;i++){
+		mtree.Insert({ i, keys[i] });
+	}
+	auto e = chrono::steady_clock::now();
+
+	tuneresult r;
+	r.nroutes = nroutes;
+	r.leafcap = leafcap;
+	r.build_ops = (double)BuildCounter::Total()/n_entries;
+	r.build_time = chrono::duration<double, nano>(e - s).count()/n_entries;
+
+	// held out keys as queries
+	QueryStats qstats;
+	vector<IdDist> hits;
+	s = chrono::steady_clock::now();
+	for (int i=n_entries;i < (int)keys.size();i++){
+		hits.clear();
+		mtree.KNNQuery(keys[i], K, CollectIdDists(hits), &qstats);
+	}
+	e = chrono::steady_clock::now();
+	const int nq = keys.size() - n_entries;
+	r.query_ops = (double)qstats.n_distances/nq;
+	r.query_time = chrono::duration<double, micro>(e - s).count()/nq;
+
+	r.memory = mtree.allocator_stats().bytes_in_use/1000000.0;
+
+	cout << setw(8) << nroutes << setw(8) << leafcap
+		 << setw(12) << setprecision(4) << r.build_ops
+		 << setw(12) << setprecision(4) << r.build_time
+		 << setw(12) << setprecision(6) << r.query_ops
+		 << setw(12) << setprecision(4) << r.query_time
+		 << setw(10) << setprecision(4) << r.memory << endl;
+	return r;
+}
+
+template<typename Key>
+void do_tune(const string &metric, const string &path, const int n_entries){
+	vector<Key> keys = load_keys<Key>(path, n_entries + n_queries);
+	if ((int)keys.size() <= n_queries){
+		cerr << "need more than " << n_queries << " keys" << endl;
+		exit(1);
+	}
+	const int n = keys.size() - n_queries;
+
+	cout << "------------------ capacity tuning -------------------" << endl;
+	cout << "metric: " << metric << endl;
+	cout << "dataset: " << (path.empty() ? "uniform random" : path) << ", N = " << n << endl;
+	cout << "no. queries: " << n_queries << " " << K << "-NN, held out from the dataset" << endl << endl;
+	cout << setw(8) << "nroutes" << setw(8) << "leafcap"
+		 << setw(12) << "build ops" << setw(12) << "build ns"
+		 << setw(12) << "query ops" << setw(12) << "query us"
+		 << setw(10) << "MB" << endl;
+
+	vector<tuneresult> results;
+	for (int nroutes : grid_nroutes){
+		for (int leafcap : grid_leafcap){
+			results.push_back(tune_run<Key>(keys, n, nroutes, leafcap));
+		}
+	}
+
+	// fastest queries; among those within 5% of it, the least memory
+	const tuneresult *fastest = &results[0], *fewest_ops = &results[0];
+	for (auto &r : results){
+		if (r.query_time < fastest->query_time) fastest = &r;
+		if (r.query_ops < fewest_ops->query_ops) fewest_ops = &r;
+	}
+	const tuneresult *best = fastest;
+	for (auto &r : results){
+		if (r.query_time <= 1.05*fastest->query_time && r.memory < best->memory) best = &r;
+	}
+
+	cout << endl << "fewest query distances: nroutes = " << fewest_ops->nroutes
+		 << ", leafcap = " << fewest_ops->leafcap << endl;
+	cout << "recommended: nroutes = " << best->nroutes << ", leafcap = " << best->leafcap
+		 << "   i.e. MTree<Key," << best->nroutes << "," << best->leafcap << ">" << endl;
+	cout << "-------------------------------------------------" << endl << endl;
+}
+
+int main(int argc, char **argv){
+
+	// metric: l2 over KEYLEN doubles, or hamming over 64-bit hashes
+	// N: number of entries to sample, default 100000
+	// file: raw binary keys (KEYLEN doubles or one uint64 each); uniform random when absent
+	const string metric = (argc > 1) ? argv[1] : "l2";
+	const int n_entries = (argc > 2) ? atoi(argv[2]) : 100000;
+	const string path = (argc > 3) ? argv[3] : "";
+
+	if (metric == "l2"){
+		do_tune<L2Key>(metric, path, n_entries);
+	} else if (metric == "hamming"){
+		do_tune<HammingKey>(metric, path, n_entries);
+	} else {
+		cout << "usage: " << argv[0] << " [l2|hamming] [N] [file]" << endl;
+		return 1;
+	}
+	return 0;
+}